@@ -20,14 +20,38 @@ SDL_Event event;
 SDL_Window* window;
 SDL_Renderer* renderer;
 SDL_Texture* texture;
-Mix_Chunk* soundBeep;
+SDL_AudioDeviceID audioDevice;
+SDL_atomic_t toneOn;  // written by the main loop, read by the audio callback
+uint32_t tonePhase;   // square wave phase, a full period is 2^32
+uint32_t toneStep;
+uint8_t tonePattern[16]; // XO-CHIP audio pattern, guarded by the audio device lock
+bool tonePatternOn;      // play tonePattern instead of the square wave
+uint32_t patternStep;    // tonePhase covers the 128 bits of the pattern
+int audioRate;
+const uint32_t palette[4] = BACKEND_PALETTE;
 TTF_Font* statusFont;
 SDL_Surface* statusSurface;
 SDL_Texture* statusTexture;
+SDL_Rect statusQuad;
+char shownStatus[STATUS_LENGTH]; // text currently rendered into statusTexture
+int8_t keymap[KEYMAP_SIZE];      // CHIP-8 key for each keycode, -1 if unmapped
 
 int video_init();
 int sound_init();
 int font_init();
+void tone_callback(void* userdata, Uint8* stream, int length);
+void update_status(char* statusString);
+
+const backend_t sdlBackend = {
+    .name = "sdl",
+    .paced = true,
+    .init = sdl_init,
+    .quit = sdl_quit,
+    .render = render_screen,
+    .tone = set_tone,
+    .input = get_input,
+    .set_keymap = set_keymap
+};
 
 void *pixels;
 int pitch;
@@ -41,7 +65,6 @@ int sdl_init(void) {
 
 int video_init() {
     texture = NULL;
-    soundBeep = NULL;
     
     if (SDL_Init(SDL_INIT_TIMER | SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
         { printf("\nSDL failed to initialize! Error: %s\n", SDL_GetError() ); return EXIT_FAILURE; }
@@ -51,29 +74,62 @@ int video_init() {
     if (window == NULL) { printf("\nSDL_Window failed to initialize! Error: %s\n", SDL_GetError() ); return EXIT_FAILURE; }
     else printf("SDL_Window, ");
 
-    renderer = SDL_CreateRenderer(window, 3, (SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC));
+    renderer = SDL_CreateRenderer(window, 3, SDL_RENDERER_ACCELERATED);
     if (renderer == NULL) { printf("\nSDL_Renderer failed to initialize! Error: %s\n", SDL_GetError() ); return EXIT_FAILURE; }
     else printf("SDL_Renderer initialized.\n");
 
     SDL_RenderSetScale(renderer,SCALE,SCALE);
-    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, SCREEN_WIDTH, SCREEN_HEIGHT);
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGB888, SDL_TEXTUREACCESS_STREAMING, SCREEN_MAX_WIDTH, SCREEN_MAX_HEIGHT);
 
     return EXIT_SUCCESS;
 }
 
+/*
+Opens an audio device that plays a square wave (or the XO-CHIP audio pattern) generated in tone_callback() while toneOn is set.
+The buffer is kept small so the tone starts and stops within a few milliseconds of the sound timer.
+*/
 int sound_init() {
-    if(Mix_OpenAudio( 44100, MIX_DEFAULT_FORMAT, 2, 2048 ) < 0)
-        { printf("\nSDL_mixer could not initialize! Error: %s\n", Mix_GetError() ); return EXIT_FAILURE; }
-    else printf("SDL2_mixer initialized, ");
+    SDL_AudioSpec wanted = { 0 }, obtained;
+    wanted.freq = AUDIO_RATE;
+    wanted.format = AUDIO_S16SYS;
+    wanted.channels = 1;
+    wanted.samples = AUDIO_SAMPLES;
+    wanted.callback = tone_callback;
 
-    soundBeep = Mix_LoadWAV(BEEP);
-    if (soundBeep == NULL) { printf("\nFailed to load sound file %s! Error: %s\n", BEEP, Mix_GetError() ); return EXIT_FAILURE; }
-    else printf("sound file \"%s\" loaded.\n", BEEP);
-    Mix_Volume(-1, MIX_MAX_VOLUME/10);
+    SDL_AtomicSet(&toneOn, 0);
+    tonePhase = 0;
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &wanted, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+    if (audioDevice == 0) { printf("\nAudio device could not be opened! Error: %s\n", SDL_GetError() ); return EXIT_FAILURE; }
+    else printf("Audio device opened (%i Hz, %i samples).\n", obtained.freq, obtained.samples);
 
+    audioRate = obtained.freq;
+    toneStep = (uint32_t)((double)TONE_FREQUENCY / audioRate * 4294967296.0);
+    SDL_PauseAudioDevice(audioDevice, 0);
     return EXIT_SUCCESS;
 }
 
+// runs on the audio thread, so it only reads toneOn and the pattern, which set_tone() changes under the device lock
+void tone_callback(void* userdata, Uint8* stream, int length) {
+    int16_t* samples = (int16_t*)stream;
+    int count = length / sizeof(int16_t);
+    if (!SDL_AtomicGet(&toneOn)) {
+        memset(stream, 0, length);
+        tonePhase = 0; // every tone starts on the same edge
+        return;
+    }
+    if (tonePatternOn) {
+        for (int i = 0; i < count; i++) {
+            samples[i] = (tonePattern[tonePhase >> 28] >> (7 - ((tonePhase >> 25) & 7))) & 1 ? TONE_VOLUME : -TONE_VOLUME;
+            tonePhase += patternStep;
+        }
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        samples[i] = tonePhase < 0x80000000u ? TONE_VOLUME : -TONE_VOLUME;
+        tonePhase += toneStep;
+    }
+}
+
 int font_init() {
     if (TTF_Init() < 0) { printf("\nTTF library failed to initialize! Error: %s\n", TTF_GetError() ); return EXIT_FAILURE; }
     else printf("SDL2_ttf initialized, ");
@@ -85,8 +141,8 @@ int font_init() {
 }
 
 void sdl_quit() {
-    Mix_FreeChunk(soundBeep);
-    soundBeep = NULL;
+    SDL_CloseAudioDevice(audioDevice);
+    audioDevice = 0;
     TTF_CloseFont(statusFont);
     statusFont = NULL;
     
@@ -97,100 +153,147 @@ void sdl_quit() {
     SDL_DestroyTexture(statusTexture);
 
     TTF_Quit();
-    Mix_Quit();
     SDL_Quit();
 }
 
-void play_beep() {
-    Mix_PlayChannel(-1, soundBeep, 0);
+// hands the tone over to tone_callback(), the pattern is only copied under the device lock when it changes
+void set_tone(bool on, const uint8_t* pattern, uint8_t pitch) {
+    static uint8_t shownPitch;
+    if ((pattern != NULL) != tonePatternOn || (pattern != NULL && (pitch != shownPitch || memcmp(pattern, tonePattern, 16) != 0))) {
+        SDL_LockAudioDevice(audioDevice);
+        tonePatternOn = pattern != NULL;
+        if (pattern != NULL) {
+            memcpy(tonePattern, pattern, 16);
+            patternStep = (uint32_t)(PATTERN_RATE * SDL_pow(2.0, (pitch - 64) / 48.0) / audioRate * 33554432.0); // 2^25 per bit
+            shownPitch = pitch;
+        }
+        SDL_UnlockAudioDevice(audioDevice);
+    }
+    SDL_AtomicSet(&toneOn, on);
 }
 
-void render_screen(uint8_t* screen, size_t screen_size, char* statusString) {
-    SDL_Color colorWhite = {255, 255, 255}; 
-    SDL_Rect renderQuad = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
-    uint8_t *pixelPointer;
-    
-    // update screen texture
-    SDL_LockTexture(texture, NULL, &pixels, &pitch);
-    for (int i = 0; i < screen_size; i++) {
-        pixelPointer = ((uint8_t *)pixels) + (i * 4);
-        memset(pixelPointer, screen[i]*COLOR_MAX, 3);
-    }
-    SDL_UnlockTexture(texture);
+/*
+Rasterizes [statusString] into statusTexture. Font rendering costs more than a whole emulated frame,
+so this is only called when the text changes.
+*/
+void update_status(char* statusString) {
+    SDL_Color colorWhite = {255, 255, 255};
 
-    
-    SDL_RenderClear(renderer);                            // clear window
-    SDL_RenderSetScale(renderer,SCALE,SCALE);             // set scaling factor for screen texture
-    SDL_RenderCopy(renderer, texture, NULL, &renderQuad); // copy screen texture to renderer
+    strncpy(shownStatus, statusString, STATUS_LENGTH - 1);
+    if (statusTexture != NULL) SDL_DestroyTexture(statusTexture);
+    statusTexture = NULL;
 
-    // render and copy status string to renderer
     statusSurface = TTF_RenderText_Blended_Wrapped(statusFont, statusString, colorWhite, SCREEN_WIDTH*SCALE);
+    if (statusSurface == NULL) return; // empty string
     statusTexture = SDL_CreateTextureFromSurface(renderer, statusSurface);
-    renderQuad.h = statusSurface->h;
-    renderQuad.w = statusSurface->w;
-    renderQuad.y = SCREEN_HEIGHT*SCALE;
-    SDL_RenderSetScale(renderer,1,1);
-    SDL_RenderCopy(renderer, statusTexture, NULL, &renderQuad);
-
-    SDL_DestroyTexture(statusTexture);
+    statusQuad = (SDL_Rect){ 0, SCREEN_HEIGHT*SCALE, statusSurface->w, statusSurface->h };
     SDL_FreeSurface(statusSurface);
+    statusSurface = NULL;
+}
+
+/*
+Uploads the rows set in [dirtyRows] that differ from what is currently on the window,
+then presents the frame. Does nothing if neither the screen nor the status string changed.
+[width] x [height] is the current resolution, scaled to fill the window.
+*/
+void render_screen(chip8_screen_t screen, int width, int height, uint64_t dirtyRows, char* statusString) {
+    static chip8_screen_t shownScreen;
+    static int shownWidth = 0;
+    SDL_Rect renderQuad = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+    SDL_Rect sourceQuad = { 0, 0, width, height };
+    SDL_Rect dirtyQuad;
+    uint32_t *pixelPointer;
+    int firstRow, lastRow;
+    bool statusChanged = strncmp(statusString, shownStatus, STATUS_LENGTH) != 0;
+    bool shownValid = shownWidth == width;
+
+    if (height < 64) dirtyRows &= (1ULL << height) - 1;
+    if (!shownValid) dirtyRows = height < 64 ? (1ULL << height) - 1 : ~0ULL; // texture contents are undefined until the first upload
+    for (int y = 0; y < height; y++) {
+        if (shownValid && memcmp(screen[0][y], shownScreen[0][y], sizeof(screen[0][y])) == 0 &&
+            memcmp(screen[1][y], shownScreen[1][y], sizeof(screen[1][y])) == 0) dirtyRows &= ~(1ULL << y); // changed back within one frame
+    }
+    if (dirtyRows == 0 && !statusChanged) return;
+    if (statusChanged) update_status(statusString);
+
+    // update the part of screen texture between the first and the last changed row
+    if (dirtyRows) {
+        firstRow = __builtin_ctzll(dirtyRows);
+        lastRow = 63 - __builtin_clzll(dirtyRows);
+        dirtyQuad = (SDL_Rect){ 0, firstRow, width, lastRow - firstRow + 1 };
+        SDL_LockTexture(texture, &dirtyQuad, &pixels, &pitch);
+        for (int y = firstRow; y <= lastRow; y++) {
+            pixelPointer = (uint32_t *)((uint8_t *)pixels + (y - firstRow) * pitch);
+            for (int x = 0; x < width; x++) {
+                pixelPointer[x] = palette[SCREEN_PIXEL(screen, 0, x, y) | SCREEN_PIXEL(screen, 1, x, y) << 1];
+            }
+            memcpy(shownScreen[0][y], screen[0][y], sizeof(screen[0][y]));
+            memcpy(shownScreen[1][y], screen[1][y], sizeof(screen[1][y]));
+        }
+        SDL_UnlockTexture(texture);
+        shownWidth = width;
+    }
+
+    SDL_RenderClear(renderer);                                   // clear window
+    SDL_RenderSetScale(renderer,SCALE,SCALE);                    // set scaling factor for screen texture
+    SDL_RenderCopy(renderer, texture, &sourceQuad, &renderQuad); // copy the part of screen texture in use to renderer
+
+    // copy cached status texture to renderer
+    SDL_RenderSetScale(renderer,1,1);
+    if (statusTexture != NULL) SDL_RenderCopy(renderer, statusTexture, NULL, &statusQuad);
 
     // render to window
     SDL_RenderPresent(renderer);
 }
 
-int get_input(uint8_t* input, uint8_t* extraFlag) {
-    if (SDL_PollEvent(&event)) {
-        if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
-            printf("\nExiting...\n");
-            return 1;
-        }
-        if (event.type == SDL_KEYDOWN) {
-            switch (event.key.keysym.sym) {
-                case SDLK_x: input[0x0] = 0xFF; break;
-                case SDLK_1: input[0x1] = 0xFF; break;
-                case SDLK_2: input[0x2] = 0xFF; break;
-                case SDLK_3: input[0x3] = 0xFF; break;
-                case SDLK_q: input[0x4] = 0xFF; break;
-                case SDLK_w: input[0x5] = 0xFF; break;
-                case SDLK_e: input[0x6] = 0xFF; break;
-                case SDLK_a: input[0x7] = 0xFF; break;
-                case SDLK_s: input[0x8] = 0xFF; break;
-                case SDLK_d: input[0x9] = 0xFF; break;
-                case SDLK_z: input[0xA] = 0xFF; break;
-                case SDLK_c: input[0xB] = 0xFF; break;
-                case SDLK_4: input[0xC] = 0xFF; break;
-                case SDLK_r: input[0xD] = 0xFF; break;
-                case SDLK_f: input[0xE] = 0xFF; break;
-                case SDLK_v: input[0xF] = 0xFF; break;
-                case SDLK_p: *extraFlag = 0xFF; break;
-                case SDLK_LEFTBRACKET: *extraFlag = 0xF0; break;
-                case SDLK_RIGHTBRACKET: *extraFlag = 0x0F; break;
-            }
+/*
+Maps the CHIP-8 keys 0-F, in that order, to the keyboard keys named by the characters of [keys].
+Returns 1 if [keys] isn't 16 distinct characters or uses a hotkey.
+*/
+int set_keymap(const char* keys) {
+    SDL_Keycode keycode;
+    char name[2] = { 0 };
+    if (strlen(keys) != 16) return 1;
+    memset(keymap, -1, sizeof(keymap));
+    for (int i = 0; i < 16; i++) {
+        name[0] = keys[i];
+        keycode = SDL_GetKeyFromName(name);
+        if (keycode <= 0 || keycode >= KEYMAP_SIZE || keymap[keycode] >= 0 || strchr(KEYMAP_RESERVED, keycode)) return 1;
+        keymap[keycode] = i;
+    }
+    return 0;
+}
+
+/*
+Drains all pending events, updating the [keys] bitmask (bit n set while CHIP-8 key n is held) and [extraFlag] for hotkeys.
+Returns 1 if the user asked to quit.
+*/
+int get_input(uint16_t* keys, uint8_t* extraFlag) {
+    SDL_Keycode keycode;
+    while (SDL_PollEvent(&event)) {
+        if (event.type == SDL_QUIT) { printf("\nExiting...\n"); return 1; }
+        if (event.type != SDL_KEYDOWN && event.type != SDL_KEYUP) continue;
+        keycode = event.key.keysym.sym;
+        if (keycode >= 0 && keycode < KEYMAP_SIZE && keymap[keycode] >= 0) {
+            if (event.type == SDL_KEYDOWN) *keys |= 1 << keymap[keycode];
+            else *keys &= ~(1 << keymap[keycode]);
+            continue;
         }
         if (event.type == SDL_KEYUP) {
-            switch (event.key.keysym.sym) {
-                case SDLK_x: input[0x0] = 0x00; break;
-                case SDLK_1: input[0x1] = 0x00; break;
-                case SDLK_2: input[0x2] = 0x00; break;
-                case SDLK_3: input[0x3] = 0x00; break;
-                case SDLK_q: input[0x4] = 0x00; break;
-                case SDLK_w: input[0x5] = 0x00; break;
-                case SDLK_e: input[0x6] = 0x00; break;
-                case SDLK_a: input[0x7] = 0x00; break;
-                case SDLK_s: input[0x8] = 0x00; break;
-                case SDLK_d: input[0x9] = 0x00; break;
-                case SDLK_z: input[0xA] = 0x00; break;
-                case SDLK_c: input[0xB] = 0x00; break;
-                case SDLK_4: input[0xC] = 0x00; break;
-                case SDLK_r: input[0xD] = 0x00; break;
-                case SDLK_f: input[0xE] = 0x00; break;
-                case SDLK_v: input[0xF] = 0x00; break;
-                case SDLK_p:
-                case SDLK_LEFTBRACKET:
-                case SDLK_RIGHTBRACKET: *extraFlag = 0x00; break;
-            }
+            if (keycode == SDLK_BACKSPACE && *extraFlag == 0xBB) *extraFlag = 0x00;
+            continue;
+        }
+        switch (keycode) {
+            case SDLK_ESCAPE: printf("\nExiting...\n"); return 1;
+            case SDLK_p: *extraFlag = 0xFF; break;
+            case SDLK_LEFTBRACKET: *extraFlag = 0xF0; break;
+            case SDLK_RIGHTBRACKET: *extraFlag = 0x0F; break;
+            case SDLK_TAB: *extraFlag = 0x01; break;
+            case SDLK_F5: *extraFlag = 0x05; break;
+            case SDLK_F9: *extraFlag = 0x09; break;
+            case SDLK_F7: *extraFlag = 0x07; break;
+            case SDLK_BACKSPACE: *extraFlag = 0xBB; break;
         }
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -18,22 +18,28 @@ Header file for SDL2-related functions
 #define SDL_H
 
 #include "common.h"
+#include "backend.h"
 #include <SDL2/SDL.h>
-#include <SDL2/SDL_mixer.h>
 #include <SDL2/SDL_ttf.h>
 
-#define COLOR_MAX 255
 #define SCALE 10
-#define BEEP "res/beep.wav"
 #define FONT "res/FreeSans.ttf"
+#define AUDIO_RATE 44100
+#define AUDIO_SAMPLES 256  // per callback, about 6 ms at 44.1 kHz
+#define TONE_FREQUENCY 440 // Hz
+#define TONE_VOLUME 3000   // square wave amplitude, out of 32767
+#define PATTERN_RATE 4000  // XO-CHIP audio pattern bits per second at pitch 64, doubling every 48 steps
+#define KEYMAP_SIZE 128    // keycodes of printable keys are their ASCII codes
+#define KEYMAP_RESERVED "p[]\t\b\x1b"  // hotkeys
 #define FONT_SIZE 25
 #define WINDOW_WIDTH 64
 #define WINDOW_HEIGHT 35
 
 int sdl_init();
 void sdl_quit();
-void play_beep();
-void render_screen(uint8_t* screen, size_t screen_size, char* statusString);
+void set_tone(bool on, const uint8_t* pattern, uint8_t pitch);
+void render_screen(chip8_screen_t screen, int width, int height, uint64_t dirtyRows, char* statusString);
 
-int get_input(uint8_t* input, uint8_t* extraFlag);
+int set_keymap(const char* keys);
+int get_input(uint16_t* keys, uint8_t* extraFlag);
 #endif
\ No newline at end of file
@@ -0,0 +1,227 @@
+/*
+Static ROM analyzer
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "analyze.h"
+#include "block.h"
+#include "disasm.h"
+#include "ops.h"
+
+#define BIT_TEST(map, bit) ((map)[(bit) >> 6] & (1ULL << ((bit) & 63)))
+#define BIT_SET(map, bit) ((map)[(bit) >> 6] |= (1ULL << ((bit) & 63)))
+
+#define INDEX_UNKNOWN -1
+
+// addresses waiting to be followed, each one is queued at most once
+typedef struct analyze_queue {
+    uint16_t* pending;
+    int count;
+    uint64_t queued[MEMORY_SIZE / 64];
+} analyze_queue_t;
+
+static void analyze_path(chip8_t* chip8, chip8_analysis_t* analysis, analyze_queue_t* queue, uint32_t address);
+static void analyze_push(chip8_analysis_t* analysis, analyze_queue_t* queue, uint32_t address);
+static void analyze_store(chip8_t* chip8, chip8_analysis_t* analysis, int index, int length);
+static uint16_t analyze_skip_target(chip8_t* chip8, uint16_t address);
+static uint8_t analyze_quirks(uint8_t handler);
+static void analyze_print_ranges(const uint64_t* map, const uint64_t* mask, uint32_t start, uint32_t end, FILE* out);
+
+/*
+Follows every path from PROGRAM_ADDRESS through the [length] bytes of ROM loaded in [chip8], decoded for its profile and quirks.
+Returns 1 if out of memory.
+*/
+int analyze_rom(chip8_t* chip8, size_t length, chip8_analysis_t* analysis) {
+    analyze_queue_t* queue = calloc(1, sizeof(analyze_queue_t));
+
+    memset(analysis, 0x0, sizeof(chip8_analysis_t));
+    analysis->start = PROGRAM_ADDRESS;
+    analysis->end = PROGRAM_ADDRESS + length;
+    if (queue == NULL || (queue->pending = malloc(MEMORY_SIZE * sizeof(uint16_t))) == NULL) { free(queue); return 1; }
+
+    analyze_push(analysis, queue, PROGRAM_ADDRESS);
+    while (queue->count > 0) analyze_path(chip8, analysis, queue, queue->pending[--queue->count]);
+
+    for (int i = 0; i < MEMORY_SIZE / 64; i++) {
+        if (analysis->written[i] & analysis->code[i]) analysis->flags |= ANALYSIS_SELF_MODIFYING;
+        analysis->blocks += __builtin_popcountll(analysis->leaders[i] & analysis->code[i]);
+    }
+    free(queue->pending);
+    free(queue);
+    return 0;
+}
+
+/*
+Prints the blocks of [analysis] with their successors and disassembly, the data ranges,
+what the analyzer couldn't follow and the quirks the ROM depends on.
+*/
+void analyze_print(chip8_t* chip8, const chip8_analysis_t* analysis, FILE* out) {
+    char text[DISASM_LENGTH], names[64];
+    int dataBytes = 0;
+    chip8_op_t op;
+
+    for (uint32_t i = analysis->start; i < analysis->end; i++) {
+        if (!BIT_TEST(analysis->code, i)) dataBytes++;
+    }
+    fprintf(out, "ROM %04X-%04X: %i instructions in %i blocks, %i bytes of data\n", analysis->start, analysis->end - 1,
+            analysis->instructions, analysis->blocks, dataBytes);
+
+    for (uint32_t leader = analysis->start; leader < analysis->end; leader++) {
+        uint32_t address = leader, last;
+        if (!BIT_TEST(analysis->leaders, leader) || !BIT_TEST(analysis->code, leader)) continue;
+        fprintf(out, "\nBlock %04X\n", leader);
+        do { // up to the next terminator, the next block or the end of the path
+            last = address;
+            chip8_decode((chip8->memory[address] << 8) | chip8->memory[address + 1], &op, chip8->profile, chip8->quirks);
+            address += disasm(chip8, address, text, sizeof(text));
+            fprintf(out, "  %04X  %02X%02X  %s\n", last, chip8->memory[last], chip8->memory[last + 1], text);
+        } while (!block_terminator(op.handler) && address < analysis->end && BIT_TEST(analysis->code, address) &&
+                 !BIT_TEST(analysis->leaders, address));
+
+        fprintf(out, "  ->");
+        switch (op.handler) {
+            case OP_JP: fprintf(out, " %04X\n", op.nnn); break;
+            case OP_CALL: fprintf(out, " %04X (call), %04X (return)\n", op.nnn, address); break;
+            case OP_RET: fprintf(out, " return\n"); break;
+            case OP_EXIT: fprintf(out, " exit\n"); break;
+            case OP_JP_V0: case OP_JP_VX: fprintf(out, " computed\n"); break;
+            case OP_SE_KK: case OP_SNE_KK: case OP_SE_XY: case OP_SNE_XY: case OP_SKP: case OP_SKNP:
+                fprintf(out, " %04X, %04X (skip)\n", address, analyze_skip_target(chip8, last));
+                break;
+            default:
+                if (address < analysis->end && BIT_TEST(analysis->code, address)) fprintf(out, " %04X\n", address);
+                else fprintf(out, " nothing, %s\n", address >= analysis->end ? "runs past the end of the ROM" : "illegal opcode");
+                break;
+        }
+    }
+
+    fprintf(out, "\nData:");
+    analyze_print_ranges(analysis->code, NULL, analysis->start, analysis->end, out);
+    if (analysis->flags & ANALYSIS_SELF_MODIFYING) {
+        fprintf(out, "Self-modifying: stores write to code at");
+        analyze_print_ranges(analysis->written, analysis->code, 0, analysis->end, out);
+    }
+    if (analysis->flags & ANALYSIS_UNKNOWN_STORE) fprintf(out, "Stores through an I set at run time can write anywhere, code included\n");
+    if (analysis->flags & ANALYSIS_COMPUTED_JUMP) fprintf(out, "Computed jumps (Bnnn) aren't followed, code only reached through them shows up as data\n");
+    if (analysis->flags & ANALYSIS_OUTSIDE_ROM) fprintf(out, "Control flow leaves the ROM\n");
+    if (analysis->flags & ANALYSIS_ILLEGAL) fprintf(out, "Paths run into illegal opcodes, probably data after a skip or call\n");
+    fprintf(out, "Quirks that matter: %s\n", analysis->quirks ? chip8_quirks_name(analysis->quirks, names, sizeof(names)) : "none");
+    fprintf(out, "Suggested engine: %s\n", analysis->flags & ANALYSIS_SELF_MODIFYING ? "interpreter (self-modifying code)" : "block");
+}
+
+/*
+Analyzes the [length] bytes of ROM loaded in [chip8] and builds the blocks of its control-flow graph in the block engine,
+called right after loading. Returns the number of blocks built, or -1 if out of memory.
+*/
+int analyze_preload(chip8_t* chip8, size_t length) {
+    chip8_analysis_t* analysis = malloc(sizeof(chip8_analysis_t));
+    int built = -1;
+    if (analysis != NULL && chip8->blocks != NULL && analyze_rom(chip8, length, analysis) == 0) built = block_preload(chip8, analysis->leaders);
+    free(analysis);
+    return built;
+}
+
+// follows one path from [address] until it jumps, returns, branches or runs into code that was already followed
+static void analyze_path(chip8_t* chip8, chip8_analysis_t* analysis, analyze_queue_t* queue, uint32_t address) {
+    int index = INDEX_UNKNOWN; // I, while the path itself set it
+    int size;
+    chip8_op_t op;
+
+    // 32 bits, so a path running off the top of XO-CHIP's address space ends there instead of wrapping to 0
+    for (;;) {
+        if (address < analysis->start || address + 1 >= analysis->end) { analysis->flags |= ANALYSIS_OUTSIDE_ROM; return; }
+        if (BIT_TEST(analysis->code, address)) return;
+        chip8_decode((chip8->memory[address] << 8) | chip8->memory[address + 1], &op, chip8->profile, chip8->quirks);
+        if (op.handler == OP_ILLEGAL) { analysis->flags |= ANALYSIS_ILLEGAL; return; }
+        size = op.handler == OP_LD_I_LONG ? 4 : 2;
+        if (address + size > analysis->end) { analysis->flags |= ANALYSIS_OUTSIDE_ROM; return; } // F000 nnnn cut off by the end
+        for (int i = 0; i < size; i++) BIT_SET(analysis->code, address + i);
+        analysis->instructions++;
+        analysis->quirks |= analyze_quirks(op.handler);
+
+        switch (op.handler) {
+            case OP_JP: analyze_push(analysis, queue, op.nnn); return;
+            case OP_CALL: analyze_push(analysis, queue, op.nnn); analyze_push(analysis, queue, address + 2); return;
+            case OP_RET: case OP_EXIT: return;
+            case OP_JP_V0: case OP_JP_VX: analysis->flags |= ANALYSIS_COMPUTED_JUMP; return;
+            case OP_SE_KK: case OP_SNE_KK: case OP_SE_XY: case OP_SNE_XY: case OP_SKP: case OP_SKNP:
+                analyze_push(analysis, queue, address + 2);
+                analyze_push(analysis, queue, analyze_skip_target(chip8, address));
+                return;
+            case OP_LD_I: index = op.nnn; break;
+            case OP_LD_I_LONG: index = (chip8->memory[(address + 2) & chip8->addressMask] << 8) | chip8->memory[(address + 3) & chip8->addressMask]; break;
+            case OP_ADD_I: case OP_LD_F: case OP_LD_HF: index = INDEX_UNKNOWN; break;
+            case OP_LD_B: analyze_store(chip8, analysis, index, 3); break;
+            case OP_LD_MEM_KEEP: analyze_store(chip8, analysis, index, op.x + 1); break;
+            case OP_SAVE: analyze_store(chip8, analysis, index, (op.x <= op.y ? op.y - op.x : op.x - op.y) + 1); break;
+            case OP_LD_MEM:
+                analyze_store(chip8, analysis, index, op.x + 1);
+                if (index != INDEX_UNKNOWN) index += op.x + 1;
+                break;
+            case OP_LD_REG:
+                if (index != INDEX_UNKNOWN) index += op.x + 1;
+                break;
+        }
+        address += size;
+        if (block_terminator(op.handler) && address < analysis->end) BIT_SET(analysis->leaders, address); // falls through into a new block
+    }
+}
+
+// marks [address] as the start of a block and queues it, unless it was queued before
+static void analyze_push(chip8_analysis_t* analysis, analyze_queue_t* queue, uint32_t address) {
+    if (address < analysis->start || address + 1 >= analysis->end) { analysis->flags |= ANALYSIS_OUTSIDE_ROM; return; }
+    BIT_SET(analysis->leaders, address);
+    if (BIT_TEST(queue->queued, address)) return;
+    BIT_SET(queue->queued, address);
+    queue->pending[queue->count++] = address;
+}
+
+static void analyze_store(chip8_t* chip8, chip8_analysis_t* analysis, int index, int length) {
+    if (index == INDEX_UNKNOWN) { analysis->flags |= ANALYSIS_UNKNOWN_STORE; return; }
+    for (int i = 0; i < length; i++) BIT_SET(analysis->written, (index + i) & chip8->addressMask);
+}
+
+// where a skip at [address] goes when taken, past a 4 byte F000 nnnn on XO-CHIP, see chip8_skip()
+static uint16_t analyze_skip_target(chip8_t* chip8, uint16_t address) {
+    uint16_t next = address + 2;
+    if (chip8->profile == PROFILE_XOCHIP && chip8->memory[next & chip8->addressMask] == 0xF0 &&
+        chip8->memory[(next + 1) & chip8->addressMask] == 0x00) return next + 4;
+    return next + 2;
+}
+
+// the quirk that changes what an instruction with [handler] does, 0 if none
+static uint8_t analyze_quirks(uint8_t handler) {
+    switch (handler) {
+        case OP_SHR: case OP_SHL: case OP_SHR_X: case OP_SHL_X: return QUIRK_SHIFT;
+        case OP_LD_MEM: case OP_LD_REG: case OP_LD_MEM_KEEP: case OP_LD_REG_KEEP: return QUIRK_LOAD_STORE;
+        case OP_JP_V0: case OP_JP_VX: return QUIRK_JUMP;
+        case OP_OR: case OP_AND: case OP_XOR: case OP_OR_VF: case OP_AND_VF: case OP_XOR_VF: return QUIRK_VF_RESET;
+        case OP_DRW: case OP_DRW_CLIP: return QUIRK_CLIP;
+        default: return 0;
+    }
+}
+
+// prints the ranges of addresses from [start] to [end] that are clear in [map], or set in both [map] and [mask] if given
+static void analyze_print_ranges(const uint64_t* map, const uint64_t* mask, uint32_t start, uint32_t end, FILE* out) {
+    uint32_t first;
+    bool any = false;
+    for (uint32_t i = start; i < end; i++) {
+        if (mask == NULL ? BIT_TEST(map, i) != 0 : !(BIT_TEST(map, i) && BIT_TEST(mask, i))) continue;
+        for (first = i; i + 1 < end && (mask == NULL ? !BIT_TEST(map, i + 1) : BIT_TEST(map, i + 1) && BIT_TEST(mask, i + 1)); i++);
+        if (i > first) fprintf(out, " %04X-%04X", first, i);
+        else fprintf(out, " %04X", first);
+        any = true;
+    }
+    fprintf(out, "%s\n", any ? "" : " none");
+}
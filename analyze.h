@@ -0,0 +1,48 @@
+/*
+Header file for the static ROM analyzer
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include "cpu.h"
+
+#define ANALYSIS_COMPUTED_JUMP  0x01 // Bnnn, its targets aren't followed
+#define ANALYSIS_SELF_MODIFYING 0x02 // Fx33/Fx55/5xy2 with a known I write to code
+#define ANALYSIS_UNKNOWN_STORE  0x04 // Fx33/Fx55/5xy2 with an I the analyzer can't tell
+#define ANALYSIS_OUTSIDE_ROM    0x08 // control flow leaves the ROM
+#define ANALYSIS_ILLEGAL        0x10 // an illegal opcode on a path, which is likely data
+
+/*
+Control-flow graph of a ROM, found by following every path from PROGRAM_ADDRESS through jumps, calls and skips
+without running it. Blocks end where the block engine ends them (see block_terminator()), so [leaders] can be
+handed to block_preload(). Bytes of the ROM that no path reaches are data, as far as the analyzer can tell:
+code only reached through Bnnn or a return address pushed by hand looks like data too.
+*/
+typedef struct chip8_analysis {
+    uint64_t code[MEMORY_SIZE / 64];    // bytes of reachable instructions
+    uint64_t leaders[MEMORY_SIZE / 64]; // first instruction of every block
+    uint64_t written[MEMORY_SIZE / 64]; // bytes written by stores with a known I
+    uint32_t start, end;                // the ROM, [end] is past its last byte
+    int flags;                          // ANALYSIS_* bits
+    uint8_t quirks;                     // QUIRK_* bits whose instructions are reachable, the ones this ROM cares about
+    int instructions;
+    int blocks;
+} chip8_analysis_t;
+
+int analyze_rom(chip8_t* chip8, size_t length, chip8_analysis_t* analysis);
+void analyze_print(chip8_t* chip8, const chip8_analysis_t* analysis, FILE* out);
+int analyze_preload(chip8_t* chip8, size_t length);
+#endif
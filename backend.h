@@ -0,0 +1,74 @@
+/*
+Header file for the frontend backend interface
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "common.h"
+
+#define KEYMAP_DEFAULT "x123qweasdzc4rfv" // keys 0-F
+#define BACKEND_PALETTE { 0x000000, 0xFFFFFF, 0xAAAAAA, 0x555555 } // XRGB, indexed by plane bits
+
+/*
+Video, audio and input of the interactive mode. main.c only talks to the machine through one of these,
+so the core and the main loop don't depend on any library. Functions are called from the main thread.
+*/
+typedef struct backend {
+    const char* name;
+    bool paced; // the main loop waits for the next 60 Hz frame, otherwise frames run back to back
+    int (*init)(void); // returns 1 on failure
+    void (*quit)(void);
+    /*
+    Presents one frame, called every emulated frame. [dirtyRows] has bit n set if row n changed since the last call,
+    [width] x [height] is the current resolution.
+    */
+    void (*render)(chip8_screen_t screen, int width, int height, uint64_t dirtyRows, char* statusString);
+    /*
+    The tone plays for as long as [on] stays set, called every frame with the sound timer state.
+    [pattern] is the XO-CHIP audio pattern played at [pitch] instead of the square wave, NULL for the square wave.
+    */
+    void (*tone)(bool on, const uint8_t* pattern, uint8_t pitch);
+    /*
+    Updates the [keys] bitmask (bit n set while CHIP-8 key n is held) and [extraFlag] for hotkeys.
+    Returns 1 if the run should end.
+    */
+    int (*input)(uint16_t* keys, uint8_t* extraFlag);
+    int (*set_keymap)(const char* keys); // NULL if the backend has no keyboard, returns 1 if [keys] can't be used
+} backend_t;
+
+#ifndef NO_SDL
+extern const backend_t sdlBackend; // SDL.c, window, keyboard and audio device
+#endif
+extern const backend_t offscreenBackend; // offscreen.c, see offscreen_set_target()
+
+#define OFFSCREEN_MAGIC "C8FB"
+
+/*
+Start of the shared memory object, followed by the frame. [sequence] is odd while the frame is being
+written: a reader copies the frame, and retries if [sequence] was odd or changed in the meantime.
+*/
+typedef struct offscreen_header {
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t sequence;
+    uint64_t frames; // presented so far, advances every emulated frame
+    uint8_t tone;    // sound timer running
+    uint8_t reserved[7];
+} offscreen_header_t;
+
+int offscreen_set_target(const char* target);
+#endif
@@ -0,0 +1,307 @@
+/*
+Lock-step batch engine
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "batch.h"
+#include "ops.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+Vectors are GCC generic vectors the size of an AVX2 register, used by the clone of batch_run() picked
+at load time on CPUs that have AVX2. Without it GCC splits them up, and mostly into single elements.
+An instruction is executed for a group of lanes by computing the new value for every lane and blending
+it in under the group's mask. 8-bit results are cut back to 8 bits wherever they could carry into the
+upper half of their element, and compared as signed, which x86 compares natively.
+*/
+#define BLEND(mask, value, old) (((value) & (mask)) | ((old) & ~(mask)))
+#define BROADCAST(value) ((batch_u16){} + (uint16_t)(value))
+#define TRUTH(comparison) ((batch_u16)(comparison)) // all ones where it holds
+#define LANE_MASK(lanes) TRUTH((BROADCAST(lanes) & laneBit) != 0) // all ones in the lanes that have their bit set in [lanes]
+
+typedef int16_t batch_s16 __attribute__((vector_size(BATCH_LANES * 2)));
+
+static const batch_u16 laneBit = { 0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80, 0x100, 0x200, 0x400, 0x800, 0x1000, 0x2000, 0x4000, 0x8000 };
+
+static void gather(chip8_batch_t* batch);
+static void scatter(chip8_batch_t* batch);
+static inline void store_lane(chip8_batch_t* batch, int lane);
+static inline void load_lane(chip8_batch_t* batch, int lane);
+
+chip8_batch_t* batch_create() {
+    chip8_batch_t* batch = aligned_alloc(64, sizeof(chip8_batch_t));
+    if (batch != NULL) memset(batch, 0x0, sizeof(chip8_batch_t));
+    return batch;
+}
+
+/*
+Adds a machine that was reset and loaded like the ones already in the batch: the profile, quirks, clock
+and frame cycle remainder have to match the first lane's, the clock has to be below BATCH_MAX_CLOCK and
+the machine has to be between frames.
+Returns the lane index, or -1 if the batch is full or the machine doesn't fit.
+*/
+int batch_add(chip8_batch_t* batch, chip8_t* chip8) {
+    chip8_t* first = batch->lanes[0];
+    if (batch->count == BATCH_LANES || chip8->cpuClock >= BATCH_MAX_CLOCK || chip8->slotsLeft != 0) return -1;
+    if (first != NULL && (chip8->profile != first->profile || chip8->quirks != first->quirks ||
+                          chip8->cpuClock != first->cpuClock || chip8->frameCycles != first->frameCycles)) return -1;
+    if (first != NULL && memcmp(chip8->memory, first->memory, chip8->addressMask + 1) != 0) batch->diverged |= 1u << batch->count;
+    batch->lanes[batch->count] = chip8;
+    return batch->count++;
+}
+
+void batch_free(chip8_batch_t* batch) {
+    free(batch);
+}
+
+// bit n is set if element n of [mask] is set, the elements being all ones or all zeros
+static inline __attribute__((always_inline)) uint32_t mask_bits(const batch_u16* mask) {
+#ifdef __SSE2__
+    __m128i part[2];
+    memcpy(part, mask, sizeof(part));
+    return _mm_movemask_epi8(_mm_packs_epi16(part[0], part[1]));
+#else
+    uint32_t bits = 0;
+    for (int i = 0; i < BATCH_LANES; i++) bits |= (uint32_t)((*mask)[i] & 1) << i;
+    return bits;
+#endif
+}
+
+// drops the lanes of [group] whose instruction at [pc] differs from [leader]'s because one of them wrote to memory
+static inline uint32_t same_code(chip8_batch_t* batch, uint32_t group, int leader, uint16_t pc) {
+    uint32_t check = batch->diverged >> leader & 1 ? group & ~(1u << leader) : group & batch->diverged;
+    const uint8_t* code = batch->lanes[leader]->memory + pc;
+    while (check) {
+        int lane = __builtin_ctz(check);
+        check &= check - 1;
+        if (memcmp(batch->lanes[lane]->memory + pc, code, 2) != 0) group &= ~(1u << lane);
+    }
+    return group;
+}
+
+// instructions that only touch what is kept in the batch, or the stack, and don't need chip8_skip()'s XO-CHIP lookahead
+static inline bool vector_handler(uint8_t handler, chip8_profile_t profile) {
+    switch (handler) {
+        case OP_SE_KK: case OP_SNE_KK: case OP_SE_XY: case OP_SNE_XY: case OP_SKP: case OP_SKNP:
+            return profile != PROFILE_XOCHIP;
+        case OP_NOP: case OP_RET: case OP_JP: case OP_CALL: case OP_LD_KK: case OP_ADD_KK: case OP_LD_XY:
+        case OP_OR: case OP_AND: case OP_XOR: case OP_ADD_XY: case OP_SUB: case OP_SHR: case OP_SUBN: case OP_SHL:
+        case OP_LD_I: case OP_JP_V0: case OP_RND: case OP_LD_X_DT: case OP_LD_DT: case OP_LD_ST: case OP_ADD_I:
+        case OP_LD_F: case OP_LD_HF: case OP_OR_VF: case OP_AND_VF: case OP_XOR_VF: case OP_SHR_X: case OP_SHL_X: case OP_JP_VX:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// executes [op] for the lanes in [mask] at once, mirroring the handlers in ops.h
+static inline __attribute__((always_inline)) void execute_group(chip8_batch_t* batch, const chip8_op_t* op, const batch_u16* mask) {
+    batch_u16 m = *mask;
+    batch_u16* v = batch->registers;
+    batch_u16 x = v[op->x], y = v[op->y], taken = {}, high, low, key; // skip instructions set [taken] in the lanes that skip
+    batch_u16 pc = batch->programCounter;
+
+    switch (op->handler) {
+        case OP_NOP: break;
+        case OP_RET:
+            for (uint32_t lanes = mask_bits(mask); lanes; lanes &= lanes - 1) {
+                chip8_t* chip8 = batch->lanes[__builtin_ctz(lanes)];
+                pc[__builtin_ctz(lanes)] = chip8->stack[chip8->stackPointer & 0xF];
+                chip8->stackPointer--;
+            }
+            break;
+        case OP_JP: pc = BLEND(m, BROADCAST(op->nnn - 2), pc); break;
+        case OP_CALL:
+            for (uint32_t lanes = mask_bits(mask); lanes; lanes &= lanes - 1) {
+                chip8_t* chip8 = batch->lanes[__builtin_ctz(lanes)];
+                chip8->stackPointer++;
+                chip8->stack[chip8->stackPointer & 0xF] = pc[__builtin_ctz(lanes)];
+            }
+            pc = BLEND(m, BROADCAST(op->nnn - 2), pc);
+            break;
+        case OP_SE_KK: taken = TRUTH(x == op->kk); break;
+        case OP_SNE_KK: taken = TRUTH(x != op->kk); break;
+        case OP_SE_XY: taken = TRUTH(x == y); break;
+        case OP_SNE_XY: taken = TRUTH(x != y); break;
+        case OP_SKP:
+        case OP_SKNP:
+            key = x & 0xF;
+            for (int i = 0; i < 16; i++) taken |= batch->keyDown[i] & TRUTH(key == (uint16_t)i); // there are no 16-bit variable shifts before AVX-512
+            if (op->handler == OP_SKNP) taken = ~taken;
+            break;
+        case OP_LD_KK: v[op->x] = BLEND(m, BROADCAST(op->kk), x); break;
+        case OP_ADD_KK: v[op->x] = (x + (m & op->kk)) & 0xFF; break;
+        case OP_LD_XY: v[op->x] = BLEND(m, y, x); break;
+        case OP_OR: v[op->x] = BLEND(m, x | y, x); break;
+        case OP_AND: v[op->x] = BLEND(m, x & y, x); break;
+        case OP_XOR: v[op->x] = BLEND(m, x ^ y, x); break;
+        case OP_OR_VF: v[op->x] = BLEND(m, x | y, x); v[0xF] &= ~m; break;
+        case OP_AND_VF: v[op->x] = BLEND(m, x & y, x); v[0xF] &= ~m; break;
+        case OP_XOR_VF: v[op->x] = BLEND(m, x ^ y, x); v[0xF] &= ~m; break;
+        case OP_ADD_XY:
+            v[0xF] = BLEND(m, (x + y) >> 8, v[0xF]);
+            v[op->x] = BLEND(m, (x + y) & 0xFF, v[op->x]);
+            break;
+        case OP_SUB:
+            v[0xF] = BLEND(m, TRUTH((batch_s16)x > (batch_s16)y) & 1, v[0xF]);
+            v[op->x] = BLEND(m, (v[op->x] - v[op->y]) & 0xFF, v[op->x]); // VF may be either operand by now
+            break;
+        case OP_SUBN:
+            v[0xF] = BLEND(m, TRUTH((batch_s16)y > (batch_s16)x) & 1, v[0xF]);
+            v[op->x] = BLEND(m, (v[op->y] - v[op->x]) & 0xFF, v[op->x]);
+            break;
+        case OP_SHR: v[op->x] = BLEND(m, y >> 1, x); v[0xF] = BLEND(m, y & 1, v[0xF]); break;
+        case OP_SHL: v[op->x] = BLEND(m, (y << 1) & 0xFF, x); v[0xF] = BLEND(m, y >> 7, v[0xF]); break;
+        case OP_SHR_X: v[op->x] = BLEND(m, x >> 1, x); v[0xF] = BLEND(m, x & 1, v[0xF]); break;
+        case OP_SHL_X: v[op->x] = BLEND(m, (x << 1) & 0xFF, x); v[0xF] = BLEND(m, x >> 7, v[0xF]); break;
+        case OP_LD_I: batch->indexRegister = BLEND(m, BROADCAST(op->nnn), batch->indexRegister); break;
+        case OP_JP_V0: pc = BLEND(m, v[0] + (uint16_t)(op->nnn - 2), pc); break;
+        case OP_JP_VX: pc = BLEND(m, x + (uint16_t)(op->nnn - 2), pc); break;
+        case OP_RND: // chip8_random() on the halves of the state
+            high = batch->rngHigh;
+            low = batch->rngLow;
+            high ^= (high << 13) | (low >> 3);
+            low ^= low << 13;
+            low ^= high >> 1;
+            high ^= (high << 5) | (low >> 11);
+            low ^= low << 5;
+            batch->rngHigh = BLEND(m, high, batch->rngHigh);
+            batch->rngLow = BLEND(m, low, batch->rngLow);
+            v[op->x] = BLEND(m, (high >> 8) & op->kk, x);
+            break;
+        case OP_LD_X_DT: v[op->x] = BLEND(m, batch->delayTimer, x); break;
+        case OP_LD_DT: batch->delayTimer = BLEND(m, x, batch->delayTimer); break;
+        case OP_LD_ST: batch->soundTimer = BLEND(m, x, batch->soundTimer); break;
+        case OP_ADD_I: batch->indexRegister += x & m; break;
+        case OP_LD_F: batch->indexRegister = BLEND(m, x * 5, batch->indexRegister); break;
+        case OP_LD_HF: batch->indexRegister = BLEND(m, (x & 0xF) * 10 + BIG_FONT_ADDRESS, batch->indexRegister); break;
+    }
+    batch->programCounter = pc + (m & 2) + (taken & m & 2);
+}
+
+/*
+Runs [frameLimit] emulated frames (0 - until every lane halted) on every lane, each one executing exactly what
+chip8_run() would. Returns 1 if every lane halted, 0 if the frame limit was reached.
+*/
+__attribute__((target_clones("avx2", "default")))
+int batch_run(chip8_batch_t* batch, unsigned long frameLimit) {
+    chip8_t* first = batch->lanes[0];
+    chip8_t* pace;
+    uint32_t alive = 0, pending, group;
+    batch_u16 mask, test, slotsUsed, vectorCycles, live;
+    const chip8_op_t* op;
+    int slots, leader;
+    uint16_t pc;
+
+    if (batch->count == 0) return 1;
+    for (int i = 0; i < batch->count; i++) {
+        if (!batch->lanes[i]->cpuHalted) alive |= 1u << i;
+        else chip8_run(batch->lanes[i], 0, frameLimit); // runs into the halt again right away
+    }
+    gather(batch);
+    for (unsigned long frame = 0; alive && (frameLimit == 0 || frame < frameLimit); frame++) {
+        // running lanes share the clock and remainder, see batch_add(), halted ones keep theirs
+        pace = batch->lanes[__builtin_ctz(alive)];
+        slots = (pace->frameCycles + pace->cpuClock) / TIMER_CLOCK;
+        pending = slots > 0 ? alive : 0;
+        for (uint32_t lanes = alive; lanes; lanes &= lanes - 1) {
+            chip8_t* chip8 = batch->lanes[__builtin_ctz(lanes)];
+            chip8->frameCycles = (chip8->frameCycles + chip8->cpuClock) % TIMER_CLOCK;
+            if (chip8->waitForKey) pending &= ~(1u << __builtin_ctz(lanes)); // the slots pass without executing anything
+        }
+        slotsUsed = vectorCycles = (batch_u16){};
+
+        while (pending) {
+            leader = __builtin_ctz(pending);
+            pc = batch->programCounter[leader];
+            test = TRUTH(batch->programCounter == pc);
+            group = mask_bits(&test) & pending;
+            if (pc > first->addressMask - 1) op = NULL; // chip8_step() halts them
+            else {
+                group = same_code(batch, group, leader, pc);
+                op = chip8_fetch(batch->lanes[leader], pc);
+            }
+            mask = LANE_MASK(group);
+            if (op != NULL && vector_handler(op->handler, first->profile)) {
+                execute_group(batch, op, &mask);
+                vectorCycles -= mask; // all ones, so one more per lane
+                batch->groupSteps++;
+            } else {
+                for (uint32_t lanes = group; lanes; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    chip8_t* chip8 = batch->lanes[lane];
+                    store_lane(batch, lane);
+                    chip8_step(chip8);
+                    load_lane(batch, lane);
+                    if (chip8->cpuHalted) alive &= ~(1u << lane);
+                    if (chip8->cpuHalted || chip8->waitForKey) pending &= ~(1u << lane);
+                    batch->scalarSteps++;
+                }
+                if (op != NULL && (op->handler == OP_LD_B || op->handler == OP_LD_MEM || op->handler == OP_LD_MEM_KEEP || op->handler == OP_SAVE)) {
+                    batch->diverged |= group;
+                }
+            }
+            slotsUsed -= mask;
+            test = TRUTH(slotsUsed == (uint16_t)slots);
+            pending &= ~mask_bits(&test);
+        }
+
+        // timers tick and the frame counts for every lane that didn't halt during the frame
+        live = LANE_MASK(alive);
+        batch->delayTimer += TRUTH(batch->delayTimer != 0) & live;
+        batch->soundTimer += TRUTH(batch->soundTimer != 0) & live;
+        for (int i = 0; i < batch->count; i++) {
+            batch->lanes[i]->cycles += vectorCycles[i];
+            if (alive >> i & 1) batch->lanes[i]->frames++;
+        }
+    }
+    scatter(batch);
+    return alive == 0;
+}
+
+// copies the state kept in the batch out of every lane
+static void gather(chip8_batch_t* batch) {
+    for (int lane = 0; lane < batch->count; lane++) {
+        load_lane(batch, lane);
+        for (int i = 0; i < 16; i++) batch->keyDown[i][lane] = batch->lanes[lane]->keys >> i & 1 ? 0xFFFF : 0;
+    }
+}
+
+// puts the state kept in the batch back into every lane
+static void scatter(chip8_batch_t* batch) {
+    for (int lane = 0; lane < batch->count; lane++) store_lane(batch, lane);
+}
+
+static inline void store_lane(chip8_batch_t* batch, int lane) {
+    chip8_t* chip8 = batch->lanes[lane];
+    for (int i = 0; i < 16; i++) chip8->registers[i] = batch->registers[i][lane];
+    chip8->programCounter = batch->programCounter[lane];
+    chip8->indexRegister = batch->indexRegister[lane];
+    chip8->delayTimer = batch->delayTimer[lane];
+    chip8->soundTimer = batch->soundTimer[lane];
+    chip8->rngState = (uint32_t)batch->rngHigh[lane] << 16 | batch->rngLow[lane];
+}
+
+static inline void load_lane(chip8_batch_t* batch, int lane) {
+    chip8_t* chip8 = batch->lanes[lane];
+    for (int i = 0; i < 16; i++) batch->registers[i][lane] = chip8->registers[i];
+    batch->programCounter[lane] = chip8->programCounter;
+    batch->indexRegister[lane] = chip8->indexRegister;
+    batch->delayTimer[lane] = chip8->delayTimer;
+    batch->soundTimer[lane] = chip8->soundTimer;
+    batch->rngHigh[lane] = chip8->rngState >> 16;
+    batch->rngLow[lane] = chip8->rngState;
+}
@@ -0,0 +1,59 @@
+/*
+Header file for the lock-step batch engine
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "cpu.h"
+
+#define BATCH_LANES 16 // one AVX2 register of 16-bit elements
+#define BATCH_MAX_CLOCK (TIMER_CLOCK * 0xFFFF) // Hz, instruction slots per frame are counted in 16 bits
+
+typedef uint16_t batch_u16 __attribute__((vector_size(BATCH_LANES * 2)));
+
+/*
+Up to BATCH_LANES machines running the same program, usually with different seeds or keys.
+While batch_run() runs, the registers, PC, I, timers and random number generator state of all lanes
+live here structure-of-arrays style, one vector per field with one element per lane, and lanes that are
+at the same PC execute the instruction there together: ALU, skip, jump and timer instructions as vector
+operations, calls and returns lane by lane. Everything else (drawing, memory access, key waits) is handed
+to chip8_step() one lane at a time. Lanes that took different branches run in separate groups until
+their PCs meet again.
+Every field is kept in 16-bit elements, 8-bit registers included, so no instruction has to convert
+between element sizes.
+Outside of batch_run() every lane is an ordinary chip8_t, e.g. for chip8_set_keys() or chip8_checksum().
+*/
+typedef struct chip8_batch {
+    batch_u16 registers[16];
+    batch_u16 programCounter;
+    batch_u16 indexRegister;
+    batch_u16 delayTimer;
+    batch_u16 soundTimer;
+    batch_u16 rngHigh;    // rngState, split in halves
+    batch_u16 rngLow;
+    batch_u16 keyDown[16]; // all ones in the lanes that hold key n
+    uint16_t diverged;    // bit n is set once lane n wrote to memory, so its code may differ from the other lanes'
+    int count;
+    chip8_t* lanes[BATCH_LANES]; // memory, stack, screen and everything else
+    unsigned long groupSteps;  // instructions executed for a whole group of lanes at once
+    unsigned long scalarSteps; // instructions handed to chip8_step()
+} __attribute__((aligned(64))) chip8_batch_t;
+
+chip8_batch_t* batch_create();
+int batch_add(chip8_batch_t* batch, chip8_t* chip8);
+int batch_run(chip8_batch_t* batch, unsigned long frameLimit);
+void batch_free(chip8_batch_t* batch);
+#endif
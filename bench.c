@@ -0,0 +1,370 @@
+/*
+Benchmark for the CHIP-8 core
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "common.h"
+#include <errno.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "ops.h"
+#include "movie.h"
+#include "batch.h"
+
+#define BENCH_VERSION 1
+#define BENCH_BUDGET 200 // ms of host time per measurement, default
+#define BENCH_FRAMES 600 // emulated frames per workload run, 10 s at 60 fps
+#define BENCH_BATCH 1024 // instructions per timed batch in opcode measurements
+#define BENCH_MAX_WORKLOADS 64
+
+typedef struct bench_workload {
+    const char* name;
+    uint8_t rom[MEMORY_SIZE - PROGRAM_ADDRESS];
+    int romLength;
+    chip8_movie_t* movie; // input fed every frame, NULL if the workload reads no keys
+    unsigned long frames;
+} bench_workload_t;
+
+typedef struct bench_result {
+    unsigned long instructions;
+    unsigned long frames;
+    double seconds;
+    bool frameTimed; // false for the batch engine, which steps all lanes together and doesn't time frames
+    double frameP50; // ns of host time per emulated frame
+    double frameP99;
+    double frameMax;
+    uint32_t checksum; // after one run, to catch behavioral changes along with speed ones
+} bench_result_t;
+
+typedef struct bench_op {
+    const char* name;
+    uint16_t first;
+    uint16_t second; // executed alternately with the first one, e.g. a return after a call
+} bench_op_t;
+
+/*
+Synthetic ROMs, each loops forever over one kind of work:
+    alu     - 8xyN arithmetic and logic, 7xkk and a skip
+    sprite  - Dxy5 with font glyphs at moving coordinates
+    memcopy - Fx65 and Fx55 over 16 registers and Fx33
+    keywait - Fx0A, fed by a key that is pressed and released every other frame
+    branchy - Cxkk picks one of two paths every iteration, so copies with different seeds keep splitting up
+*/
+static const uint16_t aluROM[] = { 0x6001, 0x6103, 0x8014, 0x8105, 0x8013, 0x8011, 0x8016, 0x810E, 0x8012, 0x7007, 0x3000, 0x1204 };
+static const uint16_t spriteROM[] = { 0x6000, 0x6100, 0xF229, 0xD015, 0x7003, 0x7105, 0x7201, 0x1204 };
+static const uint16_t memcopyROM[] = { 0xA300, 0xFF65, 0x7001, 0xA400, 0xFF55, 0xA410, 0xF033, 0x1200 };
+static const uint16_t keywaitROM[] = { 0xF10A, 0xE19E, 0x1200, 0x7201, 0x1200 };
+static const uint16_t branchyROM[] = { 0xC001, 0x3000, 0x120C, 0x7101, 0x8124, 0x1200, 0x7201, 0x8214, 0x1200 };
+
+// opcode classes measured one instruction at a time through chip8_decode_execute()
+static const bench_op_t benchOps[] = {
+    { "load", 0x6A2B, 0x6A2B },     // 6xkk
+    { "add", 0x7A03, 0x7A03 },      // 7xkk
+    { "alu", 0x8014, 0x8125 },      // 8xy4, 8xy5
+    { "shift", 0x8016, 0x810E },    // 8xy6, 8xyE
+    { "skip", 0x3AFF, 0x5010 },     // 3xkk, 5xy0, not taken
+    { "jump", 0x1300, 0x1300 },     // 1nnn
+    { "call", 0x2300, 0x00EE },     // 2nnn, 00EE
+    { "index", 0xA300, 0xF01E },    // Annn, Fx1E
+    { "random", 0xC0FF, 0xC0FF },   // Cxkk
+    { "draw", 0xD015, 0xD125 },     // Dxyn
+    { "key", 0xE09E, 0xE0A1 },      // Ex9E, ExA1
+    { "timer", 0xF015, 0xF007 },    // Fx15, Fx07
+    { "bcd", 0xF033, 0xF033 },      // Fx33
+    { "store", 0xFF55, 0xFF55 },    // Fx55
+    { "restore", 0xFF65, 0xFF65 },  // Fx65
+};
+
+static void add_synthetic(bench_workload_t* workload, const char* name, const uint16_t* program, int length);
+static chip8_movie_t* keywait_movie(unsigned long frames);
+static int add_replay(bench_workload_t* workload, const char* romPath, const char* moviePath);
+static void run_workload(bench_workload_t* workload, chip8_engine_t engine, double budget, bench_result_t* result);
+static void run_batch(bench_workload_t* workload, double budget, bench_result_t* result);
+static double run_op(const bench_op_t* op, double budget);
+static double run_draw_sprite(double budget);
+static double now(void);
+static int compare_double(const void* a, const void* b);
+void print_usage();
+
+int main(int argc, char* argv[]) {
+    static bench_workload_t workloads[BENCH_MAX_WORKLOADS];
+    static const chip8_engine_t engines[] = { ENGINE_INTERPRETER, ENGINE_BLOCK };
+    static const char* engineNames[] = { "interpreter", "block", "batch" }; // batch runs BATCH_LANES seeds of workloads without input
+    bench_result_t result;
+    int count = 0;
+    double budget = BENCH_BUDGET / 1000.0;
+    double ns;
+    char* outputPath = NULL;
+    FILE* out = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "o:t:")) != -1) {
+        switch (opt) {
+            case 'o': outputPath = optarg; break;
+            case 't': budget = atoi(optarg) / 1000.0; break;
+            default: print_usage(); return 1;
+        }
+    }
+    if ((argc - optind) % 2 != 0 || budget <= 0) { print_usage(); return 1; }
+
+    add_synthetic(&workloads[count++], "alu", aluROM, sizeof(aluROM) / 2);
+    add_synthetic(&workloads[count++], "sprite", spriteROM, sizeof(spriteROM) / 2);
+    add_synthetic(&workloads[count++], "memcopy", memcopyROM, sizeof(memcopyROM) / 2);
+    add_synthetic(&workloads[count], "keywait", keywaitROM, sizeof(keywaitROM) / 2);
+    if ((workloads[count++].movie = keywait_movie(BENCH_FRAMES)) == NULL) { printf("Out of memory\n"); return 1; }
+    add_synthetic(&workloads[count++], "branchy", branchyROM, sizeof(branchyROM) / 2);
+    for (int i = optind; i < argc && count < BENCH_MAX_WORKLOADS; i += 2) {
+        if (!add_replay(&workloads[count], argv[i], argv[i + 1])) return 1;
+        count++;
+    }
+
+    if (outputPath != NULL) {
+        out = strcmp(outputPath, "-") == 0 ? stdout : fopen(outputPath, "w");
+        if (out == NULL) { printf("Failed to open \"%s\": %s\n", outputPath, strerror(errno)); return 1; }
+        fprintf(out, "{\"version\":%i,\"cpu_clock\":%i,\"budget_ms\":%.0f,\"workloads\":[", BENCH_VERSION, CPU_CLOCK, budget * 1000.0);
+    }
+    if (out != stdout) printf("%-12s %-12s %14s %10s %12s %10s %10s %10s %9s\n",
+                              "workload", "engine", "instructions/s", "ns/instr", "frames/s", "frame p50", "frame p99", "frame max", "checksum");
+    for (int i = 0; i < count; i++) {
+        for (int e = 0; e < sizeof(engineNames) / sizeof(engineNames[0]); e++) {
+            if (e < sizeof(engines) / sizeof(engines[0])) run_workload(&workloads[i], engines[e], budget, &result);
+            else if (workloads[i].movie == NULL) run_batch(&workloads[i], budget, &result);
+            else continue;
+            if (out != stdout) {
+                printf("%-12s %-12s %14.0f %10.2f %12.0f ", workloads[i].name, engineNames[e], result.instructions / result.seconds,
+                       result.instructions ? result.seconds * 1e9 / result.instructions : 0.0, result.frames / result.seconds);
+                if (result.frameTimed) printf("%8.0fns %8.0fns %8.0fns", result.frameP50, result.frameP99, result.frameMax);
+                else printf("%10s %10s %10s", "-", "-", "-");
+                printf("  %08X\n", result.checksum);
+            }
+            if (out != NULL) {
+                fprintf(out, "%s{\"name\":\"%s\",\"engine\":\"%s\",\"instructions\":%lu,\"frames\":%lu,\"seconds\":%.6f,"
+                             "\"instructions_per_second\":%.0f,\"ns_per_instruction\":%.3f,\"frames_per_second\":%.0f,",
+                        i == 0 && e == 0 ? "" : ",", workloads[i].name, engineNames[e], result.instructions, result.frames, result.seconds,
+                        result.instructions / result.seconds, result.instructions ? result.seconds * 1e9 / result.instructions : 0.0,
+                        result.frames / result.seconds);
+                if (result.frameTimed) fprintf(out, "\"frame_ns_p50\":%.0f,\"frame_ns_p99\":%.0f,\"frame_ns_max\":%.0f,",
+                                               result.frameP50, result.frameP99, result.frameMax);
+                fprintf(out, "\"checksum\":\"%08X\"}", result.checksum);
+            }
+        }
+    }
+
+    if (out != stdout) printf("\n%-12s %10s\n", "opcode", "ns/instr");
+    if (out != NULL) fprintf(out, "],\"ops\":{");
+    for (int i = 0; i < sizeof(benchOps) / sizeof(benchOps[0]); i++) {
+        ns = run_op(&benchOps[i], budget);
+        if (out != stdout) printf("%-12s %10.2f\n", benchOps[i].name, ns);
+        if (out != NULL) fprintf(out, "%s\"%s\":%.3f", i == 0 ? "" : ",", benchOps[i].name, ns);
+    }
+    ns = run_draw_sprite(budget);
+    if (out != stdout) printf("%-12s %10.2f\n", "draw_sprite", ns);
+    if (out != NULL) {
+        fprintf(out, ",\"draw_sprite\":%.3f}}\n", ns);
+        if (out != stdout && fclose(out) != 0) { printf("Failed to write \"%s\": %s\n", outputPath, strerror(errno)); return 1; }
+    }
+
+    for (int i = 0; i < count; i++) movie_free(workloads[i].movie);
+    return 0;
+}
+
+static void add_synthetic(bench_workload_t* workload, const char* name, const uint16_t* program, int length) {
+    workload->name = name;
+    for (int i = 0; i < length; i++) {
+        workload->rom[i * 2] = program[i] >> 8;
+        workload->rom[i * 2 + 1] = program[i] & 0xFF;
+    }
+    workload->romLength = length * 2;
+    workload->frames = BENCH_FRAMES;
+}
+
+// key 1 goes down on even frames and up on odd ones, like a movie recorded by someone tapping it
+static chip8_movie_t* keywait_movie(unsigned long frames) {
+    chip8_movie_t* movie = calloc(1, sizeof(chip8_movie_t));
+    if (movie == NULL) return NULL;
+    if ((movie->events = malloc(sizeof(movie_event_t) * frames)) == NULL) { free(movie); return NULL; }
+    for (unsigned long i = 0; i < frames; i++) movie->events[i] = (movie_event_t){ i, 0x1, i % 2 == 0 };
+    movie->count = movie->capacity = frames;
+    movie->cpuClock = CPU_CLOCK;
+    movie->finished = true;
+    movie->endFrame = frames;
+    return movie;
+}
+
+// a recorded ROM and movie, run from reset to the end of the movie
+static int add_replay(bench_workload_t* workload, const char* romPath, const char* moviePath) {
+    chip8_t* chip8 = calloc(1, sizeof(chip8_t));
+    long length;
+    if (chip8 == NULL) return 0;
+    if ((workload->movie = movie_open(moviePath)) == NULL) { free(chip8); return 0; }
+    if (chip8_set_profile(chip8, workload->movie->profile)) { printf("Out of memory\n"); exit(1); } // decides how big a ROM fits
+    chip8_reset(chip8, 0);
+    length = chip8_load_file(chip8, romPath);
+    if (length < 0) { printf("Failed to load ROM file \"%s\": %s\n", romPath, strerror(errno)); chip8_free(chip8); free(chip8); return 0; }
+    memcpy(workload->rom, chip8->memory + PROGRAM_ADDRESS, length);
+    chip8_free(chip8);
+    free(chip8);
+    workload->name = moviePath;
+    workload->romLength = length;
+    workload->frames = workload->movie->finished ? workload->movie->endFrame : workload->movie->count ? workload->movie->events[workload->movie->count - 1].frame + 1 : 0;
+    if (workload->frames == 0) { printf("Movie \"%s\" is empty\n", moviePath); return 0; }
+    return 1;
+}
+
+/*
+Runs [workload] from reset, feeding its movie before every frame, until [budget] seconds of host time have been spent.
+One more run times every frame separately for the latency percentiles; it is not included in the throughput.
+*/
+static void run_workload(bench_workload_t* workload, chip8_engine_t engine, double budget, bench_result_t* result) {
+    chip8_t* chip8 = calloc(1, sizeof(chip8_t));
+    double* frameTimes = malloc(sizeof(double) * workload->frames);
+    double start, frameStart;
+    bool timeFrames = true;
+    memset(result, 0, sizeof(bench_result_t));
+    if (chip8 == NULL || frameTimes == NULL || chip8_set_engine(chip8, engine)) { printf("Out of memory\n"); exit(1); }
+
+    while (timeFrames || result->seconds < budget) {
+        if (chip8_set_profile(chip8, workload->movie != NULL ? workload->movie->profile : PROFILE_CHIP8)) { printf("Out of memory\n"); exit(1); }
+        chip8_reset(chip8, workload->movie != NULL ? workload->movie->quirks : 0);
+        chip8_seed(chip8, workload->movie != NULL ? workload->movie->seed : RNG_SEED);
+        chip8->cpuClock = workload->movie != NULL ? workload->movie->cpuClock : CPU_CLOCK;
+        memcpy(chip8->memory + PROGRAM_ADDRESS, workload->rom, workload->romLength);
+        if (workload->movie != NULL) workload->movie->position = 0;
+
+        start = now();
+        for (unsigned long frame = 0; frame < workload->frames && !chip8->cpuHalted; frame++) {
+            if (timeFrames) frameStart = now();
+            if (workload->movie != NULL) movie_feed(workload->movie, chip8);
+            chip8_run(chip8, 0, 1);
+            if (timeFrames) frameTimes[frame] = (now() - frameStart) * 1e9;
+        }
+        if (timeFrames && chip8->frames > 0) {
+            qsort(frameTimes, chip8->frames, sizeof(double), compare_double);
+            result->frameTimed = true;
+            result->frameP50 = frameTimes[chip8->frames / 2];
+            result->frameP99 = frameTimes[chip8->frames * 99 / 100];
+            result->frameMax = frameTimes[chip8->frames - 1];
+        }
+        if (timeFrames) {
+            result->checksum = chip8_checksum(chip8);
+            timeFrames = false;
+            continue;
+        }
+        result->seconds += now() - start;
+        result->instructions += chip8->cycles;
+        result->frames += chip8->frames;
+    }
+    chip8_free(chip8);
+    free(chip8);
+    free(frameTimes);
+}
+
+/*
+Runs BATCH_LANES copies of [workload] seeded RNG_SEED, RNG_SEED + 1 and so on through batch_run() until [budget] seconds
+of host time have been spent. Instructions and frames are summed over the lanes, frames aren't timed one by one.
+The checksum is the first lane's, which runs exactly like the single machine of the other engines.
+*/
+static void run_batch(bench_workload_t* workload, double budget, bench_result_t* result) {
+    chip8_t* lanes = calloc(BATCH_LANES, sizeof(chip8_t));
+    chip8_batch_t* batch;
+    double start;
+    memset(result, 0, sizeof(bench_result_t));
+    if (lanes == NULL) { printf("Out of memory\n"); exit(1); }
+
+    while (result->seconds < budget) {
+        if ((batch = batch_create()) == NULL) { printf("Out of memory\n"); exit(1); }
+        for (int i = 0; i < BATCH_LANES; i++) {
+            if (chip8_set_profile(&lanes[i], PROFILE_CHIP8)) { printf("Out of memory\n"); exit(1); }
+            chip8_reset(&lanes[i], 0);
+            chip8_seed(&lanes[i], RNG_SEED + i);
+            lanes[i].cpuClock = CPU_CLOCK;
+            memcpy(lanes[i].memory + PROGRAM_ADDRESS, workload->rom, workload->romLength);
+            batch_add(batch, &lanes[i]);
+        }
+        start = now();
+        batch_run(batch, workload->frames);
+        result->seconds += now() - start;
+        for (int i = 0; i < BATCH_LANES; i++) {
+            result->instructions += lanes[i].cycles;
+            result->frames += lanes[i].frames;
+        }
+        result->checksum = chip8_checksum(&lanes[0]);
+        batch_free(batch);
+    }
+    for (int i = 0; i < BATCH_LANES; i++) chip8_free(&lanes[i]);
+    free(lanes);
+}
+
+// ns per instruction of [op] executed through the uncached decode path
+static double run_op(const bench_op_t* op, double budget) {
+    chip8_t* chip8 = calloc(1, sizeof(chip8_t));
+    double start, elapsed = 0;
+    unsigned long executed = 0;
+    if (chip8 == NULL || chip8_set_profile(chip8, PROFILE_CHIP8)) { printf("Out of memory\n"); exit(1); }
+    chip8_reset(chip8, 0);
+    chip8->registers[0x0] = 5;
+    chip8->registers[0x1] = 7;
+    while (elapsed < budget) {
+        chip8->indexRegister = 0x300; // Fx55/Fx65/Fx1E move I
+        chip8->stackPointer = 0;
+        start = now();
+        for (int i = 0; i < BENCH_BATCH; i += 2) {
+            chip8_decode_execute(chip8, op->first);
+            chip8_decode_execute(chip8, op->second);
+        }
+        elapsed += now() - start;
+        executed += BENCH_BATCH;
+    }
+    chip8_free(chip8);
+    free(chip8);
+    return elapsed * 1e9 / executed;
+}
+
+// ns per 8-row sprite drawn at coordinates that cycle through every alignment
+static double run_draw_sprite(double budget) {
+    chip8_t* chip8 = calloc(1, sizeof(chip8_t));
+    double start, elapsed = 0;
+    unsigned long drawn = 0;
+    if (chip8 == NULL || chip8_set_profile(chip8, PROFILE_CHIP8)) { printf("Out of memory\n"); exit(1); }
+    chip8_reset(chip8, 0);
+    chip8->indexRegister = 0x0; // font
+    while (elapsed < budget) {
+        start = now();
+        for (int i = 0; i < BENCH_BATCH; i++) draw_sprite(chip8, i * 7, i * 3, 8);
+        elapsed += now() - start;
+        drawn += BENCH_BATCH;
+    }
+    chip8_free(chip8);
+    free(chip8);
+    return elapsed * 1e9 / drawn;
+}
+
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_usage() {
+    printf("chip8bench - benchmark for the chip8emu core.\nUsage: chip8bench [options] [romfile movie]...\n\n"
+           " Runs the built-in synthetic workloads (ALU, sprites, memory copy, key wait) and any given ROM/movie pairs\n"
+           " from reset with both engines, then times single instructions per opcode class and draw_sprite().\n\n"
+           " Options:\n  -o <file>  also write the results as JSON to a file, '-' for stdout only\n"
+           "  -t <ms>    host time per measurement (default: %i)\n\n", BENCH_BUDGET);
+}
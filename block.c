@@ -0,0 +1,260 @@
+/*
+Basic block execution engine
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "block.h"
+#include "ops.h"
+#include "metrics.h"
+
+#define BIT_TEST(map, bit) ((map)[(bit) >> 6] & (1ULL << ((bit) & 63)))
+#define BIT_SET(map, bit) ((map)[(bit) >> 6] |= (1ULL << ((bit) & 63)))
+
+static int block_build(chip8_t* chip8, chip8_blocks_t* blocks, uint16_t start);
+
+chip8_blocks_t* block_create() {
+    chip8_blocks_t* blocks = malloc(sizeof(chip8_blocks_t));
+    if (blocks == NULL) return NULL;
+    blocks->extent = MEMORY_SIZE;
+    block_flush(blocks, true);
+    return blocks;
+}
+
+// drops all cached blocks, and the self-modifying code marks too if [forgetSelfModified] is set (new program loaded)
+void block_flush(chip8_blocks_t* blocks, bool forgetSelfModified) {
+    memset(blocks->covered, 0x0, (blocks->extent + 63) / 64 * sizeof(uint64_t));
+    memset(blocks->index, 0x0, blocks->extent * sizeof(uint16_t));
+    blocks->extent = 0;
+    blocks->arenaUsed = 0;
+    if (forgetSelfModified) memset(blocks->selfModified, 0x0, sizeof(blocks->selfModified));
+}
+
+// called for every memory write made by the program, see chip8_invalidate()
+void block_invalidate(chip8_blocks_t* blocks, uint16_t address, uint16_t length) {
+    bool hit = false;
+    for (uint32_t i = address; i < (uint32_t)address + length && i < MEMORY_SIZE; i++) {
+        if (BIT_TEST(blocks->covered, i)) {
+            BIT_SET(blocks->selfModified, i);
+            hit = true;
+        }
+    }
+    // The arena is only reset, not freed, so the block that did the write can safely finish:
+    // Fx33, Fx55 and 5xy2 always end a block, so nothing is read from it after the handler returns.
+    if (hit) block_flush(blocks, false);
+}
+
+/*
+Executes up to [slots] instructions, block by block, with the handlers from ops.h
+dispatched by computed goto. Produces exactly the same state as running chip8_step() [slots] times.
+Returns 1 if the CPU halted.
+*/
+int block_run(chip8_t* chip8, int slots) {
+    static const void* const labels[OP_COUNT] = {
+        [OP_ILLEGAL] = &&illegal, [OP_NOP] = &&nop, [OP_CLS] = &&cls, [OP_RET] = &&ret,
+        [OP_JP] = &&jp, [OP_CALL] = &&call, [OP_SE_KK] = &&se_kk, [OP_SNE_KK] = &&sne_kk,
+        [OP_SE_XY] = &&se_xy, [OP_LD_KK] = &&ld_kk, [OP_ADD_KK] = &&add_kk, [OP_LD_XY] = &&ld_xy,
+        [OP_OR] = &&or, [OP_AND] = &&and, [OP_XOR] = &&xor, [OP_ADD_XY] = &&add_xy,
+        [OP_SUB] = &&sub, [OP_SHR] = &&shr, [OP_SUBN] = &&subn, [OP_SHL] = &&shl,
+        [OP_SNE_XY] = &&sne_xy, [OP_LD_I] = &&ld_i, [OP_JP_V0] = &&jp_v0, [OP_RND] = &&rnd,
+        [OP_DRW] = &&drw, [OP_SKP] = &&skp, [OP_SKNP] = &&sknp, [OP_LD_X_DT] = &&ld_x_dt,
+        [OP_LD_K] = &&ld_k, [OP_LD_DT] = &&ld_dt, [OP_LD_ST] = &&ld_st, [OP_ADD_I] = &&add_i,
+        [OP_LD_F] = &&ld_f, [OP_LD_B] = &&ld_b, [OP_LD_MEM] = &&ld_mem, [OP_LD_REG] = &&ld_reg,
+        [OP_SCD] = &&scd, [OP_SCR] = &&scr, [OP_SCL] = &&scl, [OP_EXIT] = &&exit,
+        [OP_LOW] = &&low, [OP_HIGH] = &&high, [OP_LD_HF] = &&ld_hf, [OP_LD_R] = &&ld_r,
+        [OP_LD_X_R] = &&ld_x_r, [OP_SCU] = &&scu, [OP_SAVE] = &&save, [OP_LOAD] = &&load,
+        [OP_LD_I_LONG] = &&ld_i_long, [OP_PLANE] = &&plane, [OP_AUDIO] = &&audio, [OP_PITCH] = &&pitch,
+        [OP_OR_VF] = &&or_vf, [OP_AND_VF] = &&and_vf, [OP_XOR_VF] = &&xor_vf, [OP_SHR_X] = &&shr_x,
+        [OP_SHL_X] = &&shl_x, [OP_JP_VX] = &&jp_vx, [OP_DRW_CLIP] = &&drw_clip,
+        [OP_LD_MEM_KEEP] = &&ld_mem_keep, [OP_LD_REG_KEEP] = &&ld_reg_keep
+    };
+    chip8_blocks_t* blocks = chip8->blocks;
+    const chip8_op_t* op;
+    const chip8_op_t* end;
+    uint16_t pc;
+    int count;
+
+    while (slots > 0) {
+        pc = chip8->programCounter;
+        if (pc > chip8->addressMask - 1) {
+            chip8->cpuHalted = true;
+            printf("\nCPU halted: PC exceeded memory limits\n");
+            return 1;
+        }
+        if (chip8->waitForKey) return 0; // nothing can press a key until chip8_run() returns, the remaining slots are spent waiting
+
+        if (blocks->index[pc] == 0 && !block_build(chip8, blocks, pc)) {
+            chip8_decode_execute(chip8, (chip8->memory[pc] << 8) | chip8->memory[pc + 1]);
+            chip8->cycles++;
+            slots--;
+            continue;
+        }
+        op = &blocks->arena[blocks->index[pc] - 1];
+        count = blocks->length[pc] < slots ? blocks->length[pc] : slots;
+        end = op + count;
+        if (chip8->metrics != NULL) {
+            for (int i = 0; i < count; i++) chip8->metrics->ops[op[i].handler]++;
+        }
+        goto *labels[op->handler];
+
+#define HANDLER(label, function) label: function(chip8, op); goto next;
+        HANDLER(illegal, op_illegal)
+        HANDLER(nop, op_nop)
+        HANDLER(cls, op_cls)
+        HANDLER(ret, op_ret)
+        HANDLER(jp, op_jp)
+        HANDLER(call, op_call)
+        HANDLER(se_kk, op_se_kk)
+        HANDLER(sne_kk, op_sne_kk)
+        HANDLER(se_xy, op_se_xy)
+        HANDLER(ld_kk, op_ld_kk)
+        HANDLER(add_kk, op_add_kk)
+        HANDLER(ld_xy, op_ld_xy)
+        HANDLER(or, op_or)
+        HANDLER(and, op_and)
+        HANDLER(xor, op_xor)
+        HANDLER(add_xy, op_add_xy)
+        HANDLER(sub, op_sub)
+        HANDLER(shr, op_shr)
+        HANDLER(subn, op_subn)
+        HANDLER(shl, op_shl)
+        HANDLER(sne_xy, op_sne_xy)
+        HANDLER(ld_i, op_ld_i)
+        HANDLER(jp_v0, op_jp_v0)
+        HANDLER(rnd, op_rnd)
+        HANDLER(drw, op_drw)
+        HANDLER(skp, op_skp)
+        HANDLER(sknp, op_sknp)
+        HANDLER(ld_x_dt, op_ld_x_dt)
+        HANDLER(ld_k, op_ld_k)
+        HANDLER(ld_dt, op_ld_dt)
+        HANDLER(ld_st, op_ld_st)
+        HANDLER(add_i, op_add_i)
+        HANDLER(ld_f, op_ld_f)
+        HANDLER(ld_b, op_ld_b)
+        HANDLER(ld_mem, op_ld_mem)
+        HANDLER(ld_reg, op_ld_reg)
+        HANDLER(scd, op_scd)
+        HANDLER(scr, op_scr)
+        HANDLER(scl, op_scl)
+        HANDLER(exit, op_exit)
+        HANDLER(low, op_low)
+        HANDLER(high, op_high)
+        HANDLER(ld_hf, op_ld_hf)
+        HANDLER(ld_r, op_ld_r)
+        HANDLER(ld_x_r, op_ld_x_r)
+        HANDLER(scu, op_scu)
+        HANDLER(save, op_save)
+        HANDLER(load, op_load)
+        HANDLER(ld_i_long, op_ld_i_long)
+        HANDLER(plane, op_plane)
+        HANDLER(audio, op_audio)
+        HANDLER(pitch, op_pitch)
+        HANDLER(or_vf, op_or_vf)
+        HANDLER(and_vf, op_and_vf)
+        HANDLER(xor_vf, op_xor_vf)
+        HANDLER(shr_x, op_shr_x)
+        HANDLER(shl_x, op_shl_x)
+        HANDLER(jp_vx, op_jp_vx)
+        HANDLER(drw_clip, op_drw_clip)
+        HANDLER(ld_mem_keep, op_ld_mem_keep)
+        HANDLER(ld_reg_keep, op_ld_reg_keep)
+#undef HANDLER
+    next:
+        chip8->programCounter += 2;
+        if (++op < end) goto *labels[op->handler];
+        chip8->cycles += count;
+        slots -= count;
+        if (chip8->cpuHalted) return 1; // 00FD, always the last instruction of its block
+    }
+    return 0;
+}
+
+/*
+Builds the blocks starting at every address set in [leaders] up front, so running the program finds them cached
+instead of decoding each one the first time it is reached. The blocks are the ones block_run() would build there,
+so execution is unchanged. Stops when the arena is full. Returns the number of blocks built.
+*/
+int block_preload(chip8_t* chip8, const uint64_t* leaders) {
+    chip8_blocks_t* blocks = chip8->blocks;
+    uint32_t start;
+    int built = 0, length;
+
+    for (uint32_t address = 0; address < chip8->addressMask; address++) {
+        if (!BIT_TEST(leaders, address)) continue;
+        // straight-line code longer than a block continues in the block right after it
+        for (start = address; start < chip8->addressMask && blocks->index[start] == 0; start += length * 2) {
+            if (blocks->arenaUsed + BLOCK_MAX_LENGTH > BLOCK_ARENA_SIZE) return built; // block_build() would flush what was built so far
+            if ((length = block_build(chip8, blocks, start)) == 0) break;
+            built++;
+            if (length < BLOCK_MAX_LENGTH || block_terminator(blocks->arena[blocks->index[start] + length - 2].handler)) break;
+        }
+    }
+    return built;
+}
+
+// decodes the block starting at [start] into the arena, returns its length (0 if [start] is self-modifying code)
+static int block_build(chip8_t* chip8, chip8_blocks_t* blocks, uint16_t start) {
+    chip8_op_t* op;
+    uint16_t address = start;
+    uint32_t end;
+    int length = 0;
+
+    if (blocks->arenaUsed + BLOCK_MAX_LENGTH > BLOCK_ARENA_SIZE) block_flush(blocks, false);
+    op = &blocks->arena[blocks->arenaUsed];
+
+    while (length < BLOCK_MAX_LENGTH && address < chip8->addressMask) {
+        if (BIT_TEST(blocks->selfModified, address) || BIT_TEST(blocks->selfModified, address + 1)) break;
+        chip8_decode((chip8->memory[address] << 8) | chip8->memory[address + 1], op, chip8->profile, chip8->quirks);
+        BIT_SET(blocks->covered, address);
+        BIT_SET(blocks->covered, address + 1);
+        length++;
+        address += 2;
+        if (block_terminator((op++)->handler)) break;
+    }
+    if (length == 0) return 0;
+
+    blocks->index[start] = blocks->arenaUsed + 1;
+    blocks->length[start] = length;
+    end = (uint32_t)start + length * 2; // past the top of XO-CHIP's address space if the block wraps around to 0
+    if (end > blocks->extent) blocks->extent = end > MEMORY_SIZE ? MEMORY_SIZE : end;
+    blocks->arenaUsed += length;
+    return length;
+}
+
+// true if a block ends after an instruction with [handler], see chip8_blocks_t
+bool block_terminator(uint8_t handler) {
+    switch (handler) {
+        case OP_RET:
+        case OP_JP:
+        case OP_CALL:
+        case OP_SE_KK:
+        case OP_SNE_KK:
+        case OP_SE_XY:
+        case OP_SNE_XY:
+        case OP_JP_V0:
+        case OP_JP_VX:
+        case OP_SKP:
+        case OP_SKNP:
+        case OP_LD_K:
+        case OP_LD_B:
+        case OP_LD_MEM:
+        case OP_LD_MEM_KEEP:
+        case OP_EXIT:
+        case OP_SAVE:
+        case OP_LD_I_LONG: // its operand isn't an instruction
+            return true;
+        default:
+            return false;
+    }
+}
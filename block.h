@@ -0,0 +1,47 @@
+/*
+Header file for the basic block execution engine
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "cpu.h"
+
+#define BLOCK_MAX_LENGTH 64
+#define BLOCK_ARENA_SIZE 8192 // decoded instructions shared by all cached blocks
+
+/*
+Straight-line runs of instructions, cached by start address. A block ends after the first
+instruction that can change the control flow (jumps, calls, returns, skips, Fx0A) or write
+to memory (Fx33, Fx55). Code that gets overwritten after it was cached is marked as
+self-modifying, and is executed one instruction at a time by chip8_decode_execute() from then on.
+*/
+typedef struct chip8_blocks {
+    uint64_t covered[MEMORY_SIZE / 64];      // bytes that belong to at least one cached block
+    uint64_t selfModified[MEMORY_SIZE / 64]; // bytes that were overwritten after being cached
+    uint16_t index[MEMORY_SIZE];             // arena offset + 1 of the block starting at address, 0 if none
+    uint8_t length[MEMORY_SIZE];
+    uint32_t extent; // no cached block reaches this address, so block_flush() only clears [covered] and [index] below it
+    int arenaUsed;
+    chip8_op_t arena[BLOCK_ARENA_SIZE];
+} chip8_blocks_t;
+
+chip8_blocks_t* block_create();
+void block_flush(chip8_blocks_t* blocks, bool forgetSelfModified);
+void block_invalidate(chip8_blocks_t* blocks, uint16_t address, uint16_t length);
+int block_run(chip8_t* chip8, int slots);
+int block_preload(chip8_t* chip8, const uint64_t* leaders);
+bool block_terminator(uint8_t handler);
+#endif
@@ -4,7 +4,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
 
-#define SCREEN_WIDTH 64
+#define SCREEN_WIDTH 64       // CHIP-8, and the low resolution of SUPER-CHIP and XO-CHIP
 #define SCREEN_HEIGHT 32
+#define SCREEN_MAX_WIDTH 128  // SUPER-CHIP and XO-CHIP high resolution
+#define SCREEN_MAX_HEIGHT 64
+#define SCREEN_WORDS (SCREEN_MAX_WIDTH / 64)
+#define SCREEN_PLANES 2       // XO-CHIP bit planes, the other machines only use the first one
+#define STATUS_LENGTH 64
+
+/*
+The framebuffer is [plane][row][word], 64 pixels per word with the leftmost one in the most significant bit.
+In low resolution only the first word of the first SCREEN_HEIGHT rows is used.
+*/
+typedef uint64_t chip8_screen_t[SCREEN_PLANES][SCREEN_MAX_HEIGHT][SCREEN_WORDS];
+#define SCREEN_PIXEL(screen, plane, x, y) (((screen)[plane][y][(x) >> 6] >> (63 - ((x) & 63))) & 0x1)
 #endif
\ No newline at end of file
@@ -15,43 +15,65 @@ CHIP-8 interpreter
 */
 
 #include "cpu.h"
-#include <sys/time.h>
+#include "ops.h"
+#include "block.h"
+#include "metrics.h"
+#include "trace.h"
+#include "debug.h"
+#include <errno.h>
 
-uint16_t indexRegister;
-uint16_t programCounter;
-uint16_t stack[16];
-uint8_t stackPointer;
-
-bool quirkWorkaround;
+static inline __attribute__((always_inline)) void chip8_execute(chip8_t* chip8, const chip8_op_t* op);
+static inline __attribute__((always_inline)) int chip8_fetch_execute(chip8_t* chip8);
+static __attribute__((noinline)) void chip8_execute_traced(chip8_t* chip8, const chip8_op_t* op);
+double timediff_ms(struct timeval *end, struct timeval *start);
 
-uint8_t delayTimer;
-uint8_t soundTimer;
+static const char* const profileNames[PROFILE_COUNT] = { "chip8", "schip", "xochip" };
 
-struct timeval cpuTime;
-struct timeval timerTime;
-struct timeval cpsTime;
-int cps;
-int cpsCounter;
+// named quirk sets first, so chip8_quirks_name() prefers them, then the single quirks
+static const struct { const char* name; uint8_t quirks; } quirkNames[] = {
+    { "none", 0 },
+    { "legacy", QUIRKS_LEGACY },                                            // what the workaround flag always enabled
+    { "cosmac", QUIRK_VF_RESET | QUIRK_CLIP },                              // original CHIP-8 on the COSMAC VIP
+    { "schip", QUIRK_SHIFT | QUIRK_LOAD_STORE | QUIRK_JUMP | QUIRK_CLIP },  // SUPER-CHIP 1.1
+    { "shift", QUIRK_SHIFT }, { "loadstore", QUIRK_LOAD_STORE }, { "jump", QUIRK_JUMP },
+    { "vfreset", QUIRK_VF_RESET }, { "clip", QUIRK_CLIP }
+};
 
-void chip8_decode_execute(uint16_t instr);
-void draw_sprite(uint8_t screenX, uint8_t screenY, uint8_t bytes);
-double timediff_ms(struct timeval *end, struct timeval *start);
+void chip8_init(chip8_t* chip8, uint8_t quirks) {
+    char names[64];
+    chip8_reset(chip8, quirks);
+    printf("%s CPU initialized.", chip8->profile == PROFILE_XOCHIP ? "XO-CHIP" : chip8->profile == PROFILE_SCHIP ? "SUPER-CHIP" : "CHIP-8");
+    if (chip8->quirks) printf(" Quirks: %s", chip8_quirks_name(chip8->quirks, names, sizeof(names)));
+}
 
-void chip8_init(bool quirks) {
-    memset(memory, 0x0, sizeof(memory));
-    memset(registers, 0x0, sizeof(registers));
-    memset(stack, 0x0, sizeof(stack));
-    memset(screen, 0x0, sizeof(screen));
-    memset(input, 0x0, sizeof(input));
-    indexRegister = 0x0;
-    programCounter = PROGRAM_ADDRESS;
-    stackPointer = 0x0;
-    delayTimer = 0x0;
-    soundTimer = 0x0;
-    drawFlag = false;
-    waitForKey = 0x0;
-    cycles = 0;
-    quirkWorkaround = quirks;
+// same as chip8_init, but silent, for callers that run many machines
+void chip8_reset(chip8_t* chip8, uint8_t quirks) {
+    memset(chip8->memory, 0x0, sizeof(chip8->memory));
+    memset(chip8->registers, 0x0, sizeof(chip8->registers));
+    memset(chip8->stack, 0x0, sizeof(chip8->stack));
+    memset(chip8->screen, 0x0, sizeof(chip8->screen));
+    chip8->dirtyRows = ~0ULL;
+    chip8->keys = 0;
+    chip8_flush_caches(chip8);
+    chip8->indexRegister = 0x0;
+    chip8->programCounter = PROGRAM_ADDRESS;
+    chip8->stackPointer = 0x0;
+    chip8->delayTimer = 0x0;
+    chip8->soundTimer = 0x0;
+    chip8->drawFlag = false;
+    chip8->waitForKey = 0x0;
+    chip8->cycles = 0;
+    chip8->frames = 0;
+    chip8->frameCycles = 0;
+    chip8->slotsLeft = 0;
+    chip8->quirks = quirks;
+    chip8_seed(chip8, RNG_SEED);
+    chip8->addressMask = chip8->profile == PROFILE_XOCHIP ? 0xFFFF : 0x0FFF;
+    chip8->hires = false;
+    chip8->planeMask = 0x1;
+    chip8->pitch = 64; // 4000 Hz
+    memset(chip8->flags, 0x0, sizeof(chip8->flags));
+    memset(chip8->audioPattern, 0xF0, sizeof(chip8->audioPattern)); // 500 Hz square wave until the program loads its own
     uint8_t chip8Fontset[80] = { 
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
         0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -70,261 +92,679 @@ void chip8_init(bool quirks) {
         0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
-    memcpy(&memory, &chip8Fontset, sizeof(chip8Fontset));
+    uint8_t bigFontset[160] = {
+        0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+        0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+        0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+        0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+        0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+        0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+        0x3C, 0x7E, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+        0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0  // F
+    };
+    memcpy(&chip8->memory, &chip8Fontset, sizeof(chip8Fontset));
+    if (chip8->profile != PROFILE_CHIP8) memcpy(&chip8->memory[BIG_FONT_ADDRESS], &bigFontset, sizeof(bigFontset));
     
-    cpuClock = CPU_CLOCK;
-    cpuRate = CPU_RATE;
-    cpuHalted = false;
-    cps = 0;
-    cpsCounter = 0;
-    gettimeofday(&cpuTime, NULL);
-    timerTime = cpuTime;
-    cpsTime = cpuTime;
-    printf("CHIP-8 CPU initialized.");
-    if (quirkWorkaround) printf(" Quirks enabled");
-}
-
-int chip8_cycle() {
-    //get current time
-    struct timeval time_cur;
-    gettimeofday(&time_cur, NULL);
+    chip8->cpuClock = CPU_CLOCK;
+    chip8->cpuHalted = false;
+    chip8->cps = 0;
+    chip8->cpsCounter = 0;
+    chip8->frameTime = 0.0;
+    chip8->frameTimeCounter = 0.0;
+    chip8->frameCounter = 0;
+    gettimeofday(&chip8->cpsTime, NULL);
+}
+
+// selects the machine emulated from the next chip8_init()/chip8_reset() on, returns 1 if its decode cache can't be allocated
+int chip8_set_profile(chip8_t* chip8, chip8_profile_t profile) {
+    chip8->profile = profile;
+    return chip8_size_decode_cache(chip8);
+}
 
-    // if difference exceeds cpuRate, execute one cycle
-    if (timediff_ms(&time_cur, &cpuTime) >= cpuRate) {
-        cpuTime = time_cur;
-        // fetch-decode-execute
-        if (programCounter > sizeof(memory) - 1) {
-            cpuHalted = true;
-            printf("\nCPU halted: PC exceeded memory limits\n");
-            return 1;
+/*
+Sizes the decode cache to the address space of the current profile, emptying it if it had to be replaced.
+Returns 1, with the cache left as it was, if out of memory.
+*/
+int chip8_size_decode_cache(chip8_t* chip8) {
+    uint32_t size = chip8->profile == PROFILE_XOCHIP ? MEMORY_SIZE : 0x1000;
+    uint64_t* valid;
+    chip8_op_t* decoded;
+    if (chip8->decodedSize == size) return 0;
+    valid = calloc(size / 64, sizeof(uint64_t));
+    decoded = malloc(size * sizeof(chip8_op_t));
+    if (valid == NULL || decoded == NULL) {
+        free(valid);
+        free(decoded);
+        return 1;
+    }
+    free(chip8->decodedValid);
+    free(chip8->decoded);
+    chip8->decodedValid = valid;
+    chip8->decoded = decoded;
+    chip8->decodedSize = size;
+    return 0;
+}
+
+// returns the profile called [name] (chip8, schip or xochip), or -1 if there is none
+int chip8_find_profile(const char* name) {
+    for (int i = 0; i < PROFILE_COUNT; i++) {
+        if (strcmp(name, profileNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+const char* chip8_profile_name(chip8_profile_t profile) {
+    return profile < PROFILE_COUNT ? profileNames[profile] : "unknown";
+}
+
+// switches quirks on a running machine, instructions decoded so far are dropped
+void chip8_set_quirks(chip8_t* chip8, uint8_t quirks) {
+    chip8->quirks = quirks;
+    chip8_flush_caches(chip8);
+}
+
+/*
+Parses a comma separated list of quirk names and named sets (see quirkNames), e.g. "schip" or "shift,clip".
+Returns the QUIRK_* bits, or -1 if a name is unknown.
+*/
+int chip8_parse_quirks(const char* names) {
+    int quirks = 0;
+    size_t length;
+    int i;
+    while (*names) {
+        length = strcspn(names, ",");
+        for (i = 0; i < sizeof(quirkNames) / sizeof(quirkNames[0]); i++) {
+            if (strlen(quirkNames[i].name) == length && strncmp(names, quirkNames[i].name, length) == 0) break;
         }
-        if (!waitForKey) {
-            chip8_decode_execute((memory[programCounter] << 8) | memory[programCounter + 1]);
-            cycles++;
+        if (i == sizeof(quirkNames) / sizeof(quirkNames[0])) return -1;
+        quirks |= quirkNames[i].quirks;
+        names += length;
+        if (*names == ',') names++;
+    }
+    return quirks;
+}
+
+// writes the name of the set equal to [quirks] or the list of single quirks into [buffer], returns it
+const char* chip8_quirks_name(uint8_t quirks, char* buffer, size_t size) {
+    size_t used = 0;
+    buffer[0] = '\0';
+    for (int i = 0; i < sizeof(quirkNames) / sizeof(quirkNames[0]); i++) {
+        if (quirkNames[i].quirks == quirks) return strncpy(buffer, quirkNames[i].name, size - 1);
+    }
+    for (int i = 0; i < sizeof(quirkNames) / sizeof(quirkNames[0]); i++) {
+        if ((quirkNames[i].quirks & (quirkNames[i].quirks - 1)) || !(quirks & quirkNames[i].quirks)) continue; // single quirks only
+        used += snprintf(buffer + used, used < size ? size - used : 0, "%s%s", used ? "," : "", quirkNames[i].name);
+    }
+    return buffer;
+}
+
+// quirks a program written for [profile] expects unless told otherwise
+uint8_t chip8_default_quirks(chip8_profile_t profile) {
+    return profile == PROFILE_SCHIP ? chip8_parse_quirks("schip") : 0;
+}
+
+/*
+Loads ROM file to memory at PROGRAM_ADDRESS.
+Returns ROM size in bytes, or -1 with errno set if the file can't be read or doesn't fit in memory.
+*/
+long chip8_load_file(chip8_t* chip8, const char* path) {
+    FILE* romfile = fopen(path, "rb");
+    if (romfile == NULL) return -1;
+
+    fseek(romfile, 0, SEEK_END);
+    long fileLength = ftell(romfile);
+    fseek(romfile, 0, SEEK_SET);
+    if (fileLength < 0 || fileLength > chip8->addressMask + 1 - PROGRAM_ADDRESS) {
+        fclose(romfile);
+        errno = EFBIG;
+        return -1;
+    }
+    if (fread(chip8->memory + PROGRAM_ADDRESS, 1, fileLength, romfile) != fileLength) fileLength = -1;
+    fclose(romfile);
+    chip8_flush_caches(chip8);
+    return fileLength;
+}
+
+/*
+Copies a ROM image that is already in memory to PROGRAM_ADDRESS, such as one taken from a ROM library with romlib_get() (see load_ROM() in main.c).
+Returns [length], or -1 with errno set to EFBIG if it doesn't fit the address space of the profile.
+*/
+long chip8_load_rom(chip8_t* chip8, const uint8_t* data, size_t length) {
+    if (length > (size_t)chip8->addressMask + 1 - PROGRAM_ADDRESS) {
+        errno = EFBIG;
+        return -1;
+    }
+    memcpy(chip8->memory + PROGRAM_ADDRESS, data, length);
+    chip8_flush_caches(chip8);
+    return length;
+}
+
+// drops all decoded instructions and blocks, must be called after memory is replaced as a whole
+void chip8_flush_caches(chip8_t* chip8) {
+    memset(chip8->decodedValid, 0x0, chip8->decodedSize / 8);
+    if (chip8->blocks != NULL) block_flush(chip8->blocks, true);
+}
+
+// selects the execution engine used by chip8_run(), returns 1 if it can't be set up
+int chip8_set_engine(chip8_t* chip8, chip8_engine_t engine) {
+    if (engine == ENGINE_BLOCK && chip8->blocks == NULL) {
+        chip8->blocks = block_create();
+        if (chip8->blocks == NULL) return 1;
+    }
+    if (engine != ENGINE_BLOCK && chip8->blocks != NULL) {
+        free(chip8->blocks);
+        chip8->blocks = NULL;
+    }
+    chip8->engine = engine;
+    return 0;
+}
+
+/*
+Copies the profile's address space from [memory], dropping the decoded instructions and blocks of only
+the 64-byte chunks that differ. Not a write of the program, so it doesn't mark code as self-modifying
+or trigger watchpoints like chip8_invalidate() does.
+*/
+void chip8_replace_memory(chip8_t* chip8, const uint8_t* memory) {
+    bool flushBlocks = false;
+    for (uint32_t page = 0; page <= chip8->addressMask; page += 0x1000) {
+        if (memcmp(chip8->memory + page, memory + page, 0x1000) == 0) continue; // most of memory doesn't change
+        for (uint32_t chunk = page; chunk < page + 0x1000; chunk += 64) {
+            if (memcmp(chip8->memory + chunk, memory + chunk, 64) == 0) continue;
+            memcpy(chip8->memory + chunk, memory + chunk, 64);
+            chip8->decodedValid[chunk >> 6] = 0;
+            if (chunk > 0) chip8->decodedValid[(chunk >> 6) - 1] &= ~(1ULL << 63); // its last instruction reads the first byte
+            if (chip8->blocks != NULL && chip8->blocks->covered[chunk >> 6] != 0) flushBlocks = true;
         }
-        cpsCounter++;
     }
+    if (flushBlocks) block_flush(chip8->blocks, false);
+}
+
+void chip8_free(chip8_t* chip8) {
+    chip8_set_engine(chip8, ENGINE_INTERPRETER);
+    free(chip8->decodedValid);
+    free(chip8->decoded);
+    chip8->decodedValid = NULL;
+    chip8->decoded = NULL;
+    chip8->decodedSize = 0;
+}
+
+/*
+Drops cached decodes and blocks overlapping [length] bytes of memory written at [address].
+Must be called after the program writes to memory. The range wraps around like accesses through I do.
+*/
+void chip8_invalidate(chip8_t* chip8, uint16_t address, uint16_t length) {
+    uint32_t size = chip8->addressMask + 1;
+    address &= chip8->addressMask;
+    if (address + length > size) {
+        chip8_invalidate(chip8, 0, address + length - size);
+        length = size - address;
+    }
+    uint32_t first = address > 0 ? address - 1 : 0; // instruction at address - 1 includes the first written byte
+    uint32_t last = (uint32_t)address + length;
+    for (uint32_t i = first; i < last; i++) chip8->decodedValid[i >> 6] &= ~(1ULL << (i & 63));
+    if (chip8->blocks != NULL) block_invalidate(chip8->blocks, address, length);
+    if (chip8->debug != NULL) debug_write(chip8->debug, address, length);
+}
+
+// seeds the random number generator used by Cxkk, equal seeds give equal runs
+void chip8_seed(chip8_t* chip8, uint32_t seed) {
+    chip8->rngState = seed * 2654435761u + 0x9E3779B9u; // spread out small seeds
+    if (chip8->rngState == 0) chip8->rngState = 1;       // xorshift gets stuck at 0
+}
+
+/*
+Updates the held keys, call between frames. A key going down while the program waits on Fx0A
+is stored in the waiting register (the highest one if several went down at once) and resumes execution.
+*/
+void chip8_set_keys(chip8_t* chip8, uint16_t keys) {
+    uint16_t pressed = keys & ~chip8->keys;
+    chip8->keys = keys;
+    if (chip8->waitForKey && pressed) {
+        chip8->registers[chip8->waitForRegister] = 31 - __builtin_clz(pressed);
+        chip8->waitForKey = false;
+    }
+}
+
+/*
+Runs one emulated 60 Hz frame (cpuClock / 60 instructions and a timer tick) as a single burst,
+and updates the instructions per second counter shown in the status string.
+Returns 1 if the CPU halted.
+*/
+int chip8_frame(chip8_t* chip8) {
+    struct timeval time_start, time_cur;
+    unsigned long cycles = chip8->cycles;
+    gettimeofday(&time_start, NULL);
+    int halted = chip8_run(chip8, 0, 1);
+    gettimeofday(&time_cur, NULL);
+    chip8->cpsCounter += chip8->cycles - cycles;
+    chip8->frameTimeCounter += timediff_ms(&time_cur, &time_start);
+    chip8->frameCounter++;
+
+    // if difference exceeds 1000 ms, update clocks per second counter and average frame time
+    if (timediff_ms(&time_cur, &chip8->cpsTime) >= 1000) {
+        chip8->cps = chip8->cpsCounter;
+        chip8->cpsCounter = 0;
+        chip8->frameTime = chip8->frameTimeCounter / chip8->frameCounter;
+        chip8->frameTimeCounter = 0.0;
+        chip8->frameCounter = 0;
+        chip8->cpsTime = time_cur;
+    }
+    return halted;
+}
+
+int chip8_step(chip8_t* chip8) {
+    return chip8_fetch_execute(chip8);
+}
+
+// inlined into the chip8_run() loop, so the only dispatch left per instruction is the handler switch
+static inline int chip8_fetch_execute(chip8_t* chip8) {
+    if (chip8->programCounter > chip8->addressMask - 1) {
+        chip8->cpuHalted = true;
+        printf("\nCPU halted: PC exceeded memory limits\n");
+        return 1;
+    }
+    if (!chip8->waitForKey) {
+        const chip8_op_t* op = chip8_fetch(chip8, chip8->programCounter);
+        if (chip8->metrics != NULL) chip8->metrics->ops[op->handler]++;
+        if (__builtin_expect(chip8->trace != NULL, 0)) chip8_execute_traced(chip8, op);
+        else chip8_execute(chip8, op);
+        chip8->cycles++;
+    }
+    return chip8->cpuHalted; // 00FD
+}
 
-    // if difference exceeds 1000 ms, increment clocks per second counter
-    if (timediff_ms(&time_cur, &cpsTime) >= 1000) {
-        cps = cpsCounter;
-        cpsCounter = 0;
-        cpsTime = time_cur;
+int chip8_tick_timers(chip8_t* chip8) {
+    if (chip8->delayTimer > 0) chip8->delayTimer--;
+    if (chip8->soundTimer > 0) {
+        chip8->soundTimer--;
+        return 1;
     }
+    return 0;
+}
 
-    // if difference exceeds 16.66 ms, update delay and sound timers
-    if (timediff_ms(&time_cur, &timerTime) >= TIMER_RATE) {
-        timerTime = time_cur;
-        if (delayTimer > 0) delayTimer--;
-        if (soundTimer > 0) {
-            soundTimer--;
-            return 1;
+/*
+Runs the CPU as fast as the host allows, without looking at wall-clock time.
+Each emulated frame executes cpuClock / TIMER_CLOCK instruction slots followed by one timer tick,
+so timers advance with the emulated cycle count. A slot spent waiting for a key press still counts.
+Limits are relative to this call, 0 means unlimited. An instruction limit that ends a frame early leaves
+the rest of its slots in slotsLeft for the next call, so a run split into several calls ends in the same state
+as a single one. Returns 1 if the CPU halted, 0 if a limit was reached.
+*/
+int chip8_run(chip8_t* chip8, unsigned long instructionLimit, unsigned long frameLimit) {
+    unsigned long executed = 0;
+    unsigned long frame = 0;
+    int slots;
+    while (frameLimit == 0 || frame < frameLimit) {
+        if (instructionLimit != 0 && executed == instructionLimit) return 0;
+        if (chip8->slotsLeft == 0) { // a new frame
+            chip8->frameCycles += chip8->cpuClock;
+            chip8->slotsLeft = chip8->frameCycles / TIMER_CLOCK;
+            chip8->frameCycles %= TIMER_CLOCK;
+        }
+        slots = chip8->slotsLeft;
+        if (instructionLimit != 0 && instructionLimit - executed < slots) slots = instructionLimit - executed;
+        if (chip8->engine == ENGINE_BLOCK && chip8->trace == NULL) { // blocks don't stop between instructions to trace them
+            if (block_run(chip8, slots)) return 1;
+        } else {
+            for (int i = 0; i < slots; i++) {
+                if (chip8_fetch_execute(chip8)) return 1;
+            }
         }
+        executed += slots;
+        chip8->slotsLeft -= slots;
+        if (chip8->slotsLeft > 0) return 0; // the instruction limit cut the frame short
+        chip8_tick_timers(chip8);
+        chip8->frames++;
+        frame++;
     }
     return 0;
 }
 
-void chip8_decode_execute(uint16_t instr) {
-    uint16_t temp = 0x0;
+void chip8_dump(chip8_t* chip8, FILE* out) {
+    fprintf(out, "PC: %04X\tI: %04X\tSP: %02X\tDT: %02X\tST: %02X\n", chip8->programCounter, chip8->indexRegister, chip8->stackPointer, chip8->delayTimer, chip8->soundTimer);
+    fprintf(out, "Cycles: %lu\tFrames: %lu\tWaiting for key: %s\n", chip8->cycles, chip8->frames, chip8->waitForKey ? "yes" : "no");
+    fprintf(out, "Registers:\n");
+    for (int i = 0; i < 16; i++) {
+        if (i > 0 && ((i % 8) == 0)) fprintf(out, "\n");
+        fprintf(out, "V%01X: %02X\t", i, chip8->registers[i]);
+    }
+    fprintf(out, "\nStack:\n");
+    for (int i = 0; i < 16; i++) {
+        if (i > 0 && ((i % 8) == 0)) fprintf(out, "\n");
+        fprintf(out, "%01X: %04X\t", i, chip8->stack[i]);
+    }
+    fprintf(out, "\nScreen:\n");
+    for (int y = 0; y < chip8_screen_height(chip8); y++) {
+        for (int x = 0; x < chip8_screen_width(chip8); x++) fputc(".#+*"[SCREEN_PIXEL(chip8->screen, 0, x, y) | SCREEN_PIXEL(chip8->screen, 1, x, y) << 1], out);
+        fputc('\n', out);
+    }
+}
+
+/*
+Splits an opcode into handler index and operands, this is the only place that looks at raw opcodes.
+Opcodes added by a later machine than [profile] decode as they did on the earlier one.
+Each of [quirks] selects the variant of the handler that has it built in.
+*/
+void chip8_decode(uint16_t instr, chip8_op_t* op, chip8_profile_t profile, uint8_t quirks) {
+    op->x = (instr & 0x0F00) >> 8;
+    op->y = (instr & 0x00F0) >> 4;
+    op->n = instr & 0x000F;
+    op->kk = instr & 0x00FF;
+    op->nnn = instr & 0x0FFF;
+    op->handler = OP_ILLEGAL;
     switch(instr & 0xF000) {
         case 0x0000:
             switch (instr & 0x00FF){
-                case 0x00: // NOP
-                    break;
-                case 0xE0: // 00E0 - CLS - clear screen
-                    memset(screen, 0x0, sizeof(screen));
-                    drawFlag = true;
-                    break;
-                case 0xEE: // 00EE - RET - return from subroutine
-                    programCounter = stack[stackPointer];
-                    stackPointer--;
-                    break;
+                case 0x00: op->handler = OP_NOP; break;
+                case 0xE0: op->handler = OP_CLS; break;
+                case 0xEE: op->handler = OP_RET; break;
+                case 0xFB: if (profile != PROFILE_CHIP8) op->handler = OP_SCR; break;
+                case 0xFC: if (profile != PROFILE_CHIP8) op->handler = OP_SCL; break;
+                case 0xFD: if (profile != PROFILE_CHIP8) op->handler = OP_EXIT; break;
+                case 0xFE: if (profile != PROFILE_CHIP8) op->handler = OP_LOW; break;
+                case 0xFF: if (profile != PROFILE_CHIP8) op->handler = OP_HIGH; break;
                 default:
-                    printf("Illegal opcode %02X!\n", instr);
+                    if ((instr & 0x00F0) == 0x00C0 && profile != PROFILE_CHIP8) op->handler = OP_SCD;
+                    else if ((instr & 0x00F0) == 0x00D0 && profile == PROFILE_XOCHIP) op->handler = OP_SCU;
                     break;
             }
+            if (op->handler == OP_ILLEGAL) op->nnn = instr;
             break;
-        case 0x1000: // 1nnn - JMP addr — jump to nnn 
-            programCounter = instr & 0x0FFF;
-            programCounter -= 2; // bypass increment and the end of the cycle
-            break;
-        case 0x2000: // 2nnn - CALL addr - save PC to stack and jump to nnn
-            stackPointer++;
-            stack[stackPointer] = programCounter;
-            programCounter = instr & 0x0FFF;
-            programCounter -= 2;
-            break;
-        case 0x3000: // 3xkk - SE Vx, kk - skip instruction if Vx = kk
-            if ((registers[(instr & 0x0F00) >> 8]) == (instr & 0x00FF)) programCounter += 2;
-            break;
-        case 0x4000: // 4xkk - SNE Vx, kk - skip instruction if Vx != kk
-            if ((registers[(instr & 0x0F00) >> 8]) != (instr & 0x00FF)) programCounter += 2;
+        case 0x1000: op->handler = OP_JP; break;
+        case 0x2000: op->handler = OP_CALL; break;
+        case 0x3000: op->handler = OP_SE_KK; break;
+        case 0x4000: op->handler = OP_SNE_KK; break;
+        case 0x5000:
+            if (profile == PROFILE_XOCHIP && op->n == 0x2) op->handler = OP_SAVE;
+            else if (profile == PROFILE_XOCHIP && op->n == 0x3) op->handler = OP_LOAD;
+            else op->handler = OP_SE_XY;
             break;
-        case 0x5000: // 5xy0 - SE Vx, Vy - skip next instruction if Vx = Vy
-            if ((registers[(instr & 0x0F00) >> 8]) == (registers[(instr & 0x00F0) >> 4])) programCounter += 2;
-            break;
-        case 0x6000: // 6xkk - LD Vx, kk - set Vx = kk
-            registers[(instr & 0x0F00) >> 8] = instr & 0x00FF;
-            break;
-        case 0x7000: // 7xkk - ADD Vx, byte - set Vx = Vx + kk
-            registers[(instr & 0x0F00) >> 8] += instr & 0x00FF;
-            break;
-        case 0x8000: // 8??? - register operations
+        case 0x6000: op->handler = OP_LD_KK; break;
+        case 0x7000: op->handler = OP_ADD_KK; break;
+        case 0x8000:
             switch(instr & 0x000F) {
-                case 0x0: // 8xy0 - LD Vx, Vy - set Vx = Vy
-                    registers[(instr & 0x0F00) >> 8] = registers[(instr & 0x00F0) >> 4];
-                    break;
-                case 0x1: // 8xy1 - OR Vx, Vy - set Vx = Vx OR Vy
-                    registers[(instr & 0x0F00) >> 8] |= registers[(instr & 0x00F0) >> 4];
-                    break;
-                case 0x2: // 8xy2 - AND Vx, Vy - set Vx = Vx AND Vy
-                    registers[(instr & 0x0F00) >> 8] &= registers[(instr & 0x00F0) >> 4];
-                    break;
-                case 0x3: // 8xy3 - XOR Vx, Vy - set Vx = Vx XOR Vy
-                    registers[(instr & 0x0F00) >> 8] ^= registers[(instr & 0x00F0) >> 4];
-                    break;
-                case 0x4: // 8xy4 - ADD Vx, Vy - set Vx = Vx + Vy, set VF = carry
-                    temp = registers[(instr & 0x0F00) >> 8] + registers[(instr & 0x00F0) >> 4];
-                    if ((temp & 0xFF00) > 0) registers[0xF] = 0x1;
-                    else registers[0xF] = 0x0;
-                    registers[(instr & 0x0F00) >> 8] = temp & 0x00FF;
-                    break;
-                case 0x5: // 8xy5 - SUB Vx, Vy - set Vx = Vx - Vy, set VF = NOT borrow
-                    if (registers[(instr & 0x0F00) >> 8] > registers[(instr & 0x00F0) >> 4]) registers[0xF] = 0x1;
-                    else registers[0xF] = 0x0;
-                    registers[(instr & 0x0F00) >> 8] -= registers[(instr & 0x00F0) >> 4];
-                    break;
-                case 0x6: // 8xy6 - SHR Vx {, Vy} - set Vx = Vx SHR 1
-                    if (quirkWorkaround) {
-                        registers[0xF] = registers[(instr & 0x0F00) >> 8] & 0x1;
-                        registers[(instr & 0x0F00) >> 8] >>= 1;
-                    } else {
-                        registers[0xF] = registers[(instr & 0x00F0) >> 4] & 0x1;
-                        registers[(instr & 0x00F0) >> 4] >>= 1;
-                        registers[(instr & 0x0F00) >> 8] = registers[(instr & 0x00F0) >> 4];
-                    }
-                    break;
-                case 0x7: // 8xy7 - SUBN Vx, Vy - set Vx = Vy - Vx, set VF = NOT borrow
-                    if (registers[(instr & 0x00F0) >> 4] > registers[(instr & 0x0F00) >> 8]) registers[0xF] = 0x1;
-                    else registers[0xF] = 0x0;
-                    registers[(instr & 0x0F00) >> 8] = registers[(instr & 0x00F0) >> 4] - registers[(instr & 0x0F00) >> 8];
-                    break;
-                case 0xE: // 8xyE - SHL Vx {, Vy} - set Vx = Vx SHL 1
-                    if (quirkWorkaround) {
-                        registers[0xF] = (registers[(instr & 0x0F00) >> 8] >> 7) & 0x1;
-                        registers[(instr & 0x0F00) >> 8] <<= 1;
-                    } else {
-                        registers[0xF] = (registers[(instr & 0x00F0) >> 4] >> 7) & 0x1;
-                        registers[(instr & 0x00F0) >> 4] <<= 1;
-                        registers[(instr & 0x0F00) >> 8] = registers[(instr & 0x00F0) >> 4];
-                    }
-                    break;
-                default:
-                    printf("Illegal opcode %02X!\n", instr & 0xF00F);
-                    break;
+                case 0x0: op->handler = OP_LD_XY; break;
+                case 0x1: op->handler = quirks & QUIRK_VF_RESET ? OP_OR_VF : OP_OR; break;
+                case 0x2: op->handler = quirks & QUIRK_VF_RESET ? OP_AND_VF : OP_AND; break;
+                case 0x3: op->handler = quirks & QUIRK_VF_RESET ? OP_XOR_VF : OP_XOR; break;
+                case 0x4: op->handler = OP_ADD_XY; break;
+                case 0x5: op->handler = OP_SUB; break;
+                case 0x6: op->handler = quirks & QUIRK_SHIFT ? OP_SHR_X : OP_SHR; break;
+                case 0x7: op->handler = OP_SUBN; break;
+                case 0xE: op->handler = quirks & QUIRK_SHIFT ? OP_SHL_X : OP_SHL; break;
+                default: op->nnn = instr & 0xF00F; break;
             }
             break;
-        case 0x9000: // 9xy0 - SNE Vx, Vy - skip next instruction if Vx != Vy.
-            if (registers[(instr & 0x0F00) >> 8] != registers[(instr & 0x00F0) >> 4]) programCounter += 2;
-            break;
-        case 0xA000: // Annn - LD I, addr - set I = nnn.
-            indexRegister = instr & 0x0FFF;
-            break;
-        case 0xB000: // Bnnn - JP V0, addr - jump to location nnn + V0.
-            programCounter = (instr & 0x0FFF) + registers[0];
-            break;
-        case 0xC000: // Cxkk - RND Vx, byte - set Vx = random byte AND kk.
-            registers[(instr & 0x0F00) >> 8] = (rand() % 0xFF) & (instr & 0x00FF);
-            break;
-        case 0xD000: // Dxyn - DRW Vx, Vy, nibble - display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
-            draw_sprite(registers[(instr & 0x0F00) >> 8], registers[(instr & 0x00F0) >> 4], (instr & 0x000F));
-            drawFlag = true;
-            break;
+        case 0x9000: op->handler = OP_SNE_XY; break;
+        case 0xA000: op->handler = OP_LD_I; break;
+        case 0xB000: op->handler = quirks & QUIRK_JUMP ? OP_JP_VX : OP_JP_V0; break;
+        case 0xC000: op->handler = OP_RND; break;
+        case 0xD000: op->handler = quirks & QUIRK_CLIP ? OP_DRW_CLIP : OP_DRW; break;
         case 0xE000:
-            if ((instr & 0x00FF) == 0x009E) { // Ex9E - SKP Vx - skip next instruction if key with the value of Vx is pressed.
-                if (input[registers[(instr & 0x0F00) >> 8]] == 0xFF) programCounter += 2;
-            } else if (instr & 0x00A1) { // ExA1 - SKNP Vx - skip next instruction if key with the value of Vx is not pressed.
-                if (input[registers[(instr & 0x0F00) >> 8]] == 0x0) programCounter += 2;
-            } else printf("Illegal opcode %02X!\n", instr);
+            if ((instr & 0x00FF) == 0x009E) op->handler = OP_SKP;
+            else if (instr & 0x00A1) op->handler = OP_SKNP;
+            else op->nnn = instr;
             break;
         case 0xF000:
             switch(instr & 0x00FF) {
-                case 0x07: // Fx07 - LD Vx, DT - set Vx = delay timer value.
-                    registers[(instr & 0x0F00) >> 8] = delayTimer;
-                    break;
-                case 0x0A: // Fx0A - LD Vx, K - wait for a key press, store the value of the key in Vx.
-                    waitForKey = true;
-                    waitForRegister = (instr & 0x0F00) >> 8;
-                    break;
-                case 0x15: // Fx15 - LD DT, Vx - set delay timer = Vx.
-                    delayTimer = registers[(instr & 0x0F00) >> 8];
-                    break;
-                case 0x18: // Fx18 - LD ST, Vx - set sound timer = Vx.
-                    soundTimer = registers[(instr & 0x0F00) >> 8];
-                    break;
-                case 0x1E: // Fx1E - ADD I, Vx - set I = I + Vx.
-                    indexRegister += registers[(instr & 0x0F00) >> 8];
-                    break;
-                case 0x29: // Fx29 - LD F, Vx - set I = location of sprite for digit Vx.
-                    indexRegister = registers[(instr & 0x0F00) >> 8] * 5; // Each sprites occupies 5 bytes in memory, sprites are loaded at 0x0
-                    break;
-                case 0x33: // Fx33 - LD B, Vx - store BCD representation of Vx in memory locations I, I+1, and I+2.
-                    temp = registers[(instr & 0x0F00) >> 8];
-                    memory[indexRegister] = (temp - temp % 100) / 100;
-                    memory[indexRegister + 1] = (temp % 100 - temp % 10) / 10;
-                    memory[indexRegister + 2] = temp % 10;
-                    break;
-                case 0x55: // Fx55 - LD [I], Vx - store registers V0 through Vx in memory starting at location I.
-                    for (int i = 0; i <= ((instr & 0x0F00) >> 8); i++) {
-                        memory[indexRegister + i] = registers[i];
-                    }
-                    if (!quirkWorkaround) indexRegister += registers[(instr & 0x0F00) >> 8] + 1;
-                    break;
-                case 0x65: // Fx65 - LD Vx, [I] - read registers V0 through Vx from memory starting at location I.
-                    for (int i = 0; i <= ((instr & 0x0F00) >> 8); i++) {
-                        registers[i] = memory[indexRegister + i];
-                    }
-                    if (!quirkWorkaround) indexRegister += registers[(instr & 0x0F00) >> 8] + 1;
-                    break;
+                case 0x07: op->handler = OP_LD_X_DT; break;
+                case 0x0A: op->handler = OP_LD_K; break;
+                case 0x15: op->handler = OP_LD_DT; break;
+                case 0x18: op->handler = OP_LD_ST; break;
+                case 0x1E: op->handler = OP_ADD_I; break;
+                case 0x29: op->handler = OP_LD_F; break;
+                case 0x33: op->handler = OP_LD_B; break;
+                case 0x55: op->handler = quirks & QUIRK_LOAD_STORE ? OP_LD_MEM_KEEP : OP_LD_MEM; break;
+                case 0x65: op->handler = quirks & QUIRK_LOAD_STORE ? OP_LD_REG_KEEP : OP_LD_REG; break;
+                case 0x30: op->handler = profile != PROFILE_CHIP8 ? OP_LD_HF : OP_NOP; break;
+                case 0x75: op->handler = profile != PROFILE_CHIP8 ? OP_LD_R : OP_NOP; break;
+                case 0x85: op->handler = profile != PROFILE_CHIP8 ? OP_LD_X_R : OP_NOP; break;
+                case 0x3A: op->handler = profile == PROFILE_XOCHIP ? OP_PITCH : OP_NOP; break;
+                case 0x01: op->handler = profile == PROFILE_XOCHIP ? OP_PLANE : OP_NOP; break;
+                case 0x02: op->handler = profile == PROFILE_XOCHIP && instr == 0xF002 ? OP_AUDIO : OP_NOP; break;
+                case 0x00: op->handler = profile == PROFILE_XOCHIP && instr == 0xF000 ? OP_LD_I_LONG : OP_NOP; break;
+                default: op->handler = OP_NOP; break;
             }
             break;
-        default:
-            printf("Illegal opcode %02X!\n", instr & 0xF000);
     }
-#ifdef DEBUG
-    printf("\n\nInstruction: %04X; Cycle: %i\n", instr, cycles);
-    printf("Dump:\nPC: %04X\tSP: %04X\nStack:\n", programCounter, stackPointer);
-    for (int i = 0; i < 16; i++) {
-        if (i > 0 && ((i % 4) == 0)) printf("\n");
-        printf("%02X: %02X\t", i, stack[i]);
+}
+
+static inline void chip8_execute(chip8_t* chip8, const chip8_op_t* op) {
+    // dense switch on the handler index compiles to a single jump table with the handlers inlined
+    switch (op->handler) {
+        case OP_ILLEGAL: op_illegal(chip8, op); break;
+        case OP_NOP: op_nop(chip8, op); break;
+        case OP_CLS: op_cls(chip8, op); break;
+        case OP_RET: op_ret(chip8, op); break;
+        case OP_JP: op_jp(chip8, op); break;
+        case OP_CALL: op_call(chip8, op); break;
+        case OP_SE_KK: op_se_kk(chip8, op); break;
+        case OP_SNE_KK: op_sne_kk(chip8, op); break;
+        case OP_SE_XY: op_se_xy(chip8, op); break;
+        case OP_LD_KK: op_ld_kk(chip8, op); break;
+        case OP_ADD_KK: op_add_kk(chip8, op); break;
+        case OP_LD_XY: op_ld_xy(chip8, op); break;
+        case OP_OR: op_or(chip8, op); break;
+        case OP_AND: op_and(chip8, op); break;
+        case OP_XOR: op_xor(chip8, op); break;
+        case OP_ADD_XY: op_add_xy(chip8, op); break;
+        case OP_SUB: op_sub(chip8, op); break;
+        case OP_SHR: op_shr(chip8, op); break;
+        case OP_SUBN: op_subn(chip8, op); break;
+        case OP_SHL: op_shl(chip8, op); break;
+        case OP_SNE_XY: op_sne_xy(chip8, op); break;
+        case OP_LD_I: op_ld_i(chip8, op); break;
+        case OP_JP_V0: op_jp_v0(chip8, op); break;
+        case OP_RND: op_rnd(chip8, op); break;
+        case OP_DRW: op_drw(chip8, op); break;
+        case OP_SKP: op_skp(chip8, op); break;
+        case OP_SKNP: op_sknp(chip8, op); break;
+        case OP_LD_X_DT: op_ld_x_dt(chip8, op); break;
+        case OP_LD_K: op_ld_k(chip8, op); break;
+        case OP_LD_DT: op_ld_dt(chip8, op); break;
+        case OP_LD_ST: op_ld_st(chip8, op); break;
+        case OP_ADD_I: op_add_i(chip8, op); break;
+        case OP_LD_F: op_ld_f(chip8, op); break;
+        case OP_LD_B: op_ld_b(chip8, op); break;
+        case OP_LD_MEM: op_ld_mem(chip8, op); break;
+        case OP_LD_REG: op_ld_reg(chip8, op); break;
+        case OP_SCD: op_scd(chip8, op); break;
+        case OP_SCR: op_scr(chip8, op); break;
+        case OP_SCL: op_scl(chip8, op); break;
+        case OP_EXIT: op_exit(chip8, op); break;
+        case OP_LOW: op_low(chip8, op); break;
+        case OP_HIGH: op_high(chip8, op); break;
+        case OP_LD_HF: op_ld_hf(chip8, op); break;
+        case OP_LD_R: op_ld_r(chip8, op); break;
+        case OP_LD_X_R: op_ld_x_r(chip8, op); break;
+        case OP_SCU: op_scu(chip8, op); break;
+        case OP_SAVE: op_save(chip8, op); break;
+        case OP_LOAD: op_load(chip8, op); break;
+        case OP_LD_I_LONG: op_ld_i_long(chip8, op); break;
+        case OP_PLANE: op_plane(chip8, op); break;
+        case OP_AUDIO: op_audio(chip8, op); break;
+        case OP_PITCH: op_pitch(chip8, op); break;
+        case OP_OR_VF: op_or_vf(chip8, op); break;
+        case OP_AND_VF: op_and_vf(chip8, op); break;
+        case OP_XOR_VF: op_xor_vf(chip8, op); break;
+        case OP_SHR_X: op_shr_x(chip8, op); break;
+        case OP_SHL_X: op_shl_x(chip8, op); break;
+        case OP_JP_VX: op_jp_vx(chip8, op); break;
+        case OP_DRW_CLIP: op_drw_clip(chip8, op); break;
+        case OP_LD_MEM_KEEP: op_ld_mem_keep(chip8, op); break;
+        case OP_LD_REG_KEEP: op_ld_reg_keep(chip8, op); break;
     }
-    printf("\nRegisters:\n");
+    chip8->programCounter += 2; //increase PC by 2 (go to the next instruction)
+}
+
+// chip8_execute() plus a trace record, out of line so the loop without tracing stays as it was
+static void chip8_execute_traced(chip8_t* chip8, const chip8_op_t* op) {
+    uint8_t registers[16];
+    uint16_t changed = 0;
+    uint16_t pc = chip8->programCounter;
+    trace_record_t record = { .cycle = chip8->cycles, .pc = pc, .opcode = (chip8->memory[pc] << 8) | chip8->memory[pc + 1],
+                              .reg = TRACE_NO_REGISTER };
+    memcpy(registers, chip8->registers, sizeof(registers));
+    chip8_execute(chip8, op);
     for (int i = 0; i < 16; i++) {
-        if (i > 0 && ((i % 4) == 0)) printf("\n");
-        printf("V%01X: %02X\t", i, registers[i]);
+        if (registers[i] != chip8->registers[i]) changed |= 1 << i;
+    }
+    if (changed) {
+        record.reg = __builtin_ctz(changed & 0x7FFF ? changed & 0x7FFF : changed); // VF is usually a side effect
+        record.value = chip8->registers[record.reg];
+    }
+    record.index = chip8->indexRegister;
+    trace_push(chip8->trace, &record);
+}
+
+// uncached path, for instructions that don't come from memory
+void chip8_decode_execute(chip8_t* chip8, uint16_t instr) {
+    chip8_op_t op;
+    chip8_decode(instr, &op, chip8->profile, chip8->quirks);
+    if (chip8->metrics != NULL) chip8->metrics->ops[op.handler]++;
+    chip8_execute(chip8, &op);
+}
+
+/*
+Draws a sprite from I at ([screenX], [screenY]) into every selected plane and sets VF on collision.
+The position wraps around the screen; with [clip] the sprite is cut off at the edges, otherwise it wraps as well.
+[bytes] is the height of an 8 pixel wide sprite; 0 draws a 16x16 one (two bytes per row) on SUPER-CHIP and XO-CHIP.
+With two planes selected, the sprite for the second one follows the first in memory.
+Rows are drawn a word at a time: the sprite row is shifted (or rotated) into place across the whole screen row and XORed into it.
+*/
+static inline __attribute__((always_inline)) void draw_sprite_rows(chip8_t* chip8, uint8_t screenX, uint8_t screenY, uint8_t bytes, bool clip) {
+    int width = chip8_screen_width(chip8);
+    int height = chip8_screen_height(chip8);
+    bool wide = bytes == 0 && chip8->profile != PROFILE_CHIP8;
+    int rows = wide ? 16 : bytes;
+    int shift = screenX & (width - 1); // both resolutions are powers of two
+    int top = screenY & (height - 1);
+    int y;
+    uint16_t address = chip8->indexRegister;
+    uint64_t spriteRow;
+    uint64_t* row;
+    unsigned __int128 wideRow;
+    uint64_t left, right;
+    uint16_t bits;
+    struct timespec start;
+    if (chip8->metrics != NULL) clock_gettime(CLOCK_MONOTONIC, &start);
+    chip8->registers[0xF] = 0x0;
+    for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+        if (!(chip8->planeMask & (1 << plane))) continue;
+        for (int i = 0; i < rows; i++) {                                                                // for each sprite row:
+            if (clip && top + i >= height) break;                                                       // stop at the bottom edge
+            y = (top + i) & (height - 1);                                                               // or wrap around it
+            bits = chip8->memory[(address + i * (wide ? 2 : 1)) & chip8->addressMask];
+            if (wide) bits = (bits << 8) | chip8->memory[(address + i * 2 + 1) & chip8->addressMask];
+            row = chip8->screen[plane][y];
+            if (width == SCREEN_WIDTH) {
+                spriteRow = (uint64_t)bits << (wide ? 48 : 56);                                         // put sprite row at the left edge of the row
+                if (clip) spriteRow >>= shift;                                                          // move it to [screenX], dropping what's past the right edge
+                else spriteRow = (spriteRow >> shift) | (spriteRow << ((SCREEN_WIDTH - shift) & (SCREEN_WIDTH - 1))); // or rotate it there, wrapping around
+                if (row[0] & spriteRow) chip8->registers[0xF] = 0x1;                                    // any lit pixel that gets turned off is a collision
+                row[0] ^= spriteRow;
+            } else {
+                wideRow = (unsigned __int128)bits << (wide ? 112 : 120);                                // same on the 128-bit row
+                if (clip) wideRow >>= shift;
+                else if (shift) wideRow = (wideRow >> shift) | (wideRow << (SCREEN_MAX_WIDTH - shift));
+                left = wideRow >> 64;
+                right = (uint64_t)wideRow;
+                if ((row[0] & left) | (row[1] & right)) chip8->registers[0xF] = 0x1;
+                row[0] ^= left;
+                row[1] ^= right;
+                spriteRow = left | right;
+            }
+            if (spriteRow) chip8->dirtyRows |= 1ULL << y;
+        }
+        address += rows * (wide ? 2 : 1);
     }
-#endif
-    programCounter += 2; //increase PC by 2 (go to the next instruction)
-}
-
-void draw_sprite(uint8_t screenX, uint8_t screenY, uint8_t bytes) {
-    uint16_t colPosition;
-    uint16_t rowPosition;
-    uint8_t prevPixel;
-    registers[0xF] = 0x0;
-    for (uint8_t y = 0; y < bytes; y++) {                                                        // for each sprite row:
-        rowPosition = (((screenY + y) % SCREEN_HEIGHT)*64);                                         // calculate the position of [screenY] row in screen array, wrap around if [screenY + Y] > SCREEN_HEIGHT
-        for (uint8_t x = 0; x < 8; x++) {                                                           // for each sprite column:
-            colPosition = rowPosition + ((screenX + x) % SCREEN_WIDTH);                               // calculate the position of pixel in screen array, wrap around if [screenX + x] > SCREEN_WIDTH
-            prevPixel = screen[colPosition];                                                          // save previous value of pixel at [column, row]
-            screen[colPosition] ^= (memory[indexRegister + y] >> (7 - x)) & 0x1;                      // XOR this pixel with sprite bit x
-            if (prevPixel != screen[colPosition] && screen[colPosition] == 0x0) registers[0xF] = 0x1; // check if pixel value changed and was set to 0 in the process (collision)
+    if (chip8->metrics != NULL) chip8->metrics->time[METRICS_DRAW] += metrics_elapsed(&start);
+}
+
+// Dxyn, sprites wrap around the screen edges
+void draw_sprite(chip8_t* chip8, uint8_t screenX, uint8_t screenY, uint8_t bytes) {
+    draw_sprite_rows(chip8, screenX, screenY, bytes, false);
+}
+
+// Dxyn with QUIRK_CLIP
+void draw_sprite_clipped(chip8_t* chip8, uint8_t screenX, uint8_t screenY, uint8_t bytes) {
+    draw_sprite_rows(chip8, screenX, screenY, bytes, true);
+}
+
+/*
+Scrolls the selected planes by [dx] pixels right (left if negative) and [dy] down (up if negative),
+in pixels of the current resolution. Pixels scrolled in are blank.
+*/
+void scroll_screen(chip8_t* chip8, int dx, int dy) {
+    int width = chip8_screen_width(chip8);
+    int height = chip8_screen_height(chip8);
+    size_t rowSize = sizeof(chip8->screen[0][0]);
+    unsigned __int128 wideRow;
+    uint64_t (*rows)[SCREEN_WORDS];
+
+    if (dy > height) dy = height;
+    if (dy < -height) dy = -height;
+    for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+        if (!(chip8->planeMask & (1 << plane))) continue;
+        rows = chip8->screen[plane];
+        if (dy > 0) {
+            memmove(rows[dy], rows[0], (height - dy) * rowSize);
+            memset(rows[0], 0x0, dy * rowSize);
+        } else if (dy < 0) {
+            memmove(rows[0], rows[-dy], (height + dy) * rowSize);
+            memset(rows[height + dy], 0x0, -dy * rowSize);
+        }
+        if (dx == 0) continue;
+        for (int y = 0; y < height; y++) {
+            if (width == SCREEN_WIDTH) {
+                rows[y][0] = dx > 0 ? rows[y][0] >> dx : rows[y][0] << -dx;
+            } else {
+                wideRow = ((unsigned __int128)rows[y][0] << 64) | rows[y][1];
+                wideRow = dx > 0 ? wideRow >> dx : wideRow << -dx;
+                rows[y][0] = wideRow >> 64;
+                rows[y][1] = (uint64_t)wideRow;
+            }
         }
     }
+    chip8->dirtyRows |= height == 64 ? ~0ULL : (1ULL << height) - 1;
+    chip8->drawFlag = true;
+}
+
+// switches between 64x32 and 128x64, clearing all planes
+void set_hires(chip8_t* chip8, bool hires) {
+    chip8->hires = hires;
+    memset(chip8->screen, 0x0, sizeof(chip8->screen));
+    chip8->dirtyRows = ~0ULL;
+    chip8->drawFlag = true;
+}
+
+// builds the status line, [extended] adds live instructions per second and frame time counters
+void generate_state(chip8_t* chip8, bool extended) {
+    double speed = ((double)chip8->cps / (double)chip8->cpuClock) * 100.0;
+    if (extended) snprintf(chip8->statusString, STATUS_LENGTH, "%i Hz | %03.02f%% | %i ips | %.3f ms", chip8->cpuClock, speed, chip8->cps, chip8->frameTime);
+    else snprintf(chip8->statusString, STATUS_LENGTH, "Clock: %i Hz | Speed: %03.02f%%", chip8->cpuClock, speed);
 }
 
-void generate_state() {
-    snprintf(statusString, 50, "Clock: %i Hz | Speed: %03.02f%%", cpuClock, ((double)cps / (double)cpuClock) * 100.0);
+// FNV-1a hash of the framebuffer and registers, used to compare runs
+uint32_t chip8_checksum(chip8_t* chip8) {
+    uint32_t hash = 2166136261u;
+    uint8_t pixel;
+    for (int y = 0; y < chip8_screen_height(chip8); y++) {
+        for (int x = 0; x < chip8_screen_width(chip8); x++) { // one byte per pixel, as before bit packing, planes in its low bits
+            pixel = SCREEN_PIXEL(chip8->screen, 0, x, y) | SCREEN_PIXEL(chip8->screen, 1, x, y) << 1;
+            hash = (hash ^ pixel) * 16777619u;
+        }
+    }
+    for (int i = 0; i < sizeof(chip8->registers); i++) hash = (hash ^ chip8->registers[i]) * 16777619u;
+    return hash;
 }
 
 double timediff_ms(struct timeval* end, struct timeval* start) {
@@ -21,36 +21,142 @@ Header file for CHIP-8 interpreter
 #include <stdbool.h>
 #include <inttypes.h>
 #include <string.h>
+#include <sys/time.h>
 
 #define PROGRAM_ADDRESS 0x200
-#define SCREEN_WIDTH 64
-#define SCREEN_HEIGHT 32
+#define BIG_FONT_ADDRESS 0x50 // SUPER-CHIP 8x10 digits, right after the 4x5 ones at 0
 
 #define CPU_CLOCK 500 // Hz
-#define CPU_RATE (double)((1.0 / CPU_CLOCK) * 1000.0) // ms
+#define TIMER_CLOCK 60 // Hz, also the emulated frame rate
+#define RNG_SEED 1     // used by chip8_reset() until the frontend calls chip8_seed()
 
-#define TIMER_CLOCK 60 // Hz
-#define TIMER_RATE (double)((1.0 / TIMER_CLOCK) * 1000.0) // ms
+#define MEMORY_SIZE 65536 // XO-CHIP, the other machines use the first 4 KB
 
-uint8_t memory[4096];
-uint8_t registers[16];
+// pre-decoded instruction, see ops.h
+typedef struct chip8_op {
+    uint8_t handler;
+    uint8_t x;
+    uint8_t y;
+    uint8_t n;
+    uint8_t kk;
+    uint16_t nnn;
+} chip8_op_t;
 
-uint8_t screen[SCREEN_WIDTH*SCREEN_HEIGHT];
-bool drawFlag;
-bool waitForKey;
-bool cpuHalted;
-uint8_t waitForRegister; // register to write the key value to
-uint8_t input[16];
+typedef enum chip8_profile {
+    PROFILE_CHIP8,  // 64x32, 4 KB
+    PROFILE_SCHIP,  // SUPER-CHIP 1.1: 128x64 mode, scrolling, 16x16 sprites, big font, flag registers
+    PROFILE_XOCHIP, // SUPER-CHIP plus 64 KB, two bit planes, audio pattern and the 5xy2/5xy3/F000/Fn01/F002/Fx3A opcodes
+    PROFILE_COUNT
+} chip8_profile_t;
 
-int cycles;
-double cpuRate;
-int cpuClock;
+/*
+Behaviors that differ between CHIP-8 implementations, see chip8_parse_quirks() for the named sets.
+They are resolved when an instruction is decoded into its handler, so executing one never checks them.
+*/
+#define QUIRK_SHIFT      0x01 // 8xy6/8xyE shift Vx in place instead of Vx = Vy shifted
+#define QUIRK_LOAD_STORE 0x02 // Fx55/Fx65 leave I unchanged instead of advancing it past the last register
+#define QUIRK_JUMP       0x04 // Bnnn jumps to xnn + Vx instead of nnn + V0
+#define QUIRK_VF_RESET   0x08 // 8xy1/8xy2/8xy3 clear VF
+#define QUIRK_CLIP       0x10 // sprites are cut off at the screen edges instead of wrapping around
+#define QUIRKS_LEGACY (QUIRK_SHIFT | QUIRK_LOAD_STORE) // the workaround flag on the command line
+
+typedef enum chip8_engine {
+    ENGINE_INTERPRETER, // one instruction at a time through the decode cache
+    ENGINE_BLOCK        // cached basic blocks, see block.h
+} chip8_engine_t;
+
+/*
+Complete state of one CHIP-8 machine. Nothing in cpu.c is global, so any number of
+machines can be run side by side. Architectural state that is touched on every
+instruction comes first to keep it within the first couple of cache lines.
+Must be zeroed and given a profile with chip8_set_profile() before the first chip8_init()/chip8_reset(),
+and released with chip8_free().
+*/
+typedef struct chip8 {
+    // machine state, everything up to CHIP8_STATE_SIZE is copied by chip8_snapshot()
+    uint8_t registers[16];
+    uint16_t programCounter;
+    uint16_t indexRegister;
+    uint16_t stack[16];
+    uint8_t stackPointer;
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    uint8_t waitForRegister; // register to write the key value to
+    bool waitForKey;
+    bool cpuHalted;
+    uint8_t quirks; // QUIRK_* bits
+    uint32_t rngState; // xorshift32 state for Cxkk, see chip8_seed()
+    uint8_t profile;   // chip8_profile_t, kept by chip8_reset()
+    bool hires;        // 128x64 mode
+    uint8_t planeMask; // XO-CHIP planes affected by drawing, clearing and scrolling
+    uint8_t pitch;     // XO-CHIP audio pattern playback rate
+    uint16_t addressMask; // accesses through I wrap around the address space of the profile
+    uint8_t flags[16];    // SUPER-CHIP RPL user flags, Fx75/Fx85
+    uint8_t audioPattern[16]; // XO-CHIP 1-bit audio samples, played while the sound timer runs
+    chip8_screen_t screen;    // see SCREEN_PIXEL()
+    uint8_t memory[MEMORY_SIZE]; // last, so snapshots can stop at the end of the profile's address space
+
+    bool drawFlag;
+    uint64_t dirtyRows; // bit n is set if row n changed since the frontend last cleared it
+    uint16_t keys;      // bit n is set while key n is held, see chip8_set_keys()
+
+    // decode cache, one entry per address of the profile's address space, valid if the corresponding bit is set.
+    // Allocated by chip8_set_profile(), so a 4 KB machine doesn't carry XO-CHIP's 64 KB worth of entries
+    uint64_t* decodedValid;
+    chip8_op_t* decoded;
+    uint32_t decodedSize; // entries
+
+    chip8_engine_t engine;
+    struct chip8_blocks* blocks; // only allocated for ENGINE_BLOCK
+    struct chip8_metrics* metrics; // performance counters, NULL unless enabled by the frontend
+    struct chip8_trace* trace;     // execution trace, NULL unless enabled by the frontend, see trace.h
+    struct chip8_debug* debug;     // breakpoints and watchpoints, NULL unless the debugger runs, see debug.h
+
+    unsigned long cycles;
+    unsigned long frames; // emulated 60 Hz frames, advanced by chip8_run()
+    int frameCycles;      // cpuClock remainder carried between emulated frames
+    int slotsLeft;        // instruction slots left in a frame an instruction limit stopped chip8_run() in, 0 between frames
+    int cpuClock;
+
+    struct timeval cpsTime;
+    int cps;
+    int cpsCounter;
+    double frameTime;        // average host time spent emulating one frame over the last second, ms
+    double frameTimeCounter;
+    int frameCounter;
 
-char statusString[50];
+    char statusString[STATUS_LENGTH];
+} chip8_t;
 
-void chip8_init(bool quirks);
-int chip8_cycle();
-void generate_state();
+void chip8_init(chip8_t* chip8, uint8_t quirks);
+void chip8_reset(chip8_t* chip8, uint8_t quirks);
+int chip8_set_profile(chip8_t* chip8, chip8_profile_t profile);
+int chip8_size_decode_cache(chip8_t* chip8);
+int chip8_find_profile(const char* name);
+const char* chip8_profile_name(chip8_profile_t profile);
+void chip8_set_quirks(chip8_t* chip8, uint8_t quirks);
+int chip8_parse_quirks(const char* names);
+const char* chip8_quirks_name(uint8_t quirks, char* buffer, size_t size);
+uint8_t chip8_default_quirks(chip8_profile_t profile);
+int chip8_set_engine(chip8_t* chip8, chip8_engine_t engine);
+void chip8_free(chip8_t* chip8);
+long chip8_load_file(chip8_t* chip8, const char* path);
+long chip8_load_rom(chip8_t* chip8, const uint8_t* data, size_t length);
+void chip8_invalidate(chip8_t* chip8, uint16_t address, uint16_t length);
+void chip8_flush_caches(chip8_t* chip8);
+void chip8_replace_memory(chip8_t* chip8, const uint8_t* memory);
+int chip8_frame(chip8_t* chip8);
+void chip8_seed(chip8_t* chip8, uint32_t seed);
+void chip8_set_keys(chip8_t* chip8, uint16_t keys);
+int chip8_step(chip8_t* chip8);
+void chip8_decode_execute(chip8_t* chip8, uint16_t instr);
+int chip8_tick_timers(chip8_t* chip8);
+int chip8_run(chip8_t* chip8, unsigned long instructionLimit, unsigned long frameLimit);
+void chip8_dump(chip8_t* chip8, FILE* out);
+uint32_t chip8_checksum(chip8_t* chip8);
 
-//#define DEBUG
+// resolution of the current display mode
+static inline int chip8_screen_width(const chip8_t* chip8) { return chip8->hires ? SCREEN_MAX_WIDTH : SCREEN_WIDTH; }
+static inline int chip8_screen_height(const chip8_t* chip8) { return chip8->hires ? SCREEN_MAX_HEIGHT : SCREEN_HEIGHT; }
+void generate_state(chip8_t* chip8, bool extended);
 #endif
\ No newline at end of file
@@ -0,0 +1,370 @@
+/*
+Debugger
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "debug.h"
+#include "disasm.h"
+#include "ops.h"
+#include <ctype.h>
+#include <signal.h>
+
+#define BIT_TEST(map, bit) ((map)[(bit) >> 6] & (1ULL << ((bit) & 63)))
+#define BIT_SET(map, bit) ((map)[(bit) >> 6] |= (1ULL << ((bit) & 63)))
+#define BIT_CLEAR(map, bit) ((map)[(bit) >> 6] &= ~(1ULL << ((bit) & 63)))
+
+#define DEBUG_NO_RETURN -1 // debug_loop() runs until the instruction limit instead of a return address
+#define DEBUG_LINE_LENGTH 256
+
+static volatile sig_atomic_t debugInterrupted;
+
+static const char* const compareNames[] = { "==", "!=", "<", "<=", ">", ">=" };
+static const char* const stopNames[] = { "Stepped", "Breakpoint", "Watchpoint", "Condition", "CPU halted", "Interrupted" };
+
+static void debug_interrupt(int signal);
+static debug_stop_t debug_loop(chip8_t* chip8, chip8_debug_t* debug, unsigned long instructionLimit, int returnAddress, uint8_t returnDepth);
+static bool debug_test(chip8_t* chip8, const debug_condition_t* condition);
+static bool debug_breakpoint_hit(chip8_t* chip8, chip8_debug_t* debug);
+static bool debug_condition_hit(chip8_t* chip8, chip8_debug_t* debug);
+static int debug_parse_register(const char* name);
+static int debug_parse_compare(const char* name);
+static const char* debug_register_name(uint8_t reg, char* buffer);
+static void debug_print_location(chip8_t* chip8);
+static void debug_print_registers(chip8_t* chip8);
+static void debug_print_points(chip8_debug_t* debug);
+static void debug_print_help();
+
+// returns NULL if out of memory
+chip8_debug_t* debug_create() {
+    return calloc(1, sizeof(chip8_debug_t));
+}
+
+void debug_free(chip8_debug_t* debug) {
+    free(debug);
+}
+
+// sets or clears the breakpoint at [address], clearing one also drops its conditions. Returns 1 if nothing changed
+int debug_set_breakpoint(chip8_debug_t* debug, uint16_t address, bool set) {
+    if (!BIT_TEST(debug->breakpoints, address) == !set) return 1;
+    if (set) {
+        BIT_SET(debug->breakpoints, address);
+        debug->breakpointCount++;
+        return 0;
+    }
+    BIT_CLEAR(debug->breakpoints, address);
+    debug->breakpointCount--;
+    for (int i = 0; i < debug->conditionCount; i++) {
+        if (debug->conditions[i].address == address) debug->conditions[i--] = debug->conditions[--debug->conditionCount];
+    }
+    return 0;
+}
+
+/*
+Sets or clears watchpoints on [length] bytes from [address] of the address space of [chip8]. The range wraps around
+like writes through I do, see chip8_invalidate(). Returns 1 if nothing changed.
+*/
+int debug_set_watchpoint(chip8_debug_t* debug, chip8_t* chip8, uint16_t address, uint32_t length, bool set) {
+    uint32_t i;
+    int changed = 0;
+    if (length > (uint32_t)chip8->addressMask + 1) length = chip8->addressMask + 1;
+    for (uint32_t n = 0; n < length; n++) {
+        i = (address + n) & chip8->addressMask;
+        if (!BIT_TEST(debug->watchpoints, i) == !set) continue;
+        if (set) BIT_SET(debug->watchpoints, i);
+        else BIT_CLEAR(debug->watchpoints, i);
+        changed++;
+    }
+    debug->watchpointCount += set ? changed : -changed;
+    return changed == 0;
+}
+
+/*
+Adds a register condition. With an [address] the breakpoint there only stops while one of its conditions is true,
+with DEBUG_NO_ADDRESS execution stops after any instruction that makes it true. Conditions that are already true
+when added only stop after they turned false and true again. Returns 1 if there is no room for another one.
+*/
+int debug_add_condition(chip8_debug_t* debug, chip8_t* chip8, int address, uint8_t reg, debug_compare_t compare, uint16_t value) {
+    debug_condition_t* condition;
+    if (debug->conditionCount == DEBUG_MAX_CONDITIONS) return 1;
+    condition = &debug->conditions[debug->conditionCount++];
+    *condition = (debug_condition_t){ .reg = reg, .compare = compare, .value = value, .address = address };
+    condition->held = debug_test(chip8, condition);
+    if (address != DEBUG_NO_ADDRESS) debug_set_breakpoint(debug, address, true);
+    return 0;
+}
+
+/*
+Executes up to [instructionLimit] instruction slots (0 - no limit) with the same frame timing as chip8_run(),
+and stops early at breakpoints, watchpoints and conditions, when the CPU halts or on Ctrl+C.
+A breakpoint at the PC it starts from doesn't stop it, so it can be continued from one.
+*/
+debug_stop_t debug_run(chip8_t* chip8, chip8_debug_t* debug, unsigned long instructionLimit) {
+    return debug_loop(chip8, debug, instructionLimit, DEBUG_NO_RETURN, 0);
+}
+
+// executes one instruction, or a whole 2nnn call up to the instruction after it (stopping at breakpoints on the way)
+debug_stop_t debug_step_over(chip8_t* chip8, chip8_debug_t* debug) {
+    uint16_t pc = chip8->programCounter;
+    if (chip8->waitForKey || pc > chip8->addressMask - 1 || chip8_fetch(chip8, pc)->handler != OP_CALL) return debug_run(chip8, debug, 1);
+    return debug_loop(chip8, debug, 0, (pc + 2) & chip8->addressMask, chip8->stackPointer);
+}
+
+static void debug_interrupt(int signal) {
+    debugInterrupted = 1;
+}
+
+/*
+The stepping loop behind debug_run() and debug_step_over(), which also stops with DEBUG_STEPPED once the PC is at
+[returnAddress] with the stack as deep as [returnDepth].
+*/
+static debug_stop_t debug_loop(chip8_t* chip8, chip8_debug_t* debug, unsigned long instructionLimit, int returnAddress, uint8_t returnDepth) {
+    struct sigaction action = { .sa_handler = debug_interrupt }, previous;
+    bool checks = debug->breakpointCount > 0 || debug->watchpointCount > 0 || debug->conditionCount > 0 || returnAddress != DEBUG_NO_RETURN;
+    debug_stop_t stop = DEBUG_STEPPED;
+    unsigned long executed = 0;
+
+    debugInterrupted = 0;
+    debug->watchHit = false;
+    chip8->debug = debug;
+    sigaction(SIGINT, &action, &previous);
+    while (instructionLimit == 0 || executed < instructionLimit) {
+        if (debugInterrupted) { stop = DEBUG_INTERRUPTED; break; }
+        if (chip8->cpuHalted) { stop = DEBUG_HALTED; break; }
+        if (!checks && instructionLimit == 0) { // nothing to look out for, whole frames at full speed
+            if (chip8_run(chip8, 0, 1)) { stop = DEBUG_HALTED; break; }
+            continue;
+        }
+        if (executed > 0 && returnAddress != DEBUG_NO_RETURN && chip8->programCounter == returnAddress && chip8->stackPointer == returnDepth) break;
+        if (executed > 0 && debug->breakpointCount > 0 && debug_breakpoint_hit(chip8, debug)) { stop = DEBUG_BREAKPOINT; break; }
+        if (chip8_run(chip8, 1, 0)) { stop = DEBUG_HALTED; break; } // one slot, chip8_run() keeps the rest of the frame
+        executed++;
+        if (debug->watchHit) { stop = DEBUG_WATCHPOINT; break; }
+        if (debug->conditionCount > 0 && debug_condition_hit(chip8, debug)) { stop = DEBUG_CONDITION; break; }
+    }
+    sigaction(SIGINT, &previous, NULL);
+    return stop;
+}
+
+static bool debug_test(chip8_t* chip8, const debug_condition_t* condition) {
+    uint16_t value = condition->reg < 16 ? chip8->registers[condition->reg] : condition->reg == DEBUG_REG_I ? chip8->indexRegister :
+                     condition->reg == DEBUG_REG_DT ? chip8->delayTimer : chip8->soundTimer;
+    switch (condition->compare) {
+        case DEBUG_EQ: return value == condition->value;
+        case DEBUG_NE: return value != condition->value;
+        case DEBUG_LT: return value < condition->value;
+        case DEBUG_LE: return value <= condition->value;
+        case DEBUG_GT: return value > condition->value;
+        case DEBUG_GE: return value >= condition->value;
+    }
+    return false;
+}
+
+// true if the instruction at PC is about to run at a breakpoint that has no conditions or a true one
+static bool debug_breakpoint_hit(chip8_t* chip8, chip8_debug_t* debug) {
+    bool conditional = false;
+    if (chip8->waitForKey || !BIT_TEST(debug->breakpoints, chip8->programCounter)) return false;
+    for (int i = 0; i < debug->conditionCount; i++) {
+        if (debug->conditions[i].address != chip8->programCounter) continue;
+        if (debug_test(chip8, &debug->conditions[i])) return true;
+        conditional = true;
+    }
+    return !conditional;
+}
+
+// true if a condition without an address became true
+static bool debug_condition_hit(chip8_t* chip8, chip8_debug_t* debug) {
+    bool hit = false, now;
+    for (int i = 0; i < debug->conditionCount; i++) {
+        debug_condition_t* condition = &debug->conditions[i];
+        if (condition->address != DEBUG_NO_ADDRESS) continue;
+        now = debug_test(chip8, condition);
+        if (now && !condition->held) hit = true;
+        condition->held = now;
+    }
+    return hit;
+}
+
+/*
+Reads debugger commands from [in] until "q" or the end of input, see debug_print_help().
+Addresses, values and keys are hexadecimal. An empty line repeats a step.
+Returns 0, or 1 if the debugger couldn't be set up.
+*/
+int debug_shell(chip8_t* chip8, chip8_debug_t* debug, FILE* in) {
+    char line[DEBUG_LINE_LENGTH], last[DEBUG_LINE_LENGTH] = "";
+    char command[16], arg1[16], arg2[16], arg3[16], arg4[16], arg5[16];
+    char text[DISASM_LENGTH];
+    int count, reg, compare;
+    unsigned long address, value;
+    debug_stop_t stop;
+
+    printf("Debugger ready, h lists the commands\n");
+    debug_print_location(chip8);
+    for (;;) {
+        printf("(chip8) ");
+        fflush(stdout);
+        if (fgets(line, sizeof(line), in) == NULL) { printf("\n"); break; }
+        if (line[0] == '\n' && (last[0] == 's' || last[0] == 'n')) strcpy(line, last);
+        count = sscanf(line, "%15s %15s %15s %15s %15s %15s", command, arg1, arg2, arg3, arg4, arg5);
+        if (count < 1) continue;
+        strcpy(last, line);
+
+        if (strcmp(command, "q") == 0) break;
+        else if (strcmp(command, "h") == 0) debug_print_help();
+        else if (strcmp(command, "s") == 0 || strcmp(command, "n") == 0 || strcmp(command, "c") == 0) {
+            if (command[0] == 's') stop = debug_run(chip8, debug, count > 1 ? strtoul(arg1, NULL, 0) : 1);
+            else if (command[0] == 'n') stop = debug_step_over(chip8, debug);
+            else stop = debug_run(chip8, debug, 0);
+            if (stop == DEBUG_WATCHPOINT) printf("Watchpoint: %04X written\n", debug->watchAddress);
+            else if (stop != DEBUG_STEPPED) printf("%s\n", stopNames[stop]);
+            debug_print_location(chip8);
+        }
+        else if (strcmp(command, "b") == 0 && count == 2) {
+            address = strtoul(arg1, NULL, 16);
+            if (debug_set_breakpoint(debug, address & chip8->addressMask, true)) printf("Breakpoint at %04lX already set\n", address);
+        }
+        else if (strcmp(command, "b") == 0 && count == 6 && strcmp(arg2, "if") == 0) {
+            address = strtoul(arg1, NULL, 16) & chip8->addressMask;
+            if ((reg = debug_parse_register(arg3)) < 0 || (compare = debug_parse_compare(arg4)) < 0) { printf("Expected b <address> if <V0-VF|I|DT|ST> <==|!=|<|<=|>|>=> <value>\n"); continue; }
+            if (debug_add_condition(debug, chip8, address, reg, compare, strtoul(arg5, NULL, 16))) printf("No room for more than %i conditions\n", DEBUG_MAX_CONDITIONS);
+        }
+        else if (strcmp(command, "when") == 0 && count == 4) {
+            if ((reg = debug_parse_register(arg1)) < 0 || (compare = debug_parse_compare(arg2)) < 0) { printf("Expected when <V0-VF|I|DT|ST> <==|!=|<|<=|>|>=> <value>\n"); continue; }
+            if (debug_add_condition(debug, chip8, DEBUG_NO_ADDRESS, reg, compare, strtoul(arg3, NULL, 16))) printf("No room for more than %i conditions\n", DEBUG_MAX_CONDITIONS);
+        }
+        else if (strcmp(command, "d") == 0 && count == 2) {
+            if (strcmp(arg1, "when") == 0) { // every condition without an address
+                for (int i = 0; i < debug->conditionCount; i++) {
+                    if (debug->conditions[i].address == DEBUG_NO_ADDRESS) debug->conditions[i--] = debug->conditions[--debug->conditionCount];
+                }
+            } else if (debug_set_breakpoint(debug, strtoul(arg1, NULL, 16) & chip8->addressMask, false)) printf("No breakpoint at %s\n", arg1);
+        }
+        else if ((strcmp(command, "w") == 0 || strcmp(command, "u") == 0) && count >= 2) {
+            address = strtoul(arg1, NULL, 16) & chip8->addressMask;
+            value = count > 2 ? strtoul(arg2, NULL, 16) : 1;
+            if (value > chip8->addressMask + 1) value = chip8->addressMask + 1;
+            if (debug_set_watchpoint(debug, chip8, address, value, command[0] == 'w')) printf("Nothing to change\n");
+        }
+        else if (strcmp(command, "i") == 0) debug_print_points(debug);
+        else if (strcmp(command, "r") == 0) debug_print_registers(chip8);
+        else if (strcmp(command, "p") == 0) chip8_dump(chip8, stdout);
+        else if (strcmp(command, "x") == 0 && count >= 2) {
+            address = strtoul(arg1, NULL, 16) & chip8->addressMask;
+            value = count > 2 ? strtoul(arg2, NULL, 16) : 0x10;
+            for (unsigned long i = 0; i < value; i++) {
+                if (i % 16 == 0) printf("%s%04lX:", i > 0 ? "\n" : "", (address + i) & chip8->addressMask);
+                printf(" %02X", chip8->memory[(address + i) & chip8->addressMask]);
+            }
+            printf("\n");
+        }
+        else if (strcmp(command, "l") == 0) {
+            address = count > 1 ? strtoul(arg1, NULL, 16) & chip8->addressMask : chip8->programCounter;
+            value = count > 2 ? strtoul(arg2, NULL, 0) : 10;
+            for (unsigned long i = 0; i < value; i++) {
+                int length = disasm(chip8, address, text, sizeof(text));
+                printf("%c%c%04lX  %02X%02X  %s\n", address == chip8->programCounter ? '>' : ' ', BIT_TEST(debug->breakpoints, address) ? '*' : ' ',
+                       address, chip8->memory[address], chip8->memory[(address + 1) & chip8->addressMask], text);
+                address = (address + length) & chip8->addressMask;
+            }
+        }
+        else if (strcmp(command, "k") == 0 && count == 2) chip8_set_keys(chip8, strtoul(arg1, NULL, 16));
+        else printf("Unknown command, h lists them\n");
+    }
+    chip8->debug = NULL;
+    return 0;
+}
+
+static int debug_parse_register(const char* name) {
+    if (strcasecmp(name, "I") == 0) return DEBUG_REG_I;
+    if (strcasecmp(name, "DT") == 0) return DEBUG_REG_DT;
+    if (strcasecmp(name, "ST") == 0) return DEBUG_REG_ST;
+    if (toupper(name[0]) == 'V' && isxdigit(name[1]) && name[2] == '\0') return strtol(name + 1, NULL, 16);
+    return -1;
+}
+
+static int debug_parse_compare(const char* name) {
+    for (int i = 0; i < sizeof(compareNames) / sizeof(compareNames[0]); i++) {
+        if (strcmp(name, compareNames[i]) == 0) return i;
+    }
+    return -1;
+}
+
+static const char* debug_register_name(uint8_t reg, char* buffer) {
+    if (reg == DEBUG_REG_I) return "I";
+    if (reg == DEBUG_REG_DT) return "DT";
+    if (reg == DEBUG_REG_ST) return "ST";
+    sprintf(buffer, "V%X", reg);
+    return buffer;
+}
+
+// the instruction about to run
+static void debug_print_location(chip8_t* chip8) {
+    char text[DISASM_LENGTH];
+    uint16_t pc = chip8->programCounter & chip8->addressMask;
+    disasm(chip8, pc, text, sizeof(text));
+    printf("%04X  %02X%02X  %-20s  cycle %lu, frame %lu%s\n", pc, chip8->memory[pc], chip8->memory[(pc + 1) & chip8->addressMask], text,
+           chip8->cycles, chip8->frames, chip8->waitForKey ? ", waiting for a key (k sets held keys)" : "");
+}
+
+static void debug_print_registers(chip8_t* chip8) {
+    printf("PC %04X  I %04X  SP %02X  DT %02X  ST %02X  keys %04X\n", chip8->programCounter, chip8->indexRegister, chip8->stackPointer,
+           chip8->delayTimer, chip8->soundTimer, chip8->keys);
+    for (int i = 0; i < 16; i++) printf("V%X %02X%s", i, chip8->registers[i], i % 8 == 7 ? "\n" : "  ");
+    printf("Stack:");
+    for (int i = 1; i <= chip8->stackPointer && i <= 16; i++) printf(" %04X", chip8->stack[i & 0xF]);
+    printf("\n");
+}
+
+static void debug_print_points(chip8_debug_t* debug) {
+    char name[4];
+    printf("Breakpoints:");
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (BIT_TEST(debug->breakpoints, i)) printf(" %04X", i);
+    }
+    printf("\nWatchpoints:");
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (BIT_TEST(debug->watchpoints, i) && (i == 0 || !BIT_TEST(debug->watchpoints, i - 1))) {
+            int end = i;
+            while (end + 1 < MEMORY_SIZE && BIT_TEST(debug->watchpoints, end + 1)) end++;
+            if (end > i) printf(" %04X-%04X", i, end);
+            else printf(" %04X", i);
+        }
+    }
+    printf("\nConditions:\n");
+    for (int i = 0; i < debug->conditionCount; i++) {
+        debug_condition_t* condition = &debug->conditions[i];
+        if (condition->address == DEBUG_NO_ADDRESS) printf("  when");
+        else printf("  at %04X if", condition->address);
+        printf(" %s %s %X\n", debug_register_name(condition->reg, name), compareNames[condition->compare], condition->value);
+    }
+}
+
+static void debug_print_help() {
+    printf(" s [n]                 step n instruction slots (default: 1), into calls\n"
+           " n                     step over: run a 2nnn call until it returns\n"
+           " c                     continue until a breakpoint, watchpoint or condition stops it, the CPU halts or Ctrl+C\n"
+           " b <addr>              break before the instruction at addr\n"
+           " b <addr> if <r> <op> <value>   break there only if the condition holds; r is V0-VF, I, DT or ST,\n"
+           "                       op is ==, !=, <, <=, > or >=\n"
+           " when <r> <op> <value> stop after any instruction that makes the condition true\n"
+           " d <addr> | d when     delete the breakpoint at addr with its conditions, or every when condition\n"
+           " w <addr> [length]     stop after the program writes to the bytes at addr (default length: 1)\n"
+           " u <addr> [length]     remove watchpoints\n"
+           " i                     list breakpoints, watchpoints and conditions\n"
+           " r                     registers and stack; p also prints the screen\n"
+           " x <addr> [length]     dump memory (default length: 10)\n"
+           " l [addr] [n]          disassemble n instructions (default: 10 from PC)\n"
+           " k <keys>              set held keys, bit n for key n\n"
+           " q                     quit\n"
+           " Addresses, values, lengths and keys are hexadecimal. An empty line repeats s or n.\n");
+}
@@ -0,0 +1,85 @@
+/*
+Header file for the debugger
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#include "cpu.h"
+
+#define DEBUG_MAX_CONDITIONS 32
+#define DEBUG_NO_ADDRESS -1 // condition checked after every instruction instead of at a breakpoint
+
+typedef enum debug_stop {
+    DEBUG_STEPPED,     // the requested instructions ran
+    DEBUG_BREAKPOINT,  // about to execute an instruction at a breakpoint
+    DEBUG_WATCHPOINT,  // the last instruction wrote to a watched address
+    DEBUG_CONDITION,   // a register condition became true
+    DEBUG_HALTED,
+    DEBUG_INTERRUPTED  // Ctrl+C
+} debug_stop_t;
+
+typedef enum debug_compare { DEBUG_EQ, DEBUG_NE, DEBUG_LT, DEBUG_LE, DEBUG_GT, DEBUG_GE } debug_compare_t;
+
+#define DEBUG_REG_I  16 // registers a condition can test besides V0-VF
+#define DEBUG_REG_DT 17
+#define DEBUG_REG_ST 18
+
+typedef struct debug_condition {
+    uint8_t reg;     // 0-F for Vx or DEBUG_REG_*
+    uint8_t compare; // debug_compare_t
+    uint16_t value;
+    int address;     // breakpoint the condition belongs to, or DEBUG_NO_ADDRESS
+    bool held;       // was true after the previous instruction, conditions without an address only stop when they become true
+} debug_condition_t;
+
+/*
+Breakpoints and watchpoints are one bit per address, so checking one costs the same however many are set.
+Breakpoints are checked by debug_run() before every instruction it steps. Watchpoints are checked by
+chip8_invalidate(), which every memory write of the program already goes through, while chip8->debug points here.
+With nothing set, debug_run() runs whole frames through chip8_run() with any engine and no checks at all.
+*/
+typedef struct chip8_debug {
+    uint64_t breakpoints[MEMORY_SIZE / 64];
+    uint64_t watchpoints[MEMORY_SIZE / 64];
+    int breakpointCount;
+    int watchpointCount;
+    debug_condition_t conditions[DEBUG_MAX_CONDITIONS];
+    int conditionCount;
+    bool watchHit;        // set by debug_write()
+    uint16_t watchAddress; // first watched address written
+} chip8_debug_t;
+
+chip8_debug_t* debug_create();
+void debug_free(chip8_debug_t* debug);
+int debug_set_breakpoint(chip8_debug_t* debug, uint16_t address, bool set);
+int debug_set_watchpoint(chip8_debug_t* debug, chip8_t* chip8, uint16_t address, uint32_t length, bool set);
+int debug_add_condition(chip8_debug_t* debug, chip8_t* chip8, int address, uint8_t reg, debug_compare_t compare, uint16_t value);
+debug_stop_t debug_run(chip8_t* chip8, chip8_debug_t* debug, unsigned long instructionLimit);
+debug_stop_t debug_step_over(chip8_t* chip8, chip8_debug_t* debug);
+int debug_shell(chip8_t* chip8, chip8_debug_t* debug, FILE* in);
+
+// called by chip8_invalidate() for every memory write of the program, [address] + [length] doesn't wrap
+static inline void debug_write(chip8_debug_t* debug, uint16_t address, uint16_t length) {
+    if (debug->watchpointCount == 0 || debug->watchHit) return;
+    for (uint32_t i = address; i < (uint32_t)address + length; i++) {
+        if (debug->watchpoints[i >> 6] & (1ULL << (i & 63))) {
+            debug->watchHit = true;
+            debug->watchAddress = i;
+            return;
+        }
+    }
+}
+#endif
@@ -0,0 +1,92 @@
+/*
+Disassembler
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "disasm.h"
+#include "ops.h"
+
+/*
+Writes the instruction at [address] as text (Cowgod's mnemonics, plus the SUPER-CHIP and XO-CHIP ones) to [buffer].
+It is decoded with chip8_decode() for the profile and quirks of [chip8], so the text shows what the emulator would
+execute there: opcodes the machine doesn't have come out as "???", or as NOP where the decoder ignores them.
+Quirk variants of a handler share its mnemonic, except Bxnn with QUIRK_JUMP and the shifts with QUIRK_SHIFT.
+Returns the length of the instruction in bytes, 4 for XO-CHIP's F000 nnnn and 2 for everything else.
+*/
+int disasm(chip8_t* chip8, uint16_t address, char* buffer, size_t size) {
+    uint16_t instr = (chip8->memory[address & chip8->addressMask] << 8) | chip8->memory[(address + 1) & chip8->addressMask];
+    uint16_t next = (chip8->memory[(address + 2) & chip8->addressMask] << 8) | chip8->memory[(address + 3) & chip8->addressMask];
+    chip8_op_t op;
+
+    chip8_decode(instr, &op, chip8->profile, chip8->quirks);
+    switch (op.handler) {
+        case OP_ILLEGAL: snprintf(buffer, size, "??? %04X", instr); break;
+        case OP_NOP: snprintf(buffer, size, "NOP"); break;
+        case OP_CLS: snprintf(buffer, size, "CLS"); break;
+        case OP_RET: snprintf(buffer, size, "RET"); break;
+        case OP_JP: snprintf(buffer, size, "JP %03X", op.nnn); break;
+        case OP_CALL: snprintf(buffer, size, "CALL %03X", op.nnn); break;
+        case OP_SE_KK: snprintf(buffer, size, "SE V%X, %02X", op.x, op.kk); break;
+        case OP_SNE_KK: snprintf(buffer, size, "SNE V%X, %02X", op.x, op.kk); break;
+        case OP_SE_XY: snprintf(buffer, size, "SE V%X, V%X", op.x, op.y); break;
+        case OP_LD_KK: snprintf(buffer, size, "LD V%X, %02X", op.x, op.kk); break;
+        case OP_ADD_KK: snprintf(buffer, size, "ADD V%X, %02X", op.x, op.kk); break;
+        case OP_LD_XY: snprintf(buffer, size, "LD V%X, V%X", op.x, op.y); break;
+        case OP_OR: case OP_OR_VF: snprintf(buffer, size, "OR V%X, V%X", op.x, op.y); break;
+        case OP_AND: case OP_AND_VF: snprintf(buffer, size, "AND V%X, V%X", op.x, op.y); break;
+        case OP_XOR: case OP_XOR_VF: snprintf(buffer, size, "XOR V%X, V%X", op.x, op.y); break;
+        case OP_ADD_XY: snprintf(buffer, size, "ADD V%X, V%X", op.x, op.y); break;
+        case OP_SUB: snprintf(buffer, size, "SUB V%X, V%X", op.x, op.y); break;
+        case OP_SHR: snprintf(buffer, size, "SHR V%X, V%X", op.x, op.y); break;
+        case OP_SHR_X: snprintf(buffer, size, "SHR V%X", op.x); break;
+        case OP_SUBN: snprintf(buffer, size, "SUBN V%X, V%X", op.x, op.y); break;
+        case OP_SHL: snprintf(buffer, size, "SHL V%X, V%X", op.x, op.y); break;
+        case OP_SHL_X: snprintf(buffer, size, "SHL V%X", op.x); break;
+        case OP_SNE_XY: snprintf(buffer, size, "SNE V%X, V%X", op.x, op.y); break;
+        case OP_LD_I: snprintf(buffer, size, "LD I, %03X", op.nnn); break;
+        case OP_JP_V0: snprintf(buffer, size, "JP V0, %03X", op.nnn); break;
+        case OP_JP_VX: snprintf(buffer, size, "JP V%X, %03X", op.x, op.nnn); break;
+        case OP_RND: snprintf(buffer, size, "RND V%X, %02X", op.x, op.kk); break;
+        case OP_DRW: case OP_DRW_CLIP: snprintf(buffer, size, "DRW V%X, V%X, %X", op.x, op.y, op.n); break;
+        case OP_SKP: snprintf(buffer, size, "SKP V%X", op.x); break;
+        case OP_SKNP: snprintf(buffer, size, "SKNP V%X", op.x); break;
+        case OP_LD_X_DT: snprintf(buffer, size, "LD V%X, DT", op.x); break;
+        case OP_LD_K: snprintf(buffer, size, "LD V%X, K", op.x); break;
+        case OP_LD_DT: snprintf(buffer, size, "LD DT, V%X", op.x); break;
+        case OP_LD_ST: snprintf(buffer, size, "LD ST, V%X", op.x); break;
+        case OP_ADD_I: snprintf(buffer, size, "ADD I, V%X", op.x); break;
+        case OP_LD_F: snprintf(buffer, size, "LD F, V%X", op.x); break;
+        case OP_LD_B: snprintf(buffer, size, "LD B, V%X", op.x); break;
+        case OP_LD_MEM: case OP_LD_MEM_KEEP: snprintf(buffer, size, "LD [I], V%X", op.x); break;
+        case OP_LD_REG: case OP_LD_REG_KEEP: snprintf(buffer, size, "LD V%X, [I]", op.x); break;
+        case OP_SCD: snprintf(buffer, size, "SCD %X", op.n); break;
+        case OP_SCR: snprintf(buffer, size, "SCR"); break;
+        case OP_SCL: snprintf(buffer, size, "SCL"); break;
+        case OP_EXIT: snprintf(buffer, size, "EXIT"); break;
+        case OP_LOW: snprintf(buffer, size, "LOW"); break;
+        case OP_HIGH: snprintf(buffer, size, "HIGH"); break;
+        case OP_LD_HF: snprintf(buffer, size, "LD HF, V%X", op.x); break;
+        case OP_LD_R: snprintf(buffer, size, "LD R, V%X", op.x); break;
+        case OP_LD_X_R: snprintf(buffer, size, "LD V%X, R", op.x); break;
+        case OP_SCU: snprintf(buffer, size, "SCU %X", op.n); break;
+        case OP_SAVE: snprintf(buffer, size, "SAVE V%X - V%X", op.x, op.y); break;
+        case OP_LOAD: snprintf(buffer, size, "LOAD V%X - V%X", op.x, op.y); break;
+        case OP_LD_I_LONG: snprintf(buffer, size, "LD I, %04X", next); return 4;
+        case OP_PLANE: snprintf(buffer, size, "PLANE %X", op.x); break;
+        case OP_AUDIO: snprintf(buffer, size, "AUDIO"); break;
+        case OP_PITCH: snprintf(buffer, size, "PITCH V%X", op.x); break;
+        default: snprintf(buffer, size, "??? %04X", instr); break;
+    }
+    return 2;
+}
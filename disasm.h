@@ -0,0 +1,25 @@
+/*
+Header file for the disassembler
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DISASM_H
+#define DISASM_H
+
+#include "cpu.h"
+
+#define DISASM_LENGTH 32 // enough for any instruction, terminator included
+
+int disasm(chip8_t* chip8, uint16_t address, char* buffer, size_t size);
+#endif
@@ -0,0 +1,609 @@
+/*
+Coverage-guided fuzzer
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "fuzz.h"
+#include "ops.h"
+#include "movie.h"
+#include "pool.h"
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FUZZ_BITMAP_WORDS (MEMORY_SIZE / 64)
+#define FUZZ_MAX_MUTATIONS 4 // stacked on top of each other per run
+#define FUZZ_MAX_SPAN 60     // frames, one second
+#define FUZZ_SAVE_INTERVAL 10 // status lines between coverage saves
+
+/*
+Every worker repeatedly takes a random input from the corpus, mutates it and runs it from reset on its own chip8_t.
+The addresses instructions were fetched from make up the coverage of a run; an input that reaches an address
+no run reached before joins the corpus. The first input to hit every fault at every address is kept as a crash.
+Both are written out as movies, so they replay with -H -P like recorded ones. Directory layout:
+    corpus/<hash>.movie          inputs that found new coverage
+    crashes/<fault>-<PC>.movie   e.g. stack-overflow-0234.movie
+    <name>.ch8                   next to a movie if the input changed ROM bytes, replay it with this ROM
+    coverage                     FUZZ_COVERAGE_MAGIC, the hash of the ROM and one bit per address, written periodically
+*/
+typedef struct fuzz_input {
+    uint32_t seed;
+    uint16_t* keys; // held keys before every frame
+    uint8_t* rom;   // NULL if it is the original ROM
+} fuzz_input_t;
+
+typedef struct fuzz {
+    fuzz_options_t* options;
+    const char* directory;
+    uint32_t romHash; // movie_rom_hash() of the original ROM
+    uint64_t coverage[FUZZ_BITMAP_WORDS];     // merged from all workers with atomic ORs
+    uint64_t faults[FUZZ_FAULT_COUNT][FUZZ_BITMAP_WORDS]; // addresses every fault was seen at
+    pthread_mutex_t lock; // corpus
+    fuzz_input_t* corpus;
+    int corpusCount;
+    int corpusCapacity;
+    unsigned long runs;
+    unsigned long instructions;
+    unsigned long crashes;
+} fuzz_t;
+
+typedef struct fuzz_worker {
+    fuzz_t* fuzz;
+    pthread_t thread;
+    bool started;
+    uint32_t random; // xorshift32 state, different for every worker
+    fuzz_input_t input;
+    uint64_t coverage[FUZZ_BITMAP_WORDS]; // of the current run
+    unsigned long endFrame; // end line of the current run, only filled in if it gets saved
+    uint32_t checksum;
+    chip8_t chip8;
+} __attribute__((aligned(64))) fuzz_worker_t;
+
+static volatile sig_atomic_t fuzzInterrupted;
+
+static void fuzz_interrupt(int signal);
+static void* fuzz_worker_main(void* arg);
+static fuzz_fault_t fuzz_execute(fuzz_worker_t* worker, uint16_t* faultAddress);
+static void fuzz_mutate(fuzz_worker_t* worker);
+static void fuzz_pick(fuzz_worker_t* worker);
+static bool fuzz_merge(fuzz_t* fuzz, const uint64_t* coverage, int words);
+static int fuzz_add(fuzz_t* fuzz, const fuzz_input_t* input);
+static void fuzz_save(fuzz_worker_t* worker, const char* name);
+static int fuzz_load_corpus(fuzz_t* fuzz);
+static int fuzz_load_coverage(fuzz_t* fuzz);
+static void fuzz_load_crashes(fuzz_t* fuzz);
+static int fuzz_save_coverage(fuzz_t* fuzz);
+static int fuzz_coverage_count(fuzz_t* fuzz);
+static uint32_t fuzz_random(fuzz_worker_t* worker);
+static bool fuzz_stopped(fuzz_t* fuzz);
+
+static const char* faultNames[FUZZ_FAULT_COUNT] = { "none", "pc-limit", "stack-overflow", "stack-underflow", "illegal" };
+
+const char* fuzz_fault_name(fuzz_fault_t fault) {
+    return fault < FUZZ_FAULT_COUNT ? faultNames[fault] : "unknown";
+}
+
+/*
+Fuzzes [options->rom] on a pool of worker threads until [options->instructionLimit] instructions ran in total,
+or until interrupted with Ctrl+C. Resumes from the corpus and coverage in [directory] if there are any.
+Prints a status line every second. Returns 1 if the fuzzer couldn't be set up, 0 otherwise.
+*/
+int fuzz_run(const char* directory, fuzz_options_t* options) {
+    fuzz_t* fuzz;
+    fuzz_worker_t* workers;
+    fuzz_input_t first = { .seed = options->seed };
+    char path[POOL_MAX_PATH];
+    int threads = options->threads;
+    unsigned long lastRuns = 0;
+    int status = 0;
+    struct sigaction action = { .sa_handler = fuzz_interrupt }, previous;
+
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+    if (threads < 1) threads = 1;
+
+    // the subdirectories are created up front, so saving an input never has to
+    if (mkdir(directory, 0755) && errno != EEXIST) { printf("Failed to create \"%s\": %s\n", directory, strerror(errno)); return 1; }
+    snprintf(path, sizeof(path), "%s/corpus", directory);
+    if (mkdir(path, 0755) && errno != EEXIST) { printf("Failed to create \"%s\": %s\n", path, strerror(errno)); return 1; }
+    snprintf(path, sizeof(path), "%s/crashes", directory);
+    if (mkdir(path, 0755) && errno != EEXIST) { printf("Failed to create \"%s\": %s\n", path, strerror(errno)); return 1; }
+
+    if ((fuzz = calloc(1, sizeof(fuzz_t))) == NULL) { printf("Failed to allocate fuzzer\n"); return 1; }
+    fuzz->options = options;
+    fuzz->directory = directory;
+    pthread_mutex_init(&fuzz->lock, NULL);
+    workers = aligned_alloc(64, sizeof(fuzz_worker_t) * threads);
+    if (workers == NULL) { printf("Failed to allocate %i fuzzer workers\n", threads); free(fuzz); return 1; }
+    memset(workers, 0x0, sizeof(fuzz_worker_t) * threads);
+
+    // hash of the original ROM, as a movie recorded with it would have
+    if (chip8_set_profile(&workers[0].chip8, options->profile)) { printf("Failed to allocate decode cache\n"); status = 1; goto done; }
+    chip8_reset(&workers[0].chip8, options->quirks);
+    if (chip8_load_rom(&workers[0].chip8, options->rom, options->romLength) < 0) { printf("ROM doesn't fit in memory\n"); status = 1; goto done; }
+    fuzz->romHash = movie_rom_hash(&workers[0].chip8);
+
+    if (fuzz_load_coverage(fuzz) || fuzz_load_corpus(fuzz)) { status = 1; goto done; }
+    fuzz_load_crashes(fuzz);
+    if (fuzz->corpusCount == 0) { // no keys held at all
+        if ((first.keys = calloc(options->frames, sizeof(uint16_t))) == NULL || fuzz_add(fuzz, &first)) { free(first.keys); status = 1; goto done; }
+        free(first.keys);
+    }
+    printf("Fuzzing with %i threads, %i inputs in the corpus, %i addresses covered; Ctrl+C stops\n",
+           threads, fuzz->corpusCount, fuzz_coverage_count(fuzz));
+
+    fuzzInterrupted = 0;
+    sigaction(SIGINT, &action, &previous);
+    for (int i = 0; i < threads; i++) {
+        fuzz_worker_t* worker = &workers[i];
+        worker->fuzz = fuzz;
+        worker->random = (options->seed ^ (0x9E3779B9u * (i + 1))) | 1;
+        worker->input.keys = malloc(sizeof(uint16_t) * options->frames);
+        worker->input.rom = options->mutateRom ? malloc(options->romLength) : NULL;
+        if (worker->input.keys == NULL || (options->mutateRom && worker->input.rom == NULL)) { printf("Failed to allocate fuzzer worker %i\n", i); fuzzInterrupted = 1; break; }
+        if (pthread_create(&worker->thread, NULL, fuzz_worker_main, worker) != 0) { printf("Failed to start fuzzer worker %i\n", i); fuzzInterrupted = 1; break; }
+        worker->started = true;
+    }
+
+    for (int seconds = 1; !fuzz_stopped(fuzz); seconds++) {
+        sleep(1);
+        unsigned long runs = __atomic_load_n(&fuzz->runs, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&fuzz->lock);
+        printf("%4is: %lu runs (%lu/s), %lu instructions, %i inputs, %i addresses covered, %lu crashes\n", seconds, runs, runs - lastRuns,
+               __atomic_load_n(&fuzz->instructions, __ATOMIC_RELAXED), fuzz->corpusCount, fuzz_coverage_count(fuzz),
+               __atomic_load_n(&fuzz->crashes, __ATOMIC_RELAXED));
+        pthread_mutex_unlock(&fuzz->lock);
+        fflush(stdout);
+        lastRuns = runs;
+        if (seconds % FUZZ_SAVE_INTERVAL == 0) fuzz_save_coverage(fuzz);
+    }
+    fuzzInterrupted = 1;
+    for (int i = 0; i < threads; i++) {
+        if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    }
+    sigaction(SIGINT, &previous, NULL);
+    status = fuzz_save_coverage(fuzz);
+    printf("Done: %lu runs, %lu instructions, %i inputs, %i addresses covered, %lu crashes in \"%s\"\n",
+           fuzz->runs, fuzz->instructions, fuzz->corpusCount, fuzz_coverage_count(fuzz), fuzz->crashes, directory);
+
+done:
+    for (int i = 0; i < threads; i++) {
+        free(workers[i].input.keys);
+        free(workers[i].input.rom);
+        chip8_free(&workers[i].chip8);
+    }
+    for (int i = 0; i < fuzz->corpusCount; i++) {
+        free(fuzz->corpus[i].keys);
+        free(fuzz->corpus[i].rom);
+    }
+    free(fuzz->corpus);
+    pthread_mutex_destroy(&fuzz->lock);
+    free(workers);
+    free(fuzz);
+    return status;
+}
+
+static void fuzz_interrupt(int signal) {
+    fuzzInterrupted = 1;
+}
+
+static bool fuzz_stopped(fuzz_t* fuzz) {
+    unsigned long limit = fuzz->options->instructionLimit;
+    return fuzzInterrupted || (limit != 0 && __atomic_load_n(&fuzz->instructions, __ATOMIC_RELAXED) >= limit);
+}
+
+static void* fuzz_worker_main(void* arg) {
+    fuzz_worker_t* worker = arg;
+    fuzz_t* fuzz = worker->fuzz;
+    char name[64];
+    uint16_t faultAddress = 0;
+    fuzz_fault_t fault;
+    bool crashed, covered;
+    uint64_t bit;
+
+    if (chip8_set_profile(&worker->chip8, fuzz->options->profile)) { printf("Failed to allocate decode cache for fuzz worker\n"); return NULL; }
+    while (!fuzz_stopped(fuzz)) {
+        fuzz_pick(worker);
+        fuzz_mutate(worker);
+        fault = fuzz_execute(worker, &faultAddress);
+        __atomic_add_fetch(&fuzz->runs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&fuzz->instructions, worker->chip8.cycles, __ATOMIC_RELAXED);
+
+        // one crash per fault and address
+        bit = 1ULL << (faultAddress & 63);
+        crashed = fault != FUZZ_NONE && !(__atomic_fetch_or(&fuzz->faults[fault][faultAddress >> 6], bit, __ATOMIC_RELAXED) & bit);
+        covered = fuzz_merge(fuzz, worker->coverage, (worker->chip8.addressMask + 1) / 64);
+        if (!crashed && !covered) continue;
+
+        worker->endFrame = movie_end_frame(&worker->chip8);
+        worker->checksum = chip8_checksum(&worker->chip8);
+        if (crashed) {
+            __atomic_add_fetch(&fuzz->crashes, 1, __ATOMIC_RELAXED);
+            snprintf(name, sizeof(name), "crashes/%s-%04X", fuzz_fault_name(fault), faultAddress);
+            fuzz_save(worker, name);
+        }
+        if (covered) {
+            pthread_mutex_lock(&fuzz->lock);
+            int failed = fuzz_add(fuzz, &worker->input);
+            pthread_mutex_unlock(&fuzz->lock);
+            if (!failed) {
+                uint32_t hash = romdb_hash((const uint8_t*)worker->input.keys, sizeof(uint16_t) * fuzz->options->frames) ^ worker->input.seed;
+                if (worker->input.rom != NULL) hash ^= romdb_hash(worker->input.rom, fuzz->options->romLength) * 31;
+                snprintf(name, sizeof(name), "corpus/%08X", hash);
+                fuzz_save(worker, name);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+Runs the worker's input from reset the way replaying its movie with -H -P would: chip8_run() one frame at a time
+with the keys set before every frame. Instructions are stepped one by one to record coverage and catch faults
+before chip8_step() prints about them. The run stops at the end of the frame with the first fault, or when the CPU halts.
+Returns the first fault, and the address of the instruction that caused it in [faultAddress].
+*/
+static fuzz_fault_t fuzz_execute(fuzz_worker_t* worker, uint16_t* faultAddress) {
+    chip8_t* chip8 = &worker->chip8;
+    fuzz_input_t* input = &worker->input;
+    fuzz_options_t* options = worker->fuzz->options;
+    fuzz_fault_t fault = FUZZ_NONE, found;
+    const chip8_op_t* op;
+    uint16_t pc;
+    int slots;
+
+    chip8_reset(chip8, options->quirks);
+    chip8->cpuClock = options->clock;
+    chip8_seed(chip8, input->seed);
+    chip8_load_rom(chip8, input->rom != NULL ? input->rom : options->rom, options->romLength);
+    memset(worker->coverage, 0x0, (chip8->addressMask + 1) / 8);
+
+    while (chip8->frames < options->frames && fault == FUZZ_NONE && !chip8->cpuHalted) {
+        chip8_set_keys(chip8, input->keys[chip8->frames]);
+        chip8->frameCycles += chip8->cpuClock;
+        slots = chip8->frameCycles / TIMER_CLOCK;
+        chip8->frameCycles %= TIMER_CLOCK;
+        for (int i = 0; i < slots && !chip8->cpuHalted; i++) {
+            pc = chip8->programCounter;
+            if (pc > chip8->addressMask - 1) { // halts like chip8_step() does, without the message
+                if (fault == FUZZ_NONE) { fault = FUZZ_PC_LIMIT; *faultAddress = pc; }
+                chip8->cpuHalted = true;
+                break;
+            }
+            if (chip8->waitForKey) continue;
+            worker->coverage[pc >> 6] |= 1ULL << (pc & 63);
+            op = chip8_fetch(chip8, pc);
+            found = FUZZ_NONE;
+            switch (op->handler) {
+                case OP_ILLEGAL: // skipped without the message
+                    if (fault == FUZZ_NONE) { fault = FUZZ_ILLEGAL; *faultAddress = pc; }
+                    chip8->programCounter += 2;
+                    chip8->cycles++;
+                    continue;
+                case OP_EXIT: // halts without the message
+                    chip8->cpuHalted = true;
+                    chip8->cycles++;
+                    continue;
+                case OP_CALL:
+                    if (chip8->stackPointer >= 16) found = FUZZ_STACK_OVERFLOW;
+                    break;
+                case OP_RET:
+                    if (chip8->stackPointer == 0) found = FUZZ_STACK_UNDERFLOW;
+                    break;
+            }
+            if (found != FUZZ_NONE && fault == FUZZ_NONE) { fault = found; *faultAddress = pc; }
+            chip8_step(chip8);
+        }
+        if (chip8->cpuHalted) break; // chip8_run() returns before the timer tick
+        chip8_tick_timers(chip8);
+        chip8->frames++;
+    }
+    return fault;
+}
+
+// copies a random corpus entry into the worker's input, the keys past its end are released
+static void fuzz_pick(fuzz_worker_t* worker) {
+    fuzz_t* fuzz = worker->fuzz;
+    fuzz_options_t* options = fuzz->options;
+    fuzz_input_t* entry;
+
+    pthread_mutex_lock(&fuzz->lock);
+    entry = &fuzz->corpus[fuzz_random(worker) % fuzz->corpusCount];
+    worker->input.seed = entry->seed;
+    memcpy(worker->input.keys, entry->keys, sizeof(uint16_t) * options->frames);
+    if (options->mutateRom) memcpy(worker->input.rom, entry->rom != NULL ? entry->rom : options->rom, options->romLength);
+    pthread_mutex_unlock(&fuzz->lock);
+}
+
+/*
+Applies up to FUZZ_MAX_MUTATIONS random changes to the worker's input. Most of them change which keys
+are held over a span of frames; the others move the input in time, splice in keys from another corpus entry,
+change the seed or, with mutateRom, a ROM byte.
+*/
+static void fuzz_mutate(fuzz_worker_t* worker) {
+    fuzz_t* fuzz = worker->fuzz;
+    fuzz_options_t* options = fuzz->options;
+    fuzz_input_t* input = &worker->input;
+    unsigned long frames = options->frames;
+    int count = 1 + fuzz_random(worker) % FUZZ_MAX_MUTATIONS;
+    int kinds = options->mutateRom && options->romLength > 0 ? 8 : 7;
+
+    for (int m = 0; m < count; m++) {
+        unsigned long start = fuzz_random(worker) % frames;
+        unsigned long length = 1 + fuzz_random(worker) % FUZZ_MAX_SPAN;
+        uint16_t key = 1 << (fuzz_random(worker) % 16);
+        if (length > frames - start) length = frames - start;
+
+        switch (fuzz_random(worker) % kinds) {
+            case 0: // hold a key
+                for (unsigned long f = start; f < start + length; f++) input->keys[f] |= key;
+                break;
+            case 1: // release a key
+                for (unsigned long f = start; f < start + length; f++) input->keys[f] &= ~key;
+                break;
+            case 2: // tap a key for a few frames, programs polling with Ex9E often need less than a second
+                for (unsigned long f = start; f < start + length && f < start + 4; f++) input->keys[f] ^= key;
+                break;
+            case 3: // release everything
+                memset(&input->keys[start], 0x0, sizeof(uint16_t) * length);
+                break;
+            case 4: // move the rest of the input later, repeating the frame before the gap
+                memmove(&input->keys[start + length], &input->keys[start], sizeof(uint16_t) * (frames - start - length));
+                for (unsigned long f = start; f < start + length; f++) input->keys[f] = start > 0 ? input->keys[start - 1] : 0;
+                break;
+            case 5: // move the rest of the input earlier, dropping frames
+                memmove(&input->keys[start], &input->keys[start + length], sizeof(uint16_t) * (frames - start - length));
+                memset(&input->keys[frames - length], 0x0, sizeof(uint16_t) * length);
+                break;
+            case 6: // splice in the same span of another input, or change the seed
+                if (fuzz_random(worker) & 1) { input->seed = fuzz_random(worker); break; }
+                pthread_mutex_lock(&fuzz->lock);
+                memcpy(&input->keys[start], &fuzz->corpus[fuzz_random(worker) % fuzz->corpusCount].keys[start], sizeof(uint16_t) * length);
+                pthread_mutex_unlock(&fuzz->lock);
+                break;
+            case 7: { // flip bits of a ROM byte, or replace it
+                size_t offset = fuzz_random(worker) % options->romLength;
+                if (fuzz_random(worker) & 1) input->rom[offset] ^= 1 << (fuzz_random(worker) % 8);
+                else input->rom[offset] = fuzz_random(worker);
+                break;
+            }
+        }
+    }
+}
+
+// merges the coverage of a run into the global bitmap, returns true if it reached any address for the first time
+static bool fuzz_merge(fuzz_t* fuzz, const uint64_t* coverage, int words) {
+    bool found = false;
+    for (int i = 0; i < words; i++) {
+        if (coverage[i] & ~__atomic_load_n(&fuzz->coverage[i], __ATOMIC_RELAXED)) {
+            if (coverage[i] & ~__atomic_fetch_or(&fuzz->coverage[i], coverage[i], __ATOMIC_RELAXED)) found = true;
+        }
+    }
+    return found;
+}
+
+// appends a copy of [input] to the corpus, the caller holds the lock once workers are running. Returns 1 if out of memory
+static int fuzz_add(fuzz_t* fuzz, const fuzz_input_t* input) {
+    fuzz_options_t* options = fuzz->options;
+    fuzz_input_t* entry;
+    if (fuzz->corpusCount == fuzz->corpusCapacity) {
+        int capacity = fuzz->corpusCapacity ? fuzz->corpusCapacity * 2 : 64;
+        fuzz_input_t* corpus = realloc(fuzz->corpus, sizeof(fuzz_input_t) * capacity);
+        if (corpus == NULL) return 1;
+        fuzz->corpus = corpus;
+        fuzz->corpusCapacity = capacity;
+    }
+    entry = &fuzz->corpus[fuzz->corpusCount];
+    entry->seed = input->seed;
+    entry->keys = malloc(sizeof(uint16_t) * options->frames);
+    entry->rom = input->rom != NULL ? malloc(options->romLength) : NULL;
+    if (entry->keys == NULL || (input->rom != NULL && entry->rom == NULL)) { free(entry->keys); free(entry->rom); return 1; }
+    memcpy(entry->keys, input->keys, sizeof(uint16_t) * options->frames);
+    if (input->rom != NULL) memcpy(entry->rom, input->rom, options->romLength);
+    fuzz->corpusCount++;
+    return 0;
+}
+
+/*
+Writes the worker's input as <directory>/<name>.movie, ending where the run that was just executed ended
+(endFrame and checksum of the worker), plus <directory>/<name>.ch8 if the ROM was mutated.
+*/
+static void fuzz_save(fuzz_worker_t* worker, const char* name) {
+    fuzz_t* fuzz = worker->fuzz;
+    fuzz_options_t* options = fuzz->options;
+    chip8_t* chip8 = &worker->chip8;
+    chip8_movie_t movie = { .seed = worker->input.seed, .profile = options->profile, .quirks = options->quirks, .cpuClock = options->clock,
+                            .romHash = fuzz->romHash, .finished = true, .endFrame = worker->endFrame, .checksum = worker->checksum };
+    uint16_t keys = 0, changed;
+    char path[POOL_MAX_PATH];
+    FILE* file;
+
+    // key changes after the end aren't written
+    for (unsigned long f = 0; f < movie.endFrame; f++) {
+        changed = worker->input.keys[f] ^ keys;
+        movie.count += __builtin_popcount(changed);
+        keys = worker->input.keys[f];
+    }
+    if (movie.count > 0 && (movie.events = malloc(sizeof(movie_event_t) * movie.count)) == NULL) return;
+    movie.count = 0;
+    keys = 0;
+    for (unsigned long f = 0; f < movie.endFrame; f++) {
+        changed = worker->input.keys[f] ^ keys;
+        for (int i = 0; changed >> i; i++) {
+            if (changed & (1 << i)) movie.events[movie.count++] = (movie_event_t){ .frame = f, .key = i, .pressed = (worker->input.keys[f] >> i) & 1 };
+        }
+        keys = worker->input.keys[f];
+    }
+
+    if (worker->input.rom != NULL && memcmp(worker->input.rom, options->rom, options->romLength) != 0) {
+        snprintf(path, sizeof(path), "%s/%s.ch8", fuzz->directory, name);
+        if ((file = fopen(path, "wb")) == NULL || fwrite(worker->input.rom, 1, options->romLength, file) != options->romLength) {
+            printf("Failed to write ROM \"%s\": %s\n", path, strerror(errno));
+        }
+        if (file != NULL) fclose(file);
+        // hashed from a fresh load, the run may have overwritten its own code
+        chip8_reset(chip8, options->quirks);
+        chip8_load_rom(chip8, worker->input.rom, options->romLength);
+        movie.romHash = movie_rom_hash(chip8);
+    }
+    snprintf(path, sizeof(path), "%s/%s.movie", fuzz->directory, name);
+    movie_save(path, &movie);
+    free(movie.events);
+}
+
+/*
+Adds every movie in <directory>/corpus recorded for the same machine, quirks and clock to the corpus,
+with the ROM next to it if there is one. Returns 1 if out of memory.
+*/
+static int fuzz_load_corpus(fuzz_t* fuzz) {
+    fuzz_options_t* options = fuzz->options;
+    char path[POOL_MAX_PATH], romPath[POOL_MAX_PATH];
+    struct dirent* entry;
+    chip8_movie_t* movie;
+    fuzz_input_t input;
+    uint16_t keys;
+    size_t length;
+    FILE* file;
+    int status = 0;
+    DIR* dir;
+
+    snprintf(path, sizeof(path), "%s/corpus", fuzz->directory);
+    if ((dir = opendir(path)) == NULL) return 0;
+    input.keys = malloc(sizeof(uint16_t) * options->frames);
+    input.rom = malloc(options->romLength + 1);
+    if (input.keys == NULL || input.rom == NULL) { closedir(dir); free(input.keys); free(input.rom); return 1; }
+
+    while (status == 0 && (entry = readdir(dir)) != NULL) {
+        length = strlen(entry->d_name);
+        if (length < 6 || strcmp(entry->d_name + length - 6, ".movie") != 0) continue;
+        snprintf(path, sizeof(path), "%s/corpus/%s", fuzz->directory, entry->d_name);
+        if ((movie = movie_open(path)) == NULL) continue;
+        if (movie->profile != options->profile || movie->quirks != options->quirks || movie->cpuClock != options->clock) {
+            printf("Skipping \"%s\", it was recorded with a different machine, quirks or clock\n", path);
+            movie_free(movie);
+            continue;
+        }
+        input.seed = movie->seed;
+        keys = 0;
+        for (unsigned long f = 0; f < options->frames; f++) {
+            while (movie->position < movie->count && movie->events[movie->position].frame <= f) {
+                movie_event_t* event = &movie->events[movie->position++];
+                keys = event->pressed ? keys | 1 << event->key : keys & ~(1 << event->key);
+            }
+            input.keys[f] = keys;
+        }
+        // the ROM it changed, only used if ROM bytes are mutated in this run too
+        snprintf(romPath, sizeof(romPath), "%s/corpus/%.*s.ch8", fuzz->directory, (int)length - 6, entry->d_name);
+        bool mutated = false;
+        if (options->mutateRom && (file = fopen(romPath, "rb")) != NULL) {
+            mutated = fread(input.rom, 1, options->romLength + 1, file) == options->romLength;
+            fclose(file);
+        }
+        if (!mutated && movie->romHash != fuzz->romHash) {
+            printf("Skipping \"%s\", it was recorded with a different ROM\n", path);
+            movie_free(movie);
+            continue;
+        }
+        fuzz_input_t copy = { .seed = input.seed, .keys = input.keys, .rom = mutated ? input.rom : NULL };
+        status = fuzz_add(fuzz, &copy);
+        movie_free(movie);
+    }
+    closedir(dir);
+    free(input.keys);
+    free(input.rom);
+    return status;
+}
+
+// marks the faults saved by earlier runs as seen, from the names of the movies in <directory>/crashes
+static void fuzz_load_crashes(fuzz_t* fuzz) {
+    char path[POOL_MAX_PATH];
+    struct dirent* entry;
+    unsigned int address;
+    size_t length;
+    DIR* dir;
+
+    snprintf(path, sizeof(path), "%s/crashes", fuzz->directory);
+    if ((dir = opendir(path)) == NULL) return;
+    while ((entry = readdir(dir)) != NULL) {
+        for (int fault = FUZZ_NONE + 1; fault < FUZZ_FAULT_COUNT; fault++) {
+            length = strlen(faultNames[fault]);
+            // <fault>-<PC>.movie exactly, the ROM next to it isn't counted again
+            if (strncmp(entry->d_name, faultNames[fault], length) != 0 || sscanf(entry->d_name + length, "-%4X", &address) != 1 ||
+                strlen(entry->d_name) != length + 5 + 6 || strcmp(entry->d_name + length + 5, ".movie") != 0) continue;
+            fuzz->faults[fault][(address & 0xFFFF) >> 6] |= 1ULL << (address & 63);
+            fuzz->crashes++;
+        }
+    }
+    closedir(dir);
+}
+
+// ORs <directory>/coverage into the bitmap, if it was written for the same ROM. Returns 1 if it exists but can't be read
+static int fuzz_load_coverage(fuzz_t* fuzz) {
+    char path[POOL_MAX_PATH];
+    char magic[4];
+    uint32_t romHash;
+    uint64_t coverage[FUZZ_BITMAP_WORDS];
+    FILE* file;
+
+    snprintf(path, sizeof(path), "%s/coverage", fuzz->directory);
+    if ((file = fopen(path, "rb")) == NULL) return errno == ENOENT ? 0 : (printf("Failed to open \"%s\": %s\n", path, strerror(errno)), 1);
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, FUZZ_COVERAGE_MAGIC, 4) != 0 || fread(&romHash, sizeof(romHash), 1, file) != 1 ||
+        fread(coverage, sizeof(coverage), 1, file) != 1) {
+        printf("Invalid coverage file \"%s\"\n", path);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+    if (romHash != fuzz->romHash) { printf("Ignoring \"%s\", it was written for a different ROM\n", path); return 0; }
+    for (int i = 0; i < FUZZ_BITMAP_WORDS; i++) fuzz->coverage[i] |= coverage[i];
+    return 0;
+}
+
+// writes the bitmap to <directory>/coverage through a temporary file, so a crash never leaves half of it behind
+static int fuzz_save_coverage(fuzz_t* fuzz) {
+    char path[POOL_MAX_PATH], temporary[POOL_MAX_PATH];
+    uint64_t coverage[FUZZ_BITMAP_WORDS];
+    int status;
+    FILE* file;
+
+    for (int i = 0; i < FUZZ_BITMAP_WORDS; i++) coverage[i] = __atomic_load_n(&fuzz->coverage[i], __ATOMIC_RELAXED);
+    snprintf(path, sizeof(path), "%s/coverage", fuzz->directory);
+    snprintf(temporary, sizeof(temporary), "%s/coverage.tmp", fuzz->directory);
+    if ((file = fopen(temporary, "wb")) == NULL) { printf("Failed to create \"%s\": %s\n", temporary, strerror(errno)); return 1; }
+    fwrite(FUZZ_COVERAGE_MAGIC, 1, 4, file);
+    fwrite(&fuzz->romHash, sizeof(fuzz->romHash), 1, file);
+    fwrite(coverage, sizeof(coverage), 1, file);
+    status = ferror(file) != 0;
+    if (fclose(file) != 0) status = 1;
+    if (status == 0 && rename(temporary, path) != 0) status = 1;
+    if (status) printf("Failed to write \"%s\": %s\n", path, strerror(errno));
+    return status;
+}
+
+static int fuzz_coverage_count(fuzz_t* fuzz) {
+    int count = 0;
+    for (int i = 0; i < FUZZ_BITMAP_WORDS; i++) count += __builtin_popcountll(__atomic_load_n(&fuzz->coverage[i], __ATOMIC_RELAXED));
+    return count;
+}
+
+// xorshift32, per worker so threads never share random number state
+static uint32_t fuzz_random(fuzz_worker_t* worker) {
+    uint32_t x = worker->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return worker->random = x;
+}
@@ -0,0 +1,48 @@
+/*
+Header file for the coverage-guided fuzzer
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include "cpu.h"
+
+#define FUZZ_COVERAGE_MAGIC "C8CV"
+
+typedef enum fuzz_fault {
+    FUZZ_NONE,
+    FUZZ_PC_LIMIT,        // PC ran past the end of memory, the CPU halts
+    FUZZ_STACK_OVERFLOW,  // 2nnn with 16 return addresses on the stack, the oldest one gets overwritten
+    FUZZ_STACK_UNDERFLOW, // 00EE with nothing on the stack
+    FUZZ_ILLEGAL,         // an opcode the machine doesn't have, skipped with a message otherwise
+    FUZZ_FAULT_COUNT
+} fuzz_fault_t;
+
+typedef struct fuzz_options {
+    const uint8_t* rom; // the program, as loaded at PROGRAM_ADDRESS
+    size_t romLength;
+    chip8_profile_t profile;
+    uint8_t quirks;
+    int clock;
+    uint32_t seed;        // of the first input, if the corpus is empty
+    unsigned long frames; // emulated frames per run, shorter if a run halts or faults
+    unsigned long instructionLimit; // over all runs, 0 - until interrupted
+    int threads;          // 0 - one per online CPU
+    bool mutateRom;       // inputs may change ROM bytes as well as keys and the seed
+} fuzz_options_t;
+
+int fuzz_run(const char* directory, fuzz_options_t* options);
+const char* fuzz_fault_name(fuzz_fault_t fault);
+#endif
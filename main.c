@@ -1,79 +1,593 @@
 #include "common.h"
 #include <errno.h>
-#include "SDL.h"
+#include <unistd.h>
+#include "backend.h"
 #include "cpu.h"
+#include "pool.h"
+#include "metrics.h"
+#include "state.h"
+#include "rewind.h"
+#include "movie.h"
+#include "romdb.h"
+#include "romlib.h"
+#include "batch.h"
+#include "fuzz.h"
+#include "trace.h"
+#include "debug.h"
+#include "analyze.h"
+#include "block.h"
 
-int load_ROM(char* path);
+#define FRAME_SKIP_LIMIT 4 // frames
+
+static const romlib_rom_t* libraryRom; // picked from the -p library, load_ROM() copies it instead of reading the ROM file
+static bool quirksHint; // the quirks are the machine's defaults, load_ROM() lists the ones the ROM depends on
+
+long load_ROM(chip8_t* chip8, char* path);
+int load_state(chip8_t* chip8, char* path);
+int save_state(chip8_t* chip8, char* path);
+int run_headless(chip8_t* chip8, char* path, uint8_t quirks, int clock, uint32_t seed, unsigned long instructionLimit, unsigned long frameLimit, char* loadStatePath, char* saveStatePath, chip8_movie_t* movie);
+int run_variants(char* path, int profile, uint8_t quirks, int clock, uint32_t seed, unsigned long variants, unsigned long frameLimit);
+int run_fuzzer(char* path, char* directory, fuzz_options_t* options);
+int run_debugger(chip8_t* chip8, char* path, uint8_t quirks, int clock, uint32_t seed, char* loadStatePath);
+int run_analyzer(chip8_t* chip8, char* path, uint8_t quirks);
+int check_movie(chip8_t* chip8, chip8_movie_t* movie);
+int wait_frame(struct timespec* nextFrame);
+void print_usage();
 
 int main(int argc, char* argv[]) {
-    uint8_t extraFlag;
-    bool quirks = false;
-    srand((unsigned) time(NULL));
+    chip8_t chip8 = { 0 };
+    uint8_t extraFlag = 0x0;
+    char* romPath;
+    int quirks = -1;  // -1 until given, then picked by romdb_resolve()
+    int profile = -1;
+    int clock = -1;
+    romdb_t* romdb;
+    char* packPath = NULL;
+    char* buildPath = NULL;
+    romlib_t* library = NULL;
+    romlib_rom_t rom;
+    int romIndex;
+    bool quirksGiven;
+    bool known;
+    bool headless = false;
+    const backend_t* backend = NULL;
+    bool romList = false;
+    bool extendedStatus = false;
+    int threads = 0;
+    chip8_engine_t engine = ENGINE_INTERPRETER;
+    unsigned long instructionLimit = 0;
+    unsigned long frameLimit = 0;
+    unsigned long variants = 0;
+    struct timespec nextFrame;
+    char* metricsTarget = NULL;
+    char* loadStatePath = NULL;
+    char* saveStatePath = NULL;
+    char defaultStatePath[POOL_MAX_PATH];
+    chip8_rewind_t* rewind = NULL;
+    long rewindBudget = REWIND_BUDGET;
+    bool rewinding;
+    uint32_t seed = (uint32_t) time(NULL);
+    char* recordPath = NULL;
+    char* replayPath = NULL;
+    char* fuzzPath = NULL;
+    char* tracePath = NULL;
+    char defaultTracePath[POOL_MAX_PATH];
+    chip8_trace_t* trace = NULL;
+    bool fuzzRom = false;
+    bool debugger = false;
+    bool analyzeRom = false;
+    chip8_movie_t* movie = NULL;
+    uint16_t keys = 0; // held keys, only hotkeys are used while replaying
+    char* keymap = KEYMAP_DEFAULT;
+    int droppedFrames;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Hi:f:lj:e:M:L:S:r:s:R:P:k:m:q:p:b:O:n:z:ZT:Da")) != -1) {
+        switch (opt) {
+            case 'H': headless = true; break;
+            case 'i': instructionLimit = strtoul(optarg, NULL, 0); headless = true; break;
+            case 'f': frameLimit = strtoul(optarg, NULL, 0); headless = true; break;
+            case 'l': romList = true; break;
+            case 'j': threads = atoi(optarg); break;
+            case 'M': metricsTarget = optarg; break;
+            case 'L': loadStatePath = optarg; break;
+            case 'S': saveStatePath = optarg; break;
+            case 'r': rewindBudget = atol(optarg); break;
+            case 's': seed = strtoul(optarg, NULL, 0); break;
+            case 'R': recordPath = optarg; break;
+            case 'P': replayPath = optarg; break;
+            case 'k': keymap = optarg; break;
+            case 'p': packPath = optarg; break;
+            case 'b': buildPath = optarg; break;
+            case 'n': variants = strtoul(optarg, NULL, 0); headless = true; break;
+            case 'z': fuzzPath = optarg; headless = true; break;
+            case 'Z': fuzzRom = true; break;
+            case 'T': tracePath = optarg; break;
+            case 'D': debugger = true; headless = true; break;
+            case 'a': analyzeRom = true; headless = true; break;
+            case 'O':
+                if (offscreen_set_target(optarg)) { printf("Unknown offscreen target \"%s\", expected raw:<path>, ppm:<path> or shm:<name>\n", optarg); return 1; }
+                backend = &offscreenBackend;
+                break;
+            case 'm':
+                if ((profile = chip8_find_profile(optarg)) < 0) { printf("Unknown machine \"%s\"\n", optarg); return 1; }
+                break;
+            case 'q':
+                if ((quirks = chip8_parse_quirks(optarg)) < 0) { printf("Unknown quirks \"%s\"\n", optarg); return 1; }
+                break;
+            case 'e':
+                if (strcmp(optarg, "block") == 0) engine = ENGINE_BLOCK;
+                else if (strcmp(optarg, "interpreter") == 0) engine = ENGINE_INTERPRETER;
+                else { printf("Unknown engine \"%s\"\n", optarg); return 1; }
+                break;
+            default: print_usage(); return 1;
+        }
+    }
+    if (optind == argc && !(romList && packPath != NULL)) { print_usage(); return 1; } // a whole library needs no ROM argument
+    romPath = argv[optind];
+    if (argc - optind > 1 && *argv[optind + 1] == '1') quirks = QUIRKS_LEGACY;
+    romdb = romdb_open(ROMDB_PATH);
+    if (romdb == NULL && errno != ENOENT) return 1;
 
-    if (argc == 1) { printf("chip8emu - a basic CHIP-8 emulator.\nUsage: chip8emu <romfile> <workaround flag>\n\n"
-                  " If the program doesn't work properly, try inputting 1 after ROM file.\n This will enable workarounds for instructions 8XY6, 8XYE, 8X55 and 8X65.\n\n"
-                  " Key mapping:\n  1 2 3 C -> 1 2 3 4\n  4 5 6 D -> Q W E R\n  7 8 9 E -> A S D F\n  A 0 B F -> Z X C V\n"
-                  " Press '[' key to decrease CPU speed, ']' to increase. Press 'P' to reset the system.\n\n"); return 1; }
+    if (buildPath != NULL) {
+        int status = romlib_build(buildPath, romPath, romdb);
+        romdb_free(romdb);
+        return status;
+    }
+    if (packPath != NULL && (library = romlib_open(packPath)) == NULL) { printf("Failed to open ROM library \"%s\": %s\n", packPath, strerror(errno)); return 1; }
+    if (romList) {
+        if (instructionLimit == 0 && frameLimit == 0) { printf("ROM list mode requires an instruction (-i) or frame (-f) limit\n"); return 1; }
+        pool_options_t options = { .quirks = quirks, .profile = profile, .romdb = romdb, .library = library, .instructionLimit = instructionLimit, .frameLimit = frameLimit, .threads = threads, .engine = engine };
+        int status = library != NULL ? pool_run_library(&options) : pool_run_list(romPath, &options);
+        romdb_free(romdb);
+        romlib_close(library);
+        return status;
+    }
+    if (backend == &offscreenBackend) { // -i and -f limit the offscreen run instead
+        if (instructionLimit == 0 && frameLimit == 0 && replayPath == NULL) { printf("Offscreen mode (-O) requires an instruction (-i) or frame (-f) limit, or a movie (-P)\n"); return 1; }
+        headless = false;
+    }
+#ifndef NO_SDL
+    if (backend == NULL) backend = &sdlBackend;
+#endif
+    if (backend == NULL && !headless) { printf("Built without SDL, only the headless (-H) and offscreen (-O) modes are available\n"); return 1; }
+    if (recordPath != NULL && backend != NULL && backend->set_keymap == NULL) { printf("Recording (-R) needs a keyboard, the %s backend has none\n", backend->name); return 1; }
+    if (recordPath != NULL && (headless || replayPath != NULL)) { printf("Recording (-R) needs the interactive mode and can't be combined with -P\n"); return 1; }
+    if (loadStatePath != NULL && (recordPath != NULL || replayPath != NULL)) { printf("Movies start from reset, -L can't be combined with -R or -P\n"); return 1; }
+    if (replayPath != NULL) {
+        if ((movie = movie_open(replayPath)) == NULL) return 1;
+        seed = movie->seed;
+        quirks = movie->quirks;
+        profile = movie->profile;
+    }
+    quirksGiven = quirks >= 0;
+    if (library != NULL) {
+        if ((romIndex = romlib_lookup(library, romPath)) < 0) { printf("No ROM named \"%s\" or with that hash in \"%s\"\n", romPath, packPath); return 1; }
+        romlib_get(library, romIndex, &rom);
+        libraryRom = &rom;
+        romdb_resolve_entry(rom.known ? &rom.info : NULL, &profile, &quirks, &clock);
+        known = rom.known;
+    } else known = romdb_resolve(romdb, romPath, &profile, &quirks, &clock);
+    romdb_free(romdb);
+    quirksHint = !quirksGiven && !known && !analyzeRom; // the analyzer prints them anyway
+    if (chip8_set_profile(&chip8, profile)) { printf("Failed to allocate decode cache\n"); return 1; }
+    if (analyzeRom) {
+        int status = run_analyzer(&chip8, romPath, quirks);
+        romlib_close(library);
+        chip8_free(&chip8);
+        return status;
+    }
+    if (chip8_set_engine(&chip8, engine)) { printf("Failed to set up execution engine\n"); return 1; }
+    if (variants != 0) {
+        if (frameLimit == 0 || instructionLimit != 0 || movie != NULL || loadStatePath != NULL || metricsTarget != NULL) {
+            printf("Variants (-n) require a frame limit (-f) and can't be combined with -i, -P, -L or -M\n");
+            return 1;
+        }
+        int status = run_variants(romPath, profile, quirks, clock, seed, variants, frameLimit);
+        romlib_close(library);
+        chip8_free(&chip8);
+        return status;
+    }
+    if (fuzzPath != NULL) {
+        if (frameLimit == 0 || movie != NULL || loadStatePath != NULL || variants != 0 || metricsTarget != NULL) {
+            printf("Fuzzing (-z) requires a frame limit (-f) and can't be combined with -P, -L, -n or -M\n");
+            return 1;
+        }
+        fuzz_options_t options = { .profile = profile, .quirks = quirks, .clock = clock, .seed = seed, .frames = frameLimit,
+                                   .instructionLimit = instructionLimit, .threads = threads, .mutateRom = fuzzRom };
+        int status = run_fuzzer(romPath, fuzzPath, &options);
+        romlib_close(library);
+        chip8_free(&chip8);
+        return status;
+    }
+    if (debugger && movie != NULL) { printf("The debugger (-D) can't be combined with -P\n"); return 1; }
+    if (metricsTarget != NULL && (chip8.metrics = metrics_open(metricsTarget)) == NULL) return 1;
+    if (tracePath != NULL && (chip8.trace = trace = trace_open(tracePath, profile, quirks)) == NULL) return 1;
+    if (headless) {
+        int status = debugger ? run_debugger(&chip8, romPath, quirks, clock, seed, loadStatePath) :
+                                run_headless(&chip8, romPath, quirks, clock, seed, instructionLimit, frameLimit, loadStatePath, saveStatePath, movie);
+        chip8.trace = NULL;
+        if (trace_close(trace)) status = 1;
+        movie_free(movie);
+        romlib_close(library);
+        metrics_close(chip8.metrics);
+        chip8_free(&chip8);
+        return status;
+    }
 
-    if (sdl_init()) return 1;
+    if (backend->set_keymap != NULL && backend->set_keymap(keymap)) { printf("Invalid key map \"%s\", expected 16 distinct keys for 0-F that aren't hotkeys\n", keymap); return 1; }
+    if (backend->init()) return 1;
 
-    if (argc == 3 && *argv[2] == '1') quirks = true;
-    chip8_init(quirks);
+    chip8_init(&chip8, quirks);
+    chip8.cpuClock = clock;
+    chip8_seed(&chip8, seed);
     
-    if (load_ROM(argv[1])) return 1;
+    if (load_ROM(&chip8, romPath) < 0) return 1;
+    if (loadStatePath != NULL && load_state(&chip8, loadStatePath)) return 1;
+    if (movie != NULL) {
+        chip8.cpuClock = movie->cpuClock;
+        if (movie_rom_hash(&chip8) != movie->romHash) printf("Warning: movie was recorded with a different ROM\n");
+        printf("Replaying \"%s\"\n", replayPath);
+    }
+    if (recordPath != NULL) {
+        if ((movie = movie_record(recordPath, &chip8, seed)) == NULL) return 1;
+        printf("Recording to \"%s\" (seed %u)\n", recordPath, seed);
+    }
+    if (saveStatePath == NULL) { // F5/F9 use <romfile>.state by default
+        snprintf(defaultStatePath, sizeof(defaultStatePath), "%s.state", romPath);
+        saveStatePath = defaultStatePath;
+    }
+    if (tracePath == NULL) { // F7 traces to <romfile>.trace by default
+        snprintf(defaultTracePath, sizeof(defaultTracePath), "%s.trace", romPath);
+        tracePath = defaultTracePath;
+    }
+    if (rewindBudget > 0 && (rewind = rewind_create(rewindBudget * 1024, REWIND_MAX_FRAMES)) == NULL) printf("Failed to allocate rewind buffer\n");
 
-    play_beep();
     printf("\nEntering main loop...\n");
-    while(!cpuHalted) {
-        if (chip8_cycle()) play_beep();
-        
-        if (drawFlag) {
-            generate_state();
-            render_screen((uint8_t*)&screen, sizeof(screen), statusString);
-            drawFlag = false;
-        }
-
-        if (get_input((uint8_t*)&input, &extraFlag)) break;
-        if (waitForKey) {
-            for (uint8_t i = 0; i < sizeof(registers); i++) {
-                if (input[i] == 0xFF) { registers[waitForRegister] = i; waitForKey = false; }
-            }
-        }
+    clock_gettime(CLOCK_MONOTONIC, &nextFrame);
+    while(!chip8.cpuHalted) {
+        if (frameLimit != 0 && chip8.frames >= frameLimit) break;
+        if (instructionLimit != 0 && chip8.cycles >= instructionLimit) break;
+        metrics_start_frame(chip8.metrics);
+        if (backend->input(&keys, &extraFlag)) break;
+        if (replayPath == NULL) chip8_set_keys(&chip8, keys);
+        metrics_lap(chip8.metrics, METRICS_INPUT);
+        // hotkeys that change the machine behind the movie's back are ignored while recording or replaying
+        if (movie != NULL && extraFlag != 0x01 && extraFlag != 0x05 && extraFlag != 0x07) extraFlag = 0x0;
+        rewinding = extraFlag == 0xBB; // stays set while the key is held
         
         switch (extraFlag) {
             case 0xFF:
                 printf("Resetting...\n");
-                chip8_init(quirks);
-                load_ROM(argv[1]);
-                render_screen((uint8_t*)&screen, sizeof(screen), statusString);
+                chip8_init(&chip8, quirks);
+                chip8.cpuClock = clock;
+                chip8_seed(&chip8, seed);
+                load_ROM(&chip8, romPath);
                 extraFlag = 0x0;
                 break;
             case 0xF0:
-                cpuClock -= 10;
-                cpuRate = (1.0 / (double)cpuClock) * 1000.0;
+                if (chip8.cpuClock > 10) chip8.cpuClock -= 10;
                 extraFlag = 0x0;
                 break;
             case 0x0F:
-                cpuClock += 10;
-                cpuRate = (1.0 / (double)cpuClock) * 1000.0;
+                chip8.cpuClock += 10;
+                extraFlag = 0x0;
+                break;
+            case 0x01:
+                extendedStatus = !extendedStatus;
+                extraFlag = 0x0;
+                break;
+            case 0x05:
+                save_state(&chip8, saveStatePath);
+                extraFlag = 0x0;
+                break;
+            case 0x09:
+                load_state(&chip8, saveStatePath);
+                extraFlag = 0x0;
+                break;
+            case 0x07: // the file stays open while tracing is paused, so one session makes one trace
+                if (trace == NULL) trace = trace_open(tracePath, chip8.profile, chip8.quirks);
+                if (trace != NULL) {
+                    chip8.trace = chip8.trace == NULL ? trace : NULL;
+                    printf("\nTracing %s \"%s\"\n", chip8.trace != NULL ? "to" : "paused,", tracePath);
+                }
                 extraFlag = 0x0;
                 break;
         }
+
+        metrics_lap(chip8.metrics, METRICS_INPUT); // key wait and hotkeys
+        if (rewinding && rewind != NULL) {
+            rewind_pop(rewind, &chip8); // one frame back per frame, stays on the oldest one when history runs out
+        } else {
+            if (replayPath != NULL && !movie_feed(movie, &chip8)) break;
+            if (recordPath != NULL) movie_capture(movie, &chip8);
+            if (chip8_frame(&chip8)) break;
+            if (rewind != NULL) rewind_push(rewind, &chip8);
+        }
+        metrics_lap(chip8.metrics, METRICS_EMULATE);
+        backend->tone(chip8.soundTimer > 0 && !rewinding, chip8.profile == PROFILE_XOCHIP ? chip8.audioPattern : NULL, chip8.pitch);
+
+        // all draws of the frame are presented at once, the SDL backend skips the present if nothing changed
+        generate_state(&chip8, extendedStatus);
+        backend->render(chip8.screen, chip8_screen_width(&chip8), chip8_screen_height(&chip8), chip8.dirtyRows, chip8.statusString);
+        chip8.dirtyRows = 0;
+        chip8.drawFlag = false;
+        metrics_lap(chip8.metrics, METRICS_RENDER);
+
+        droppedFrames = backend->paced ? wait_frame(&nextFrame) : 0;
+        metrics_end_frame(chip8.metrics, &chip8, droppedFrames);
+    }
+    backend->quit();
+    rewind_free(rewind);
+    chip8.trace = NULL;
+    trace_close(trace);
+    if (recordPath != NULL && movie_finish(movie, &chip8)) printf("Failed to write movie \"%s\"\n", recordPath);
+    if (replayPath != NULL) check_movie(&chip8, movie);
+    movie_free(movie);
+    metrics_report(chip8.metrics, &chip8);
+    metrics_close(chip8.metrics);
+    chip8_free(&chip8);
+    romlib_close(library);
+    return 0;
+}
+
+/*
+Loads [path], or the ROM picked from the -p library, returns its length or -1 if it can't be loaded.
+The control-flow graph found by the static analyzer is cached for the block engine right away, and is
+where the quirks the ROM depends on come from when no -q or ROM database entry picked them.
+*/
+long load_ROM(chip8_t* chip8, char* path) {
+    chip8_analysis_t* analysis;
+    char names[64];
+    long fileLength = libraryRom != NULL ? chip8_load_rom(chip8, libraryRom->data, libraryRom->length) : chip8_load_file(chip8, path);
+    if (fileLength < 0) { printf("\nFailed to load ROM file: %s\n", strerror(errno)); return -1; }
+    printf("\nLoaded ROM file \"%s\" (%li bytes, hash %08X) to memory at offset 0x%03X\n", path, fileLength,
+           romdb_hash(chip8->memory + PROGRAM_ADDRESS, fileLength), PROGRAM_ADDRESS);
+    if (chip8->blocks == NULL && !quirksHint) return fileLength;
+    if ((analysis = malloc(sizeof(chip8_analysis_t))) == NULL || analyze_rom(chip8, fileLength, analysis)) { free(analysis); return fileLength; }
+    if (chip8->blocks != NULL) block_preload(chip8, analysis->leaders);
+    if (quirksHint && analysis->quirks != 0) {
+        printf("Quirks the ROM depends on: %s (running with the machine's defaults, pick them with -q if it misbehaves)\n",
+               chip8_quirks_name(analysis->quirks, names, sizeof(names)));
+    }
+    quirksHint = false; // once, not on every reset
+    free(analysis);
+    return fileLength;
+}
+
+int load_state(chip8_t* chip8, char* path) {
+    if (chip8_load_state(chip8, path)) { printf("\nFailed to load state \"%s\": %s\n", path, strerror(errno)); return 1; }
+    printf("\nLoaded state \"%s\" (%lu instructions executed)\n", path, chip8->cycles);
+    return 0;
+}
+
+int save_state(chip8_t* chip8, char* path) {
+    if (chip8_save_state(chip8, path)) { printf("\nFailed to save state \"%s\": %s\n", path, strerror(errno)); return 1; }
+    printf("\nSaved state \"%s\"\n", path);
+    return 0;
+}
+
+/*
+Runs [path] without SDL until one of the limits is reached, or until the end of [movie] if one is given.
+When replaying, keys are fed from the movie frame by frame and the final checksum is compared with the recorded one.
+*/
+int run_headless(chip8_t* chip8, char* path, uint8_t quirks, int clock, uint32_t seed, unsigned long instructionLimit, unsigned long frameLimit, char* loadStatePath, char* saveStatePath, chip8_movie_t* movie) {
+    struct timespec start, end;
+    double elapsed;
+
+    if (instructionLimit == 0 && frameLimit == 0 && movie == NULL) { printf("Headless mode requires an instruction (-i) or frame (-f) limit\n"); return 1; }
+
+    chip8_init(chip8, quirks);
+    chip8->cpuClock = clock;
+    chip8_seed(chip8, seed);
+    if (load_ROM(chip8, path) < 0) return 1;
+    if (loadStatePath != NULL && load_state(chip8, loadStatePath)) return 1;
+    if (movie != NULL) {
+        chip8->cpuClock = movie->cpuClock;
+        if (movie_rom_hash(chip8) != movie->romHash) printf("Warning: movie was recorded with a different ROM\n");
+    }
+
+    printf("Running headless...\n");
+    metrics_start_frame(chip8->metrics);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (movie == NULL) chip8_run(chip8, instructionLimit, frameLimit);
+    else {
+        while (!chip8->cpuHalted && movie_feed(movie, chip8)) {
+            if (frameLimit != 0 && chip8->frames >= frameLimit) break;
+            if (instructionLimit != 0 && chip8->cycles >= instructionLimit) break;
+            if (chip8_run(chip8, instructionLimit != 0 ? instructionLimit - chip8->cycles : 0, 1)) break;
+        }
     }
-    sdl_quit();    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    metrics_lap(chip8->metrics, METRICS_EMULATE);
+    metrics_report(chip8->metrics, chip8);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    chip8_dump(chip8, stdout);
+    printf("Executed %lu instructions in %lu frames, %.3f ms (%.0f instructions/s)\n",
+           chip8->cycles, chip8->frames, elapsed * 1000.0, elapsed > 0 ? (double)chip8->cycles / elapsed : 0.0);
+    if (saveStatePath != NULL && save_state(chip8, saveStatePath)) return 1;
+    if (movie != NULL && check_movie(chip8, movie)) return 1;
+    return chip8->cpuHalted ? 1 : 0;
+}
+
+/*
+Loads [path] and hands it to the debugger shell on stdin, see debug_shell().
+The machine runs with the frame timing of the headless mode, just stopped wherever the shell says.
+*/
+int run_debugger(chip8_t* chip8, char* path, uint8_t quirks, int clock, uint32_t seed, char* loadStatePath) {
+    chip8_debug_t* debug = debug_create();
+    int status;
+
+    if (debug == NULL) { printf("Failed to allocate debugger\n"); return 1; }
+    chip8_init(chip8, quirks);
+    chip8->cpuClock = clock;
+    chip8_seed(chip8, seed);
+    if (load_ROM(chip8, path) < 0 || (loadStatePath != NULL && load_state(chip8, loadStatePath))) { debug_free(debug); return 1; }
+    status = debug_shell(chip8, debug, stdin);
+    debug_free(debug);
+    return status;
+}
+
+// loads [path] and prints its control-flow graph, see analyze_print()
+int run_analyzer(chip8_t* chip8, char* path, uint8_t quirks) {
+    chip8_analysis_t* analysis = malloc(sizeof(chip8_analysis_t));
+    char names[64];
+    long length;
+
+    if (analysis == NULL) { printf("Failed to allocate analysis\n"); return 1; }
+    chip8_reset(chip8, quirks);
+    if ((length = load_ROM(chip8, path)) < 0) { free(analysis); return 1; }
+    if (analyze_rom(chip8, length, analysis)) { printf("Failed to allocate analysis\n"); free(analysis); return 1; }
+    printf("%s, quirks %s\n", chip8_profile_name(chip8->profile), chip8_quirks_name(chip8->quirks, names, sizeof(names)));
+    analyze_print(chip8, analysis, stdout);
+    free(analysis);
     return 0;
 }
 
-int load_ROM(char* path) {
-    FILE* romfile = fopen(path, "rb");
-    if (romfile == NULL) { printf("\nFailed to load ROM file: error %i\n",errno); return 1; }
+/*
+Runs [variants] copies of [path] for [frameLimit] frames, seeded with [seed], [seed] + 1 and so on,
+BATCH_LANES at a time on the batch engine. Prints the checksum and instruction count of every copy.
+*/
+int run_variants(char* path, int profile, uint8_t quirks, int clock, uint32_t seed, unsigned long variants, unsigned long frameLimit) {
+    chip8_t* lanes = calloc(BATCH_LANES, sizeof(chip8_t));
+    chip8_batch_t* batch = NULL;
+    uint8_t* program;
+    size_t programSize;
+    struct timespec start, end;
+    double elapsed = 0.0;
+    unsigned long cycles = 0, groupSteps = 0, scalarSteps = 0;
+    int count;
+
+    if (lanes == NULL) { printf("Failed to allocate %i machines\n", BATCH_LANES); return 1; }
+    // loaded once, every lane gets a copy of the whole program area
+    if (chip8_set_profile(&lanes[0], profile)) { printf("Failed to allocate decode cache\n"); free(lanes); return 1; }
+    chip8_reset(&lanes[0], quirks);
+    if (load_ROM(&lanes[0], path) < 0) { chip8_free(&lanes[0]); free(lanes); return 1; }
+    programSize = lanes[0].addressMask + 1 - PROGRAM_ADDRESS;
+    if ((program = malloc(programSize)) == NULL) { chip8_free(&lanes[0]); free(lanes); return 1; }
+    memcpy(program, lanes[0].memory + PROGRAM_ADDRESS, programSize);
+
+    printf("Running %lu variants headless, %i at a time...\n", variants, BATCH_LANES);
+    for (unsigned long first = 0; first < variants; first += count) {
+        count = variants - first < BATCH_LANES ? variants - first : BATCH_LANES;
+        if ((batch = batch_create()) == NULL) { printf("Failed to allocate batch\n"); break; }
+        for (int i = 0; i < count; i++) {
+            if (chip8_set_profile(&lanes[i], profile)) { printf("Failed to allocate decode cache\n"); count = i; break; }
+            chip8_reset(&lanes[i], quirks);
+            lanes[i].cpuClock = clock;
+            chip8_seed(&lanes[i], seed + first + i);
+            chip8_load_rom(&lanes[i], program, programSize);
+            batch_add(batch, &lanes[i]);
+        }
+        if (batch->count != count) { printf("Clock %i is too fast for the batch engine, the limit is %i\n", clock, BATCH_MAX_CLOCK - 1); batch_free(batch); batch = NULL; break; }
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        batch_run(batch, frameLimit);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        for (int i = 0; i < count; i++) {
+            printf("Seed %u: checksum %08X, %lu instructions in %lu frames%s\n", (uint32_t)(seed + first + i),
+                   chip8_checksum(&lanes[i]), lanes[i].cycles, lanes[i].frames, lanes[i].cpuHalted ? ", halted" : "");
+            cycles += lanes[i].cycles;
+        }
+        groupSteps += batch->groupSteps;
+        scalarSteps += batch->scalarSteps;
+        batch_free(batch);
+    }
+    printf("Executed %lu instructions, %.3f ms (%.0f instructions/s); %lu instructions ran for a group of lanes at once, %lu for single lanes\n",
+           cycles, elapsed * 1000.0, elapsed > 0 ? (double)cycles / elapsed : 0.0, groupSteps, scalarSteps);
+    free(program);
+    for (int i = 0; i < BATCH_LANES; i++) chip8_free(&lanes[i]);
+    free(lanes);
+    return variants != 0 && batch == NULL;
+}
+
+/*
+Fuzzes [path] with keys (and ROM bytes if asked to) from [options], keeping the corpus, coverage and crashes in [directory].
+The ROM is loaded once, workers copy it from here.
+*/
+int run_fuzzer(char* path, char* directory, fuzz_options_t* options) {
+    chip8_t* chip8 = calloc(1, sizeof(chip8_t));
+    long length;
+    int status;
+
+    if (chip8 == NULL) return 1;
+    if (chip8_set_profile(chip8, options->profile)) { printf("Failed to allocate decode cache\n"); free(chip8); return 1; }
+    chip8_reset(chip8, options->quirks);
+    if ((length = load_ROM(chip8, path)) < 0) { chip8_free(chip8); free(chip8); return 1; }
+    options->romLength = length;
+    options->rom = chip8->memory + PROGRAM_ADDRESS;
+    status = fuzz_run(directory, options);
+    chip8_free(chip8);
+    free(chip8);
+    return status;
+}
+
+// prints the checksum of a replayed run, returns 1 if the movie has an end line and the run didn't match it
+int check_movie(chip8_t* chip8, chip8_movie_t* movie) {
+    uint32_t checksum = chip8_checksum(chip8);
+    printf("Replay checksum %08X after %lu frames", checksum, chip8->frames);
+    if (!movie->finished) { printf(" (movie has no recorded result)\n"); return 0; }
+    if (movie_end_frame(chip8) == movie->endFrame && checksum == movie->checksum) { printf(", matches the recording\n"); return 0; }
+    printf(", MISMATCH: recorded %08X after %lu frames\n", movie->checksum, movie->endFrame);
+    return 1;
+}
+
+/*
+Sleeps until the start of the next 60 Hz frame. If the host fell more than FRAME_SKIP_LIMIT
+frames behind, the schedule is restarted from now instead of running the missed frames back to back.
+Returns the number of frames skipped this way.
+*/
+int wait_frame(struct timespec* nextFrame) {
+    struct timespec now;
+    double lag;
 
-    fseek(romfile, 0, SEEK_END);
-    int file_length = ftell(romfile);
-    fseek(romfile, 0, SEEK_SET);
-    printf("\nLoading ROM file \"%s\" (%i bytes) to memory at offset 0x%03X...\n", path, file_length, PROGRAM_ADDRESS);
-    fread(memory + PROGRAM_ADDRESS, file_length, 1, romfile);
-    fclose(romfile);
+    nextFrame->tv_nsec += 1000000000L / TIMER_CLOCK;
+    if (nextFrame->tv_nsec >= 1000000000L) { nextFrame->tv_sec++; nextFrame->tv_nsec -= 1000000000L; }
 
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lag = (now.tv_sec - nextFrame->tv_sec) + (now.tv_nsec - nextFrame->tv_nsec) / 1e9;
+    if (lag > (double)FRAME_SKIP_LIMIT / TIMER_CLOCK) {
+        *nextFrame = now;
+        return (int)(lag * TIMER_CLOCK);
+    }
+    if (lag < 0) clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, nextFrame, NULL);
     return 0;
-}
\ No newline at end of file
+}
+
+void print_usage() {
+    printf("chip8emu - a basic CHIP-8 emulator.\nUsage: chip8emu [options] <romfile> <workaround flag>\n\n"
+           " If the program doesn't work properly, try inputting 1 after ROM file.\n This will enable workarounds for instructions 8XY6, 8XYE, 8X55 and 8X65.\n\n"
+           " Options:\n  -H       run headless, without SDL (requires -i or -f)\n"
+           "  -i <n>   headless: stop after n instructions\n  -f <n>   headless: stop after n emulated 60 Hz frames\n"
+           "  -l       romfile is a list of ROM paths, one per line; run them all headless in parallel\n"
+           "  -j <n>   number of worker threads for -l and -z (default: one per CPU)\n"
+           "  -n <n>       headless: run n copies of the ROM seeded -s, -s + 1 and so on, many at a time (requires -f)\n"
+           "  -z <dir>     fuzz the ROM on all cores with random key input of -f frames, saving new coverage to dir/corpus and\n"
+           "               faults to dir/crashes as movies for -P; resumes from dir, runs until Ctrl+C or -i instructions in total\n"
+           "  -Z           with -z, also mutate ROM bytes\n"
+           "  -b <pack>    pack every ROM in the directory romfile, or listed in the file romfile, into a ROM library and exit\n"
+           "  -p <pack>    romfile is the name or hash of a ROM in a library built with -b; with -l runs the whole library\n"
+           "  -e <engine>  execution engine: interpreter (default) or block (cached basic blocks)\n"
+           "  -a           print the ROM's control-flow graph, data ranges and the quirks it depends on, found without running it\n"
+           "  -D           debug the ROM from a command line on stdin: breakpoints, watchpoints, stepping, disassembly\n"
+           "  -T <trace>   record every executed instruction to a binary trace file, printed by chip8trace; in the window\n"
+           "               F7 pauses and resumes tracing (default file: <romfile>.trace)\n"
+           "  -M <target>  write performance counters as JSON lines every second to a file, or to unix:<socket path>\n"
+           "  -L <state>   load a save state after the ROM\n"
+           "  -S <state>   headless: save state after the run; otherwise the file used by F5/F9 (default: <romfile>.state)\n"
+           "  -r <KiB>     memory budget for rewind history (default: %i, 0 disables rewind)\n"
+           "  -s <seed>    random number generator seed (default: current time)\n"
+           "  -R <movie>   record key presses to a movie file, replayable with -P\n"
+           "  -P <movie>   replay a movie; with -H runs headless and checks the recorded checksum\n"
+           "  -O <target>  run without SDL as fast as possible, frames go to raw:<path> or ppm:<path> (RGB, 128x64,\n"
+           "               - for the standard output) or to the shared memory object shm:<name>; -i, -f or -P ends the run\n"
+           "  -k <keys>    keyboard keys for CHIP-8 keys 0-F, in that order (default: %s)\n"
+           "  -m <machine> chip8 (default), schip (SUPER-CHIP 1.1) or xochip (XO-CHIP)\n"
+           "  -q <quirks>  comma separated quirks or quirk sets: none, legacy (same as the workaround flag), cosmac, schip,\n"
+           "               shift, loadstore, jump, vfreset, clip (default: the machine's own, unless the ROM has an entry in\n"
+           "               " ROMDB_PATH ", which ships empty, or the -p library)\n\n"
+           " Default key mapping:\n  1 2 3 C -> 1 2 3 4\n  4 5 6 D -> Q W E R\n  7 8 9 E -> A S D F\n  A 0 B F -> Z X C V\n"
+           " Press '[' key to decrease CPU speed, ']' to increase. Press 'P' to reset the system.\n"
+           " F5 saves state, F9 loads it, F7 toggles tracing, hold Backspace to rewind, Tab toggles extra status counters.\n\n", REWIND_BUDGET, KEYMAP_DEFAULT);
+}
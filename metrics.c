@@ -0,0 +1,159 @@
+/*
+Performance counters, reported as JSON lines
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "metrics.h"
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const char* const handlerNames[OP_COUNT] = {
+    "ILLEGAL", "NOP", "CLS", "RET", "JP", "CALL", "SE_KK", "SNE_KK", "SE_XY", "LD_KK", "ADD_KK", "LD_XY",
+    "OR", "AND", "XOR", "ADD_XY", "SUB", "SHR", "SUBN", "SHL", "SNE_XY", "LD_I", "JP_V0", "RND", "DRW",
+    "SKP", "SKNP", "LD_X_DT", "LD_K", "LD_DT", "LD_ST", "ADD_I", "LD_F", "LD_B", "LD_MEM", "LD_REG",
+    "SCD", "SCR", "SCL", "EXIT", "LOW", "HIGH", "LD_HF", "LD_R", "LD_X_R", "SCU", "SAVE", "LOAD", "LD_I_LONG",
+    "PLANE", "AUDIO", "PITCH", "OR_VF", "AND_VF", "XOR_VF", "SHR_X", "SHL_X", "JP_VX", "DRW_CLIP", "LD_MEM_KEEP",
+    "LD_REG_KEEP"
+};
+static const char* const timerNames[METRICS_TIMER_COUNT] = { "emulate", "draw", "render", "input" };
+// upper bounds of the frame time histogram buckets, ms; the last bucket is everything over one 60 Hz frame
+static const double bucketLimits[METRICS_HISTOGRAM_BUCKETS - 1] = { 0.25, 0.5, 1.0, 2.0, 4.0, 8.0, 1000.0 / TIMER_CLOCK };
+static const char* const bucketNames[METRICS_HISTOGRAM_BUCKETS] = { "0.25", "0.5", "1", "2", "4", "8", "16.7", "inf" };
+
+static void metrics_reset(chip8_metrics_t* metrics);
+
+/*
+Opens the metrics output. [target] is either a file path (lines are appended)
+or "unix:<path>" to connect to a listening Unix stream socket.
+Returns NULL on failure.
+*/
+chip8_metrics_t* metrics_open(const char* target) {
+    chip8_metrics_t* metrics;
+    FILE* out;
+
+    if (strncmp(target, "unix:", 5) == 0) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) { printf("Failed to create metrics socket: %s\n", strerror(errno)); return NULL; }
+        strncpy(address.sun_path, target + 5, sizeof(address.sun_path) - 1);
+        if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+            printf("Failed to connect to metrics socket \"%s\": %s\n", address.sun_path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        signal(SIGPIPE, SIG_IGN); // a collector that goes away shouldn't kill the emulator
+        out = fdopen(fd, "w");
+    } else {
+        out = fopen(target, "a");
+    }
+    if (out == NULL) { printf("Failed to open metrics output \"%s\": %s\n", target, strerror(errno)); return NULL; }
+
+    metrics = calloc(1, sizeof(chip8_metrics_t));
+    if (metrics == NULL) { fclose(out); return NULL; }
+    metrics->out = out;
+    clock_gettime(CLOCK_MONOTONIC, &metrics->reportTime);
+    return metrics;
+}
+
+void metrics_close(chip8_metrics_t* metrics) {
+    if (metrics == NULL) return;
+    if (metrics->out != NULL) fclose(metrics->out);
+    free(metrics);
+}
+
+void metrics_start_frame(chip8_metrics_t* metrics) {
+    if (metrics == NULL) return;
+    clock_gettime(CLOCK_MONOTONIC, &metrics->frameStart);
+    metrics->lap = metrics->frameStart;
+}
+
+// adds the time since the previous lap (or the start of the frame) to [timer]
+void metrics_lap(chip8_metrics_t* metrics, metrics_timer_t timer) {
+    if (metrics == NULL) return;
+    metrics->time[timer] += metrics_elapsed(&metrics->lap);
+    clock_gettime(CLOCK_MONOTONIC, &metrics->lap);
+}
+
+/*
+Records the host time spent on the frame (from metrics_start_frame() to the last lap, so the sleep
+until the next frame is not included) in the histogram, along with the frames the scheduler
+had to skip, and writes a report if METRICS_INTERVAL has passed.
+*/
+void metrics_end_frame(chip8_metrics_t* metrics, chip8_t* chip8, int droppedFrames) {
+    int bucket = 0;
+    double frameTime;
+    if (metrics == NULL) return;
+
+    frameTime = (metrics->lap.tv_sec - metrics->frameStart.tv_sec) * 1000.0 + (metrics->lap.tv_nsec - metrics->frameStart.tv_nsec) / 1e6;
+    while (bucket < METRICS_HISTOGRAM_BUCKETS - 1 && frameTime > bucketLimits[bucket]) bucket++;
+    metrics->histogram[bucket]++;
+    metrics->droppedFrames += droppedFrames;
+    metrics->missedCycles += (unsigned long)droppedFrames * chip8->cpuClock / TIMER_CLOCK;
+
+    if (metrics_elapsed(&metrics->reportTime) >= METRICS_INTERVAL) metrics_report(metrics, chip8);
+}
+
+/*
+Writes one JSON line with the counters collected since the previous report and resets them.
+Stops reporting (and returns 1) if the output fails, e.g. the socket was closed.
+*/
+int metrics_report(chip8_metrics_t* metrics, chip8_t* chip8) {
+    double interval;
+    unsigned long instructions;
+    unsigned long frames;
+    FILE* out;
+    if (metrics == NULL || metrics->out == NULL) return 1;
+
+    out = metrics->out;
+    interval = metrics_elapsed(&metrics->reportTime);
+    instructions = chip8->cycles >= metrics->cycles ? chip8->cycles - metrics->cycles : chip8->cycles; // CPU was reset
+    frames = chip8->frames >= metrics->frames ? chip8->frames - metrics->frames : chip8->frames;
+    fprintf(out, "{\"time\":%ld,\"interval_ms\":%.3f,\"frames\":%lu,\"instructions\":%lu,\"ips\":%.0f,"
+                 "\"dropped_frames\":%lu,\"missed_cycles\":%lu,\"time_ms\":{",
+            (long)time(NULL), interval, frames, instructions, interval > 0 ? instructions * 1000.0 / interval : 0.0,
+            metrics->droppedFrames, metrics->missedCycles);
+    for (int i = 0; i < METRICS_TIMER_COUNT; i++) fprintf(out, "%s\"%s\":%.3f", i ? "," : "", timerNames[i], metrics->time[i]);
+    fprintf(out, "},\"frame_ms\":{");
+    for (int i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++) fprintf(out, "%s\"%s\":%lu", i ? "," : "", bucketNames[i], metrics->histogram[i]);
+    fprintf(out, "},\"ops\":{");
+    for (int i = 0, first = 1; i < OP_COUNT; i++) {
+        if (metrics->ops[i] == 0) continue;
+        fprintf(out, "%s\"%s\":%lu", first ? "" : ",", handlerNames[i], metrics->ops[i]);
+        first = 0;
+    }
+    fprintf(out, "}}\n");
+
+    if (fflush(out) != 0) {
+        printf("Failed to write metrics: %s, reporting stopped\n", strerror(errno));
+        fclose(out);
+        metrics->out = NULL;
+        return 1;
+    }
+    metrics->cycles = chip8->cycles;
+    metrics->frames = chip8->frames;
+    metrics_reset(metrics);
+    return 0;
+}
+
+static void metrics_reset(chip8_metrics_t* metrics) {
+    memset(metrics->ops, 0x0, sizeof(metrics->ops));
+    memset(metrics->time, 0x0, sizeof(metrics->time));
+    memset(metrics->histogram, 0x0, sizeof(metrics->histogram));
+    metrics->droppedFrames = 0;
+    metrics->missedCycles = 0;
+    clock_gettime(CLOCK_MONOTONIC, &metrics->reportTime);
+}
@@ -0,0 +1,66 @@
+/*
+Header file for performance counters
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "cpu.h"
+#include "ops.h"
+
+#define METRICS_INTERVAL 1000 // ms between reports
+#define METRICS_HISTOGRAM_BUCKETS 8
+
+typedef enum metrics_timer {
+    METRICS_EMULATE, // chip8_run(), draw_sprite() included
+    METRICS_DRAW,    // draw_sprite() alone
+    METRICS_RENDER,
+    METRICS_INPUT,
+    METRICS_TIMER_COUNT
+} metrics_timer_t;
+
+/*
+Counters collected while a chip8_t has its metrics pointer set. Everything is reset
+after each report, so every JSON line describes one METRICS_INTERVAL.
+All metrics_* functions do nothing if [metrics] is NULL, so callers don't need to check.
+*/
+typedef struct chip8_metrics {
+    FILE* out;
+    unsigned long ops[OP_COUNT];                       // executed instructions per handler
+    double time[METRICS_TIMER_COUNT];                  // ms
+    unsigned long histogram[METRICS_HISTOGRAM_BUCKETS]; // host time per frame, see metrics_end_frame()
+    unsigned long droppedFrames; // frames skipped because the host fell behind
+    unsigned long missedCycles;  // instructions those frames would have executed
+    unsigned long cycles;        // chip8->cycles at the last report
+    unsigned long frames;        // chip8->frames at the last report
+    struct timespec lap;
+    struct timespec frameStart;
+    struct timespec reportTime;
+} chip8_metrics_t;
+
+chip8_metrics_t* metrics_open(const char* target);
+void metrics_close(chip8_metrics_t* metrics);
+void metrics_start_frame(chip8_metrics_t* metrics);
+void metrics_lap(chip8_metrics_t* metrics, metrics_timer_t timer);
+void metrics_end_frame(chip8_metrics_t* metrics, chip8_t* chip8, int droppedFrames);
+int metrics_report(chip8_metrics_t* metrics, chip8_t* chip8);
+
+// ms elapsed since [start]
+static inline double metrics_elapsed(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+#endif
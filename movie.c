@@ -0,0 +1,168 @@
+/*
+Input recording and replay
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "movie.h"
+#include <errno.h>
+
+static int movie_add(chip8_movie_t* movie, unsigned long frame, uint8_t key, bool pressed);
+
+/*
+Starts recording to [path]. [chip8] must have the ROM loaded and be seeded with [seed].
+Returns NULL on failure.
+*/
+chip8_movie_t* movie_record(const char* path, chip8_t* chip8, uint32_t seed) {
+    chip8_movie_t* movie = calloc(1, sizeof(chip8_movie_t));
+    if (movie == NULL) return NULL;
+    movie->file = fopen(path, "w");
+    if (movie->file == NULL) { printf("Failed to create movie \"%s\": %s\n", path, strerror(errno)); free(movie); return NULL; }
+    movie->seed = seed;
+    movie->profile = chip8->profile;
+    movie->quirks = chip8->quirks;
+    movie->cpuClock = chip8->cpuClock;
+    movie->romHash = movie_rom_hash(chip8);
+    movie->lastKeys = chip8->keys;
+    fprintf(movie->file, "%s\nseed %u\nprofile %s\nquirks %02X\nclock %i\nrom %08X\n", MOVIE_MAGIC, movie->seed,
+            chip8_profile_name(movie->profile), movie->quirks, movie->cpuClock, movie->romHash);
+    return movie;
+}
+
+// records the keys that changed since the previous call, must be called right before every emulated frame
+void movie_capture(chip8_movie_t* movie, chip8_t* chip8) {
+    uint16_t changed = chip8->keys ^ movie->lastKeys;
+    for (int i = 0; changed >> i; i++) {
+        if (changed & (1 << i)) fprintf(movie->file, "%lu %X %i\n", chip8->frames, i, (chip8->keys >> i) & 1);
+    }
+    movie->lastKeys = chip8->keys;
+}
+
+// writes the end line with the frame count and checksum and closes the file, returns 1 if writing failed
+int movie_finish(chip8_movie_t* movie, chip8_t* chip8) {
+    int status;
+    fprintf(movie->file, "end %lu %08X\n", movie_end_frame(chip8), chip8_checksum(chip8));
+    status = ferror(movie->file) != 0;
+    if (fclose(movie->file) != 0) status = 1;
+    movie->file = NULL;
+    return status;
+}
+
+/*
+Writes [movie] to [path] in one go: the header, every event and the end line if it is finished.
+For movies put together without recording, e.g. by the fuzzer. Returns 1 (with a message printed) on failure.
+*/
+int movie_save(const char* path, const chip8_movie_t* movie) {
+    int status;
+    FILE* file = fopen(path, "w");
+    if (file == NULL) { printf("Failed to create movie \"%s\": %s\n", path, strerror(errno)); return 1; }
+    fprintf(file, "%s\nseed %u\nprofile %s\nquirks %02X\nclock %i\nrom %08X\n", MOVIE_MAGIC, movie->seed,
+            chip8_profile_name(movie->profile), movie->quirks, movie->cpuClock, movie->romHash);
+    for (int i = 0; i < movie->count; i++) fprintf(file, "%lu %X %i\n", movie->events[i].frame, movie->events[i].key, movie->events[i].pressed);
+    if (movie->finished) fprintf(file, "end %lu %08X\n", movie->endFrame, movie->checksum);
+    status = ferror(file) != 0;
+    if (fclose(file) != 0) status = 1;
+    if (status) printf("Failed to write movie \"%s\": %s\n", path, strerror(errno));
+    return status;
+}
+
+// loads a movie for replay, returns NULL (with a message printed) if it can't be read or parsed
+chip8_movie_t* movie_open(const char* path) {
+    char line[128];
+    unsigned long frame;
+    unsigned int key, pressed, value;
+    char name[16];
+    int profile;
+    int lineNumber = 1;
+    chip8_movie_t* movie;
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) { printf("Failed to open movie \"%s\": %s\n", path, strerror(errno)); return NULL; }
+    movie = calloc(1, sizeof(chip8_movie_t));
+    if (movie == NULL) { fclose(file); return NULL; }
+
+    if (!fgets(line, sizeof(line), file) || strncmp(line, MOVIE_MAGIC, strlen(MOVIE_MAGIC)) != 0) goto invalid;
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        if (sscanf(line, "seed %u", &value) == 1) movie->seed = value;
+        else if (sscanf(line, "profile %15s", name) == 1) {
+            if ((profile = chip8_find_profile(name)) < 0) goto invalid;
+            movie->profile = profile;
+        }
+        else if (sscanf(line, "quirks %X", &value) == 1) movie->quirks = value;
+        else if (sscanf(line, "clock %u", &value) == 1) movie->cpuClock = value;
+        else if (sscanf(line, "rom %X", &value) == 1) movie->romHash = value;
+        else if (sscanf(line, "end %lu %X", &frame, &value) == 2) {
+            movie->finished = true;
+            movie->endFrame = frame;
+            movie->checksum = value;
+            break;
+        }
+        else if (sscanf(line, "%lu %X %u", &frame, &key, &pressed) == 3 && key < 16) {
+            if (movie->count > 0 && frame < movie->events[movie->count - 1].frame) goto invalid;
+            if (movie_add(movie, frame, key, pressed != 0)) goto invalid;
+        }
+        else if (line[0] != '\n' && line[0] != '#') goto invalid;
+    }
+    fclose(file);
+    if (movie->cpuClock <= 0) movie->cpuClock = CPU_CLOCK;
+    return movie;
+
+invalid:
+    printf("Invalid movie \"%s\" at line %i\n", path, lineNumber);
+    fclose(file);
+    movie_free(movie);
+    return NULL;
+}
+
+/*
+Applies the key changes recorded for the frame about to run through chip8_set_keys().
+Returns false once the recorded run is over (or the events ran out, if the movie has no end line).
+*/
+bool movie_feed(chip8_movie_t* movie, chip8_t* chip8) {
+    movie_event_t* event;
+    uint16_t keys = chip8->keys;
+    if (movie->finished ? chip8->frames >= movie->endFrame : movie->position == movie->count) return false;
+    while (movie->position < movie->count && movie->events[movie->position].frame <= chip8->frames) {
+        event = &movie->events[movie->position++];
+        keys = event->pressed ? keys | 1 << event->key : keys & ~(1 << event->key);
+    }
+    chip8_set_keys(chip8, keys);
+    return true;
+}
+
+// FNV-1a of the program area, identifies the ROM a movie was recorded with
+uint32_t movie_rom_hash(chip8_t* chip8) {
+    uint32_t hash = 2166136261u;
+    for (int i = PROGRAM_ADDRESS; i <= chip8->addressMask; i++) hash = (hash ^ chip8->memory[i]) * 16777619u;
+    return hash;
+}
+
+void movie_free(chip8_movie_t* movie) {
+    if (movie == NULL) return;
+    if (movie->file != NULL) fclose(movie->file);
+    free(movie->events);
+    free(movie);
+}
+
+static int movie_add(chip8_movie_t* movie, unsigned long frame, uint8_t key, bool pressed) {
+    if (movie->count == movie->capacity) {
+        int capacity = movie->capacity ? movie->capacity * 2 : 256;
+        movie_event_t* events = realloc(movie->events, sizeof(movie_event_t) * capacity);
+        if (events == NULL) return 1;
+        movie->events = events;
+        movie->capacity = capacity;
+    }
+    movie->events[movie->count++] = (movie_event_t){ frame, key, pressed };
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+Header file for input recording and replay
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include "cpu.h"
+
+#define MOVIE_MAGIC "chip8movie 1"
+
+typedef struct movie_event {
+    unsigned long frame; // applied before this emulated frame runs
+    uint8_t key;
+    bool pressed;
+} movie_event_t;
+
+/*
+Key presses and releases per emulated frame, plus everything else a run depends on
+(RNG seed, machine, quirks, clock and ROM hash), so replaying it reproduces the run exactly.
+Text file:
+    chip8movie 1
+    seed <n>
+    profile <chip8|schip|xochip>     optional, chip8 if missing
+    quirks <QUIRK_* bits, hex>
+    clock <Hz>
+    rom <FNV-1a of the loaded ROM, hex>
+    <frame> <key, hex> <1 pressed|0 released>     one line per change
+    end <frames, including the one the CPU halted in> <chip8_checksum() at the end, hex>
+*/
+typedef struct chip8_movie {
+    FILE* file; // open while recording
+    uint32_t seed;
+    chip8_profile_t profile;
+    uint8_t quirks;
+    int cpuClock;
+    uint32_t romHash;
+    movie_event_t* events;
+    int count;
+    int capacity;
+    int position; // next event to replay
+    uint16_t lastKeys;
+    bool finished; // end line present
+    unsigned long endFrame;
+    uint32_t checksum;
+} chip8_movie_t;
+
+chip8_movie_t* movie_record(const char* path, chip8_t* chip8, uint32_t seed);
+void movie_capture(chip8_movie_t* movie, chip8_t* chip8);
+int movie_finish(chip8_movie_t* movie, chip8_t* chip8);
+int movie_save(const char* path, const chip8_movie_t* movie);
+chip8_movie_t* movie_open(const char* path);
+bool movie_feed(chip8_movie_t* movie, chip8_t* chip8);
+uint32_t movie_rom_hash(chip8_t* chip8);
+
+// frames for the end line, a frame cut short by a halt counts so replaying runs it too
+static inline unsigned long movie_end_frame(const chip8_t* chip8) { return chip8->frames + chip8->cpuHalted; }
+void movie_free(chip8_movie_t* movie);
+#endif
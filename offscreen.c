@@ -0,0 +1,185 @@
+/*
+Offscreen backend
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "backend.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+Frames are always SCREEN_MAX_WIDTH x SCREEN_MAX_HEIGHT RGB (3 bytes per pixel, rows top to bottom),
+with low resolution pixels doubled, so a consumer never sees the size change.
+
+raw:<path> and ppm:<path> write every frame to a file or pipe, ppm with a P6 header in front of each one.
+A path of - is the standard output, everything printed goes to the standard error instead.
+shm:<name> keeps the latest frame in a POSIX shared memory object, see offscreen_header_t.
+*/
+#define OFFSCREEN_ROW (SCREEN_MAX_WIDTH * 3)
+#define OFFSCREEN_FRAME (OFFSCREEN_ROW * SCREEN_MAX_HEIGHT)
+#define OFFSCREEN_PPM_HEADER "P6\n128 64\n255\n" // keep in sync with SCREEN_MAX_*
+
+typedef enum offscreen_format {
+    OFFSCREEN_NONE,
+    OFFSCREEN_RAW,
+    OFFSCREEN_PPM,
+    OFFSCREEN_SHM
+} offscreen_format_t;
+
+static int offscreen_init(void);
+static void offscreen_quit(void);
+static void offscreen_render(chip8_screen_t screen, int width, int height, uint64_t dirtyRows, char* statusString);
+static void offscreen_tone(bool on, const uint8_t* pattern, uint8_t pitch);
+static int offscreen_input(uint16_t* keys, uint8_t* extraFlag);
+
+const backend_t offscreenBackend = {
+    .name = "offscreen",
+    .paced = false,
+    .init = offscreen_init,
+    .quit = offscreen_quit,
+    .render = offscreen_render,
+    .tone = offscreen_tone,
+    .input = offscreen_input,
+    .set_keymap = NULL
+};
+
+static const uint32_t palette[4] = BACKEND_PALETTE;
+static offscreen_format_t format;
+static const char* targetPath;
+static int output = -1;       // raw and ppm
+static bool failed;           // a frame couldn't be written, ends the run
+static uint8_t* buffer;       // what is written per frame: the PPM header, if any, then the frame
+static uint8_t* frame;        // inside [buffer], or in the shared memory object
+static size_t bufferSize;
+static offscreen_header_t* shared;
+static int shownWidth;
+
+/*
+Selects where frames go, "raw:<path>", "ppm:<path>" or "shm:<name>". Nothing is opened until the backend is initialized.
+Returns 1 if [target] isn't one of these.
+*/
+int offscreen_set_target(const char* target) {
+    if (strncmp(target, "raw:", 4) == 0) format = OFFSCREEN_RAW;
+    else if (strncmp(target, "ppm:", 4) == 0) format = OFFSCREEN_PPM;
+    else if (strncmp(target, "shm:", 4) == 0) format = OFFSCREEN_SHM;
+    else return 1;
+    targetPath = target + 4;
+    return *targetPath == '\0';
+}
+
+static int offscreen_init(void) {
+    size_t headerSize = format == OFFSCREEN_PPM ? strlen(OFFSCREEN_PPM_HEADER) : 0;
+    int fd;
+
+    shownWidth = 0;
+    failed = false;
+    if (format == OFFSCREEN_SHM) {
+        bufferSize = sizeof(offscreen_header_t) + OFFSCREEN_FRAME;
+        fd = shm_open(targetPath, O_CREAT | O_RDWR, 0600);
+        if (fd < 0 || ftruncate(fd, bufferSize) != 0) { printf("Failed to create shared memory \"%s\": %s\n", targetPath, strerror(errno)); if (fd >= 0) close(fd); return 1; }
+        buffer = mmap(NULL, bufferSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (buffer == MAP_FAILED) { buffer = NULL; printf("Failed to map shared memory \"%s\": %s\n", targetPath, strerror(errno)); return 1; }
+        shared = (offscreen_header_t*)buffer;
+        memset(buffer, 0x0, bufferSize);
+        memcpy(shared->magic, OFFSCREEN_MAGIC, 4);
+        shared->width = SCREEN_MAX_WIDTH;
+        shared->height = SCREEN_MAX_HEIGHT;
+        frame = buffer + sizeof(offscreen_header_t);
+        printf("Offscreen frames in shared memory \"%s\" (%i x %i RGB)\n", targetPath, SCREEN_MAX_WIDTH, SCREEN_MAX_HEIGHT);
+        return 0;
+    }
+
+    if (strcmp(targetPath, "-") == 0) {
+        output = dup(STDOUT_FILENO);
+        fflush(stdout);
+        dup2(STDERR_FILENO, STDOUT_FILENO); // keep messages out of the stream
+    } else output = open(targetPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output < 0) { printf("Failed to open \"%s\": %s\n", targetPath, strerror(errno)); return 1; }
+    signal(SIGPIPE, SIG_IGN); // a reader going away fails the write instead
+    bufferSize = headerSize + OFFSCREEN_FRAME;
+    if ((buffer = calloc(1, bufferSize)) == NULL) return 1;
+    memcpy(buffer, OFFSCREEN_PPM_HEADER, headerSize);
+    frame = buffer + headerSize;
+    printf("Offscreen %s frames to \"%s\" (%i x %i RGB)\n", format == OFFSCREEN_PPM ? "PPM" : "raw", targetPath, SCREEN_MAX_WIDTH, SCREEN_MAX_HEIGHT);
+    return 0;
+}
+
+static void offscreen_quit(void) {
+    if (format == OFFSCREEN_SHM) {
+        if (buffer != NULL) munmap(buffer, bufferSize); // the object is left in place for readers
+    } else {
+        free(buffer);
+        if (output >= 0) close(output);
+        output = -1;
+    }
+    buffer = NULL;
+    shared = NULL;
+}
+
+// redraws the changed rows straight into the frame, then writes it out or publishes it
+static void offscreen_render(chip8_screen_t screen, int width, int height, uint64_t dirtyRows, char* statusString) {
+    int scale = SCREEN_MAX_WIDTH / width;
+    uint8_t* row;
+    uint32_t color;
+    size_t written = 0;
+    ssize_t length;
+
+    if (height < 64) dirtyRows &= (1ULL << height) - 1;
+    if (shownWidth != width) dirtyRows = height < 64 ? (1ULL << height) - 1 : ~0ULL;
+    if (dirtyRows != 0) {
+        if (shared != NULL) {
+            __atomic_add_fetch(&shared->sequence, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE); // odd before any pixel changes
+        }
+        for (int y = 0; y < height; y++) {
+            if (!(dirtyRows >> y & 1)) continue;
+            row = frame + y * scale * OFFSCREEN_ROW;
+            for (int x = 0; x < width; x++) {
+                color = palette[SCREEN_PIXEL(screen, 0, x, y) | SCREEN_PIXEL(screen, 1, x, y) << 1];
+                for (int i = 0; i < scale; i++) {
+                    *row++ = color >> 16;
+                    *row++ = color >> 8;
+                    *row++ = color;
+                }
+            }
+            if (scale > 1) memcpy(row, row - OFFSCREEN_ROW, OFFSCREEN_ROW);
+        }
+        if (shared != NULL) __atomic_add_fetch(&shared->sequence, 1, __ATOMIC_RELEASE);
+        shownWidth = width;
+    }
+    if (shared != NULL) {
+        __atomic_store_n(&shared->frames, shared->frames + 1, __ATOMIC_RELEASE);
+        return;
+    }
+    while (written < bufferSize && !failed) {
+        length = write(output, buffer + written, bufferSize - written);
+        if (length < 0 && errno == EINTR) continue;
+        if (length <= 0) { printf("\nFailed to write frame to \"%s\": %s\n", targetPath, strerror(errno)); failed = true; }
+        else written += length;
+    }
+}
+
+static void offscreen_tone(bool on, const uint8_t* pattern, uint8_t pitch) {
+    if (shared != NULL) shared->tone = on;
+}
+
+// there is no keyboard, keys only come from a replayed movie; ends the run once a frame couldn't be written
+static int offscreen_input(uint16_t* keys, uint8_t* extraFlag) {
+    return failed;
+}
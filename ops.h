@@ -0,0 +1,429 @@
+/*
+CHIP-8 instruction handlers
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OPS_H
+#define OPS_H
+
+#include "cpu.h"
+
+/*
+Every opcode is decoded once by chip8_decode() into a chip8_op_t holding the handler index
+and the X/Y/N/KK/NNN operands, and cached per memory address in chip8_t.decoded.
+Handlers work exactly like the old switch cases: they may change PC, and the caller
+adds 2 to it afterwards.
+*/
+enum chip8_handler {
+    OP_ILLEGAL, // nnn holds the value printed in the error message
+    OP_NOP,     // 0000, and unknown Fxkk
+    OP_CLS,     // 00E0
+    OP_RET,     // 00EE
+    OP_JP,      // 1nnn
+    OP_CALL,    // 2nnn
+    OP_SE_KK,   // 3xkk
+    OP_SNE_KK,  // 4xkk
+    OP_SE_XY,   // 5xy0
+    OP_LD_KK,   // 6xkk
+    OP_ADD_KK,  // 7xkk
+    OP_LD_XY,   // 8xy0
+    OP_OR,      // 8xy1
+    OP_AND,     // 8xy2
+    OP_XOR,     // 8xy3
+    OP_ADD_XY,  // 8xy4
+    OP_SUB,     // 8xy5
+    OP_SHR,     // 8xy6
+    OP_SUBN,    // 8xy7
+    OP_SHL,     // 8xyE
+    OP_SNE_XY,  // 9xy0
+    OP_LD_I,    // Annn
+    OP_JP_V0,   // Bnnn
+    OP_RND,     // Cxkk
+    OP_DRW,     // Dxyn
+    OP_SKP,     // Ex9E
+    OP_SKNP,    // ExA1
+    OP_LD_X_DT, // Fx07
+    OP_LD_K,    // Fx0A
+    OP_LD_DT,   // Fx15
+    OP_LD_ST,   // Fx18
+    OP_ADD_I,   // Fx1E
+    OP_LD_F,    // Fx29
+    OP_LD_B,    // Fx33
+    OP_LD_MEM,  // Fx55
+    OP_LD_REG,  // Fx65
+    OP_SCD,     // 00Cn, SUPER-CHIP
+    OP_SCR,     // 00FB, SUPER-CHIP
+    OP_SCL,     // 00FC, SUPER-CHIP
+    OP_EXIT,    // 00FD, SUPER-CHIP
+    OP_LOW,     // 00FE, SUPER-CHIP
+    OP_HIGH,    // 00FF, SUPER-CHIP
+    OP_LD_HF,   // Fx30, SUPER-CHIP
+    OP_LD_R,    // Fx75, SUPER-CHIP
+    OP_LD_X_R,  // Fx85, SUPER-CHIP
+    OP_SCU,     // 00Dn, XO-CHIP
+    OP_SAVE,    // 5xy2, XO-CHIP
+    OP_LOAD,    // 5xy3, XO-CHIP
+    OP_LD_I_LONG, // F000 nnnn, XO-CHIP
+    OP_PLANE,   // Fn01, XO-CHIP
+    OP_AUDIO,   // F002, XO-CHIP
+    OP_PITCH,   // Fx3A, XO-CHIP
+    OP_OR_VF,   // 8xy1, QUIRK_VF_RESET
+    OP_AND_VF,  // 8xy2, QUIRK_VF_RESET
+    OP_XOR_VF,  // 8xy3, QUIRK_VF_RESET
+    OP_SHR_X,   // 8xy6, QUIRK_SHIFT
+    OP_SHL_X,   // 8xyE, QUIRK_SHIFT
+    OP_JP_VX,   // Bxnn, QUIRK_JUMP
+    OP_DRW_CLIP, // Dxyn, QUIRK_CLIP
+    OP_LD_MEM_KEEP, // Fx55, QUIRK_LOAD_STORE
+    OP_LD_REG_KEEP, // Fx65, QUIRK_LOAD_STORE
+    OP_COUNT
+};
+
+void chip8_decode(uint16_t instr, chip8_op_t* op, chip8_profile_t profile, uint8_t quirks);
+void draw_sprite(chip8_t* chip8, uint8_t screenX, uint8_t screenY, uint8_t bytes);
+void draw_sprite_clipped(chip8_t* chip8, uint8_t screenX, uint8_t screenY, uint8_t bytes);
+void scroll_screen(chip8_t* chip8, int dx, int dy);
+void set_hires(chip8_t* chip8, bool hires);
+
+// returns the decoded instruction at [address], decoding it on first use
+static inline const chip8_op_t* chip8_fetch(chip8_t* chip8, uint16_t address) {
+    chip8_op_t* op = &chip8->decoded[address];
+    if (!(chip8->decodedValid[address >> 6] & (1ULL << (address & 63)))) {
+        chip8_decode((chip8->memory[address] << 8) | chip8->memory[address + 1], op, chip8->profile, chip8->quirks);
+        chip8->decodedValid[address >> 6] |= 1ULL << (address & 63);
+    }
+    return op;
+}
+
+// skips the next instruction, which is 4 bytes long if it is XO-CHIP's F000 nnnn
+static inline void chip8_skip(chip8_t* chip8) {
+    chip8->programCounter += 2;
+    if (chip8->profile == PROFILE_XOCHIP && chip8->memory[(chip8->programCounter) & chip8->addressMask] == 0xF0 &&
+        chip8->memory[(chip8->programCounter + 1) & chip8->addressMask] == 0x00) chip8->programCounter += 2;
+}
+
+// xorshift32, the state is part of the machine so runs are reproducible from a seed and survive snapshots
+static inline uint8_t chip8_random(chip8_t* chip8) {
+    uint32_t x = chip8->rngState;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip8->rngState = x;
+    return x >> 24;
+}
+
+static inline void op_illegal(chip8_t* chip8, const chip8_op_t* op) {
+    printf("Illegal opcode %02X!\n", op->nnn);
+}
+
+static inline void op_nop(chip8_t* chip8, const chip8_op_t* op) {
+}
+
+static inline void op_cls(chip8_t* chip8, const chip8_op_t* op) { // 00E0 - CLS - clear screen (the selected planes on XO-CHIP)
+    for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+        if (!(chip8->planeMask & (1 << plane))) continue;
+        for (int y = 0; y < SCREEN_MAX_HEIGHT; y++) {
+            if (chip8->screen[plane][y][0] | chip8->screen[plane][y][1]) chip8->dirtyRows |= 1ULL << y;
+        }
+        memset(chip8->screen[plane], 0x0, sizeof(chip8->screen[plane]));
+    }
+    chip8->drawFlag = true;
+}
+
+static inline void op_ret(chip8_t* chip8, const chip8_op_t* op) { // 00EE - RET - return from subroutine
+    chip8->programCounter = chip8->stack[chip8->stackPointer & 0xF];
+    chip8->stackPointer--;
+}
+
+static inline void op_jp(chip8_t* chip8, const chip8_op_t* op) { // 1nnn - JMP addr — jump to nnn
+    chip8->programCounter = op->nnn - 2; // bypass increment and the end of the cycle
+}
+
+static inline void op_call(chip8_t* chip8, const chip8_op_t* op) { // 2nnn - CALL addr - save PC to stack and jump to nnn
+    chip8->stackPointer++;
+    chip8->stack[chip8->stackPointer & 0xF] = chip8->programCounter;
+    chip8->programCounter = op->nnn - 2;
+}
+
+static inline void op_se_kk(chip8_t* chip8, const chip8_op_t* op) { // 3xkk - SE Vx, kk - skip instruction if Vx = kk
+    if (chip8->registers[op->x] == op->kk) chip8_skip(chip8);
+}
+
+static inline void op_sne_kk(chip8_t* chip8, const chip8_op_t* op) { // 4xkk - SNE Vx, kk - skip instruction if Vx != kk
+    if (chip8->registers[op->x] != op->kk) chip8_skip(chip8);
+}
+
+static inline void op_se_xy(chip8_t* chip8, const chip8_op_t* op) { // 5xy0 - SE Vx, Vy - skip next instruction if Vx = Vy
+    if (chip8->registers[op->x] == chip8->registers[op->y]) chip8_skip(chip8);
+}
+
+static inline void op_ld_kk(chip8_t* chip8, const chip8_op_t* op) { // 6xkk - LD Vx, kk - set Vx = kk
+    chip8->registers[op->x] = op->kk;
+}
+
+static inline void op_add_kk(chip8_t* chip8, const chip8_op_t* op) { // 7xkk - ADD Vx, byte - set Vx = Vx + kk
+    chip8->registers[op->x] += op->kk;
+}
+
+static inline void op_ld_xy(chip8_t* chip8, const chip8_op_t* op) { // 8xy0 - LD Vx, Vy - set Vx = Vy
+    chip8->registers[op->x] = chip8->registers[op->y];
+}
+
+static inline void op_or(chip8_t* chip8, const chip8_op_t* op) { // 8xy1 - OR Vx, Vy - set Vx = Vx OR Vy
+    chip8->registers[op->x] |= chip8->registers[op->y];
+}
+
+static inline void op_and(chip8_t* chip8, const chip8_op_t* op) { // 8xy2 - AND Vx, Vy - set Vx = Vx AND Vy
+    chip8->registers[op->x] &= chip8->registers[op->y];
+}
+
+static inline void op_xor(chip8_t* chip8, const chip8_op_t* op) { // 8xy3 - XOR Vx, Vy - set Vx = Vx XOR Vy
+    chip8->registers[op->x] ^= chip8->registers[op->y];
+}
+
+static inline void op_add_xy(chip8_t* chip8, const chip8_op_t* op) { // 8xy4 - ADD Vx, Vy - set Vx = Vx + Vy, set VF = carry
+    uint16_t temp = chip8->registers[op->x] + chip8->registers[op->y];
+    chip8->registers[0xF] = temp > 0xFF;
+    chip8->registers[op->x] = temp & 0x00FF;
+}
+
+static inline void op_sub(chip8_t* chip8, const chip8_op_t* op) { // 8xy5 - SUB Vx, Vy - set Vx = Vx - Vy, set VF = NOT borrow
+    chip8->registers[0xF] = chip8->registers[op->x] > chip8->registers[op->y];
+    chip8->registers[op->x] -= chip8->registers[op->y];
+}
+
+static inline void op_shr(chip8_t* chip8, const chip8_op_t* op) { // 8xy6 - SHR Vx, Vy - set Vx = Vy SHR 1, VF = bit shifted out
+    uint8_t flag = chip8->registers[op->y] & 0x1;
+    chip8->registers[op->x] = chip8->registers[op->y] >> 1;
+    chip8->registers[0xF] = flag;
+}
+
+static inline void op_subn(chip8_t* chip8, const chip8_op_t* op) { // 8xy7 - SUBN Vx, Vy - set Vx = Vy - Vx, set VF = NOT borrow
+    chip8->registers[0xF] = chip8->registers[op->y] > chip8->registers[op->x];
+    chip8->registers[op->x] = chip8->registers[op->y] - chip8->registers[op->x];
+}
+
+static inline void op_shl(chip8_t* chip8, const chip8_op_t* op) { // 8xyE - SHL Vx, Vy - set Vx = Vy SHL 1, VF = bit shifted out
+    uint8_t flag = chip8->registers[op->y] >> 7;
+    chip8->registers[op->x] = chip8->registers[op->y] << 1;
+    chip8->registers[0xF] = flag;
+}
+
+static inline void op_sne_xy(chip8_t* chip8, const chip8_op_t* op) { // 9xy0 - SNE Vx, Vy - skip next instruction if Vx != Vy.
+    if (chip8->registers[op->x] != chip8->registers[op->y]) chip8_skip(chip8);
+}
+
+static inline void op_ld_i(chip8_t* chip8, const chip8_op_t* op) { // Annn - LD I, addr - set I = nnn.
+    chip8->indexRegister = op->nnn;
+}
+
+static inline void op_jp_v0(chip8_t* chip8, const chip8_op_t* op) { // Bnnn - JP V0, addr - jump to location nnn + V0.
+    chip8->programCounter = op->nnn + chip8->registers[0] - 2; // bypass increment
+}
+
+static inline void op_rnd(chip8_t* chip8, const chip8_op_t* op) { // Cxkk - RND Vx, byte - set Vx = random byte AND kk.
+    chip8->registers[op->x] = chip8_random(chip8) & op->kk;
+}
+
+static inline void op_drw(chip8_t* chip8, const chip8_op_t* op) { // Dxyn - DRW Vx, Vy, nibble - display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision. Dxy0 draws 16x16 on SUPER-CHIP.
+    draw_sprite(chip8, chip8->registers[op->x], chip8->registers[op->y], op->n);
+    chip8->drawFlag = true;
+}
+
+static inline void op_skp(chip8_t* chip8, const chip8_op_t* op) { // Ex9E - SKP Vx - skip next instruction if key with the value of Vx is pressed.
+    if (chip8->keys & (1 << (chip8->registers[op->x] & 0xF))) chip8_skip(chip8);
+}
+
+static inline void op_sknp(chip8_t* chip8, const chip8_op_t* op) { // ExA1 - SKNP Vx - skip next instruction if key with the value of Vx is not pressed.
+    if (!(chip8->keys & (1 << (chip8->registers[op->x] & 0xF)))) chip8_skip(chip8);
+}
+
+static inline void op_ld_x_dt(chip8_t* chip8, const chip8_op_t* op) { // Fx07 - LD Vx, DT - set Vx = delay timer value.
+    chip8->registers[op->x] = chip8->delayTimer;
+}
+
+static inline void op_ld_k(chip8_t* chip8, const chip8_op_t* op) { // Fx0A - LD Vx, K - wait for a key press, store the value of the key in Vx.
+    chip8->waitForKey = true;
+    chip8->waitForRegister = op->x;
+}
+
+static inline void op_ld_dt(chip8_t* chip8, const chip8_op_t* op) { // Fx15 - LD DT, Vx - set delay timer = Vx.
+    chip8->delayTimer = chip8->registers[op->x];
+}
+
+static inline void op_ld_st(chip8_t* chip8, const chip8_op_t* op) { // Fx18 - LD ST, Vx - set sound timer = Vx.
+    chip8->soundTimer = chip8->registers[op->x];
+}
+
+static inline void op_add_i(chip8_t* chip8, const chip8_op_t* op) { // Fx1E - ADD I, Vx - set I = I + Vx.
+    chip8->indexRegister += chip8->registers[op->x];
+}
+
+static inline void op_ld_f(chip8_t* chip8, const chip8_op_t* op) { // Fx29 - LD F, Vx - set I = location of sprite for digit Vx.
+    chip8->indexRegister = chip8->registers[op->x] * 5; // Each sprites occupies 5 bytes in memory, sprites are loaded at 0x0
+}
+
+static inline void op_ld_b(chip8_t* chip8, const chip8_op_t* op) { // Fx33 - LD B, Vx - store BCD representation of Vx in memory locations I, I+1, and I+2.
+    uint8_t temp = chip8->registers[op->x];
+    chip8->memory[chip8->indexRegister & chip8->addressMask] = temp / 100;
+    chip8->memory[(chip8->indexRegister + 1) & chip8->addressMask] = (temp % 100) / 10;
+    chip8->memory[(chip8->indexRegister + 2) & chip8->addressMask] = temp % 10;
+    chip8_invalidate(chip8, chip8->indexRegister, 3);
+}
+
+static inline void op_ld_mem(chip8_t* chip8, const chip8_op_t* op) { // Fx55 - LD [I], Vx - store registers V0 through Vx in memory starting at location I.
+    for (int i = 0; i <= op->x; i++) {
+        chip8->memory[(chip8->indexRegister + i) & chip8->addressMask] = chip8->registers[i];
+    }
+    chip8_invalidate(chip8, chip8->indexRegister, op->x + 1);
+    chip8->indexRegister += op->x + 1;
+}
+
+static inline void op_ld_reg(chip8_t* chip8, const chip8_op_t* op) { // Fx65 - LD Vx, [I] - read registers V0 through Vx from memory starting at location I.
+    for (int i = 0; i <= op->x; i++) {
+        chip8->registers[i] = chip8->memory[(chip8->indexRegister + i) & chip8->addressMask];
+    }
+    chip8->indexRegister += op->x + 1;
+}
+
+static inline void op_scd(chip8_t* chip8, const chip8_op_t* op) { // 00Cn - SCD nibble - scroll the screen down n pixels.
+    scroll_screen(chip8, 0, op->n);
+}
+
+static inline void op_scr(chip8_t* chip8, const chip8_op_t* op) { // 00FB - SCR - scroll the screen right 4 pixels.
+    scroll_screen(chip8, 4, 0);
+}
+
+static inline void op_scl(chip8_t* chip8, const chip8_op_t* op) { // 00FC - SCL - scroll the screen left 4 pixels.
+    scroll_screen(chip8, -4, 0);
+}
+
+static inline void op_exit(chip8_t* chip8, const chip8_op_t* op) { // 00FD - EXIT - stop the interpreter.
+    chip8->cpuHalted = true;
+    chip8->programCounter -= 2; // stays on the exit
+    printf("\nCPU halted: program exited\n");
+}
+
+static inline void op_low(chip8_t* chip8, const chip8_op_t* op) { // 00FE - LOW - switch to 64x32, clears the screen.
+    set_hires(chip8, false);
+}
+
+static inline void op_high(chip8_t* chip8, const chip8_op_t* op) { // 00FF - HIGH - switch to 128x64, clears the screen.
+    set_hires(chip8, true);
+}
+
+static inline void op_ld_hf(chip8_t* chip8, const chip8_op_t* op) { // Fx30 - LD HF, Vx - set I = location of the 8x10 sprite for digit Vx.
+    chip8->indexRegister = BIG_FONT_ADDRESS + (chip8->registers[op->x] & 0xF) * 10;
+}
+
+static inline void op_ld_r(chip8_t* chip8, const chip8_op_t* op) { // Fx75 - LD R, Vx - store V0 through Vx in the flag registers.
+    memcpy(chip8->flags, chip8->registers, op->x + 1);
+}
+
+static inline void op_ld_x_r(chip8_t* chip8, const chip8_op_t* op) { // Fx85 - LD Vx, R - read V0 through Vx from the flag registers.
+    memcpy(chip8->registers, chip8->flags, op->x + 1);
+}
+
+static inline void op_scu(chip8_t* chip8, const chip8_op_t* op) { // 00Dn - SCU nibble - scroll the screen up n pixels.
+    scroll_screen(chip8, 0, -op->n);
+}
+
+static inline void op_save(chip8_t* chip8, const chip8_op_t* op) { // 5xy2 - SAVE Vx - Vy - store Vx through Vy (in either order) in memory starting at I, I is unchanged.
+    int step = op->x <= op->y ? 1 : -1;
+    int count = (op->x <= op->y ? op->y - op->x : op->x - op->y) + 1;
+    for (int i = 0; i < count; i++) {
+        chip8->memory[(chip8->indexRegister + i) & chip8->addressMask] = chip8->registers[op->x + i * step];
+    }
+    chip8_invalidate(chip8, chip8->indexRegister, count);
+}
+
+static inline void op_load(chip8_t* chip8, const chip8_op_t* op) { // 5xy3 - LOAD Vx - Vy - read Vx through Vy (in either order) from memory starting at I, I is unchanged.
+    int step = op->x <= op->y ? 1 : -1;
+    int count = (op->x <= op->y ? op->y - op->x : op->x - op->y) + 1;
+    for (int i = 0; i < count; i++) {
+        chip8->registers[op->x + i * step] = chip8->memory[(chip8->indexRegister + i) & chip8->addressMask];
+    }
+}
+
+static inline void op_ld_i_long(chip8_t* chip8, const chip8_op_t* op) { // F000 nnnn - LD I, long nnnn - set I to the 16-bit address in the next word.
+    chip8->indexRegister = (chip8->memory[(chip8->programCounter + 2) & chip8->addressMask] << 8) |
+                           chip8->memory[(chip8->programCounter + 3) & chip8->addressMask];
+    chip8->programCounter += 2;
+}
+
+static inline void op_plane(chip8_t* chip8, const chip8_op_t* op) { // Fn01 - PLANE n - select the bit planes affected by drawing, clearing and scrolling.
+    chip8->planeMask = op->x & 0x3;
+}
+
+static inline void op_audio(chip8_t* chip8, const chip8_op_t* op) { // F002 - AUDIO - load the 16-byte audio pattern from memory starting at I.
+    for (int i = 0; i < sizeof(chip8->audioPattern); i++) {
+        chip8->audioPattern[i] = chip8->memory[(chip8->indexRegister + i) & chip8->addressMask];
+    }
+}
+
+static inline void op_pitch(chip8_t* chip8, const chip8_op_t* op) { // Fx3A - PITCH Vx - set the audio pattern playback rate to 4000 * 2 ^ ((Vx - 64) / 48) Hz.
+    chip8->pitch = chip8->registers[op->x];
+}
+
+// QUIRK_* variants, chosen by chip8_decode()
+
+static inline void op_or_vf(chip8_t* chip8, const chip8_op_t* op) { // 8xy1 - OR Vx, Vy - set Vx = Vx OR Vy, VF = 0.
+    chip8->registers[op->x] |= chip8->registers[op->y];
+    chip8->registers[0xF] = 0x0;
+}
+
+static inline void op_and_vf(chip8_t* chip8, const chip8_op_t* op) { // 8xy2 - AND Vx, Vy - set Vx = Vx AND Vy, VF = 0.
+    chip8->registers[op->x] &= chip8->registers[op->y];
+    chip8->registers[0xF] = 0x0;
+}
+
+static inline void op_xor_vf(chip8_t* chip8, const chip8_op_t* op) { // 8xy3 - XOR Vx, Vy - set Vx = Vx XOR Vy, VF = 0.
+    chip8->registers[op->x] ^= chip8->registers[op->y];
+    chip8->registers[0xF] = 0x0;
+}
+
+static inline void op_shr_x(chip8_t* chip8, const chip8_op_t* op) { // 8xy6 - SHR Vx - set Vx = Vx SHR 1, VF = bit shifted out.
+    uint8_t flag = chip8->registers[op->x] & 0x1;
+    chip8->registers[op->x] >>= 1;
+    chip8->registers[0xF] = flag;
+}
+
+static inline void op_shl_x(chip8_t* chip8, const chip8_op_t* op) { // 8xyE - SHL Vx - set Vx = Vx SHL 1, VF = bit shifted out.
+    uint8_t flag = chip8->registers[op->x] >> 7;
+    chip8->registers[op->x] <<= 1;
+    chip8->registers[0xF] = flag;
+}
+
+static inline void op_jp_vx(chip8_t* chip8, const chip8_op_t* op) { // Bxnn - JP Vx, addr - jump to location xnn + Vx.
+    chip8->programCounter = op->nnn + chip8->registers[op->x] - 2; // bypass increment
+}
+
+static inline void op_drw_clip(chip8_t* chip8, const chip8_op_t* op) { // Dxyn - DRW Vx, Vy, nibble - same as op_drw, but the sprite is cut off at the screen edges.
+    draw_sprite_clipped(chip8, chip8->registers[op->x], chip8->registers[op->y], op->n);
+    chip8->drawFlag = true;
+}
+
+static inline void op_ld_mem_keep(chip8_t* chip8, const chip8_op_t* op) { // Fx55 - LD [I], Vx - store registers V0 through Vx in memory starting at location I, I is unchanged.
+    for (int i = 0; i <= op->x; i++) {
+        chip8->memory[(chip8->indexRegister + i) & chip8->addressMask] = chip8->registers[i];
+    }
+    chip8_invalidate(chip8, chip8->indexRegister, op->x + 1);
+}
+
+static inline void op_ld_reg_keep(chip8_t* chip8, const chip8_op_t* op) { // Fx65 - LD Vx, [I] - read registers V0 through Vx from memory starting at location I, I is unchanged.
+    for (int i = 0; i <= op->x; i++) {
+        chip8->registers[i] = chip8->memory[(chip8->indexRegister + i) & chip8->addressMask];
+    }
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,273 @@
+/*
+Multi-threaded ROM pool runner
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "pool.h"
+#include "analyze.h"
+#include <errno.h>
+#include <unistd.h>
+
+/*
+Every worker owns a double-ended queue of ROM indices. The owner takes jobs from the tail,
+idle workers steal from the head of somebody else's queue, so the only contention happens
+when a worker runs out of its own work. Each worker keeps one chip8_t and reuses it for every ROM.
+*/
+typedef struct pool_worker {
+    pthread_mutex_t lock;
+    int* jobs;
+    int head;
+    int tail;
+    pthread_t thread;
+    bool started;
+    int id;
+    struct pool* pool;
+    chip8_t chip8;
+} __attribute__((aligned(64))) pool_worker_t;
+
+typedef struct pool {
+    char** paths;
+    pool_result_t* results;
+    pool_options_t* options;
+    pool_worker_t* workers;
+    int threads;
+} pool_t;
+
+static int pool_take(pool_worker_t* worker);
+static int pool_steal(pool_t* pool, pool_worker_t* thief);
+static void* pool_worker_main(void* arg);
+static void pool_execute(pool_worker_t* worker, int job);
+static int pool_report(char** paths, int count, pool_options_t* options);
+
+/*
+Runs [count] ROMs headlessly on a pool of worker threads, filling [results] (one entry per path).
+Returns 0 if every ROM reached the instruction/frame limit, 1 otherwise.
+*/
+int pool_run(char** paths, int count, pool_options_t* options, pool_result_t* results) {
+    pool_t pool;
+    int threads = options->threads;
+    int failed = 0;
+
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > POOL_MAX_THREADS) threads = POOL_MAX_THREADS;
+    if (threads > count) threads = count;
+    if (threads < 1) threads = 1;
+
+    pool.paths = paths;
+    pool.results = results;
+    pool.options = options;
+    pool.threads = threads;
+    pool.workers = aligned_alloc(64, sizeof(pool_worker_t) * threads);
+    if (pool.workers == NULL) { printf("Failed to allocate %i pool workers\n", threads); return 1; }
+    memset(pool.workers, 0x0, sizeof(pool_worker_t) * threads);
+
+    // split jobs into contiguous ranges, stealing evens out the rest
+    for (int i = 0; i < threads; i++) {
+        pool_worker_t* worker = &pool.workers[i];
+        int first = (long)count * i / threads;
+        int last = (long)count * (i + 1) / threads;
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->jobs = malloc(sizeof(int) * (last - first + 1));
+        for (int j = first; j < last; j++) worker->jobs[j - first] = j;
+        worker->head = 0;
+        worker->tail = last - first;
+        worker->id = i;
+        worker->pool = &pool;
+        if (chip8_set_engine(&worker->chip8, options->engine)) printf("Failed to set up execution engine for pool worker %i\n", i);
+    }
+    for (int i = 0; i < threads; i++) {
+        pool.workers[i].started = pthread_create(&pool.workers[i].thread, NULL, pool_worker_main, &pool.workers[i]) == 0;
+        if (!pool.workers[i].started) printf("Failed to start pool worker %i\n", i);
+    }
+    for (int i = 0; i < threads; i++) {
+        if (pool.workers[i].started) pthread_join(pool.workers[i].thread, NULL);
+    }
+    for (int i = 0; i < threads; i++) {
+        if (!pool.workers[i].started) pool_worker_main(&pool.workers[i]); // pick up whatever is left
+        pthread_mutex_destroy(&pool.workers[i].lock);
+        free(pool.workers[i].jobs);
+        chip8_free(&pool.workers[i].chip8);
+    }
+    free(pool.workers);
+
+    for (int i = 0; i < count; i++) {
+        if (results[i].status != POOL_DONE) failed = 1;
+    }
+    return failed;
+}
+
+/*
+Reads ROM paths from [listPath] (one per line, empty lines and lines starting with '#' are skipped),
+runs them with pool_run() and prints per-ROM results followed by aggregate throughput.
+*/
+int pool_run_list(const char* listPath, pool_options_t* options) {
+    char line[POOL_MAX_PATH];
+    char** paths = NULL;
+    int count = 0;
+    int capacity = 0;
+    int status;
+
+    FILE* list = fopen(listPath, "r");
+    if (list == NULL) { printf("Failed to open ROM list \"%s\": %s\n", listPath, strerror(errno)); return 1; }
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            paths = realloc(paths, sizeof(char*) * capacity);
+        }
+        paths[count++] = strdup(line);
+    }
+    fclose(list);
+    if (count == 0) { printf("ROM list \"%s\" is empty\n", listPath); free(paths); return 1; }
+
+    status = pool_report(paths, count, options);
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    return status;
+}
+
+// same as pool_run_list() for every ROM of options->library
+int pool_run_library(pool_options_t* options) {
+    const romlib_t* library = options->library;
+    romlib_rom_t rom;
+    char** names;
+    int status;
+
+    if (library->count == 0) { printf("ROM library is empty\n"); return 1; }
+    if ((names = malloc(sizeof(char*) * library->count)) == NULL) return 1;
+    for (uint32_t i = 0; i < library->count; i++) {
+        romlib_get(library, i, &rom);
+        names[i] = (char*)rom.name;
+    }
+    status = pool_report(names, library->count, options);
+    free(names);
+    return status;
+}
+
+static void* pool_worker_main(void* arg) {
+    pool_worker_t* worker = arg;
+    int job;
+    for (;;) {
+        job = pool_take(worker);
+        if (job < 0) job = pool_steal(worker->pool, worker);
+        if (job < 0) break;
+        pool_execute(worker, job);
+    }
+    return NULL;
+}
+
+// pops a job from the tail of the worker's own queue, -1 if it is empty
+static int pool_take(pool_worker_t* worker) {
+    int job = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->head < worker->tail) job = worker->jobs[--worker->tail];
+    pthread_mutex_unlock(&worker->lock);
+    return job;
+}
+
+// steals a job from the head of another worker's queue, -1 if all queues are empty
+static int pool_steal(pool_t* pool, pool_worker_t* thief) {
+    int job = -1;
+    for (int i = 1; i < pool->threads && job < 0; i++) {
+        pool_worker_t* victim = &pool->workers[(thief->id + i) % pool->threads];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) job = victim->jobs[victim->head++];
+        pthread_mutex_unlock(&victim->lock);
+    }
+    return job;
+}
+
+static void pool_execute(pool_worker_t* worker, int job) {
+    pool_t* pool = worker->pool;
+    pool_result_t* result = &pool->results[job];
+    chip8_t* chip8 = &worker->chip8;
+    struct timespec start, end;
+    int profile = pool->options->profile;
+    int quirks = pool->options->quirks;
+    int clock = -1;
+    romlib_rom_t rom;
+    long length;
+
+    result->path = pool->paths[job];
+    if (pool->options->library != NULL) {
+        romlib_get(pool->options->library, job, &rom);
+        romdb_resolve_entry(rom.known ? &rom.info : NULL, &profile, &quirks, &clock);
+    } else romdb_resolve(pool->options->romdb, result->path, &profile, &quirks, &clock);
+    if (chip8_set_profile(chip8, profile)) {
+        result->status = POOL_ERROR;
+        result->error = ENOMEM;
+        return;
+    }
+    chip8_reset(chip8, quirks);
+    chip8->cpuClock = clock;
+    if (pool->options->library != NULL) length = chip8_load_rom(chip8, rom.data, rom.length);
+    else length = chip8_load_file(chip8, result->path);
+    if (length < 0) {
+        result->status = POOL_ERROR;
+        result->error = errno;
+        return;
+    }
+    if (chip8->blocks != NULL) analyze_preload(chip8, length);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result->status = chip8_run(chip8, pool->options->instructionLimit, pool->options->frameLimit) ? POOL_HALTED : POOL_DONE;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result->elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    result->cycles = chip8->cycles;
+    result->frames = chip8->frames;
+    result->checksum = chip8_checksum(chip8);
+}
+
+// runs [paths] with pool_run() and prints per-ROM results followed by aggregate throughput
+static int pool_report(char** paths, int count, pool_options_t* options) {
+    unsigned long totalCycles = 0;
+    int halted = 0;
+    int errors = 0;
+    struct timespec start, end;
+    double elapsed;
+    int status;
+
+    pool_result_t* results = calloc(count, sizeof(pool_result_t));
+    if (results == NULL) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    status = pool_run(paths, count, options, results);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    for (int i = 0; i < count; i++) {
+        pool_result_t* result = &results[i];
+        switch (result->status) {
+            case POOL_DONE:
+                printf("%s: done, %lu instructions, %lu frames, checksum %08X, %.3f ms\n",
+                       result->path, result->cycles, result->frames, result->checksum, result->elapsed * 1000.0);
+                break;
+            case POOL_HALTED:
+                printf("%s: halted after %lu instructions, %lu frames, checksum %08X, %.3f ms\n",
+                       result->path, result->cycles, result->frames, result->checksum, result->elapsed * 1000.0);
+                halted++;
+                break;
+            case POOL_ERROR:
+                printf("%s: failed to load: %s\n", result->path, strerror(result->error));
+                errors++;
+                break;
+        }
+        totalCycles += result->cycles;
+    }
+    printf("\n%i ROMs (%i halted, %i failed to load), %lu instructions in %.3f ms (%.0f instructions/s)\n",
+           count, halted, errors, totalCycles, elapsed * 1000.0, elapsed > 0 ? (double)totalCycles / elapsed : 0.0);
+    free(results);
+    return status;
+}
@@ -0,0 +1,58 @@
+/*
+Header file for the multi-threaded ROM pool runner
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "cpu.h"
+#include "romdb.h"
+#include "romlib.h"
+#include <pthread.h>
+
+#define POOL_MAX_THREADS 256
+#define POOL_MAX_PATH 4096
+
+typedef enum pool_status {
+    POOL_DONE,   // instruction/frame limit reached
+    POOL_HALTED, // CPU halted before reaching the limit
+    POOL_ERROR   // ROM could not be loaded
+} pool_status_t;
+
+typedef struct pool_result {
+    const char* path; // ROM name if run from a library
+    pool_status_t status;
+    int error; // errno if status is POOL_ERROR
+    unsigned long cycles;
+    unsigned long frames;
+    uint32_t checksum;
+    double elapsed; // seconds
+} pool_result_t;
+
+typedef struct pool_options {
+    int quirks;  // QUIRK_* bits, or -1 to look them up per ROM, see romdb_resolve()
+    int profile; // chip8_profile_t, or -1 to look it up per ROM
+    const romdb_t* romdb; // NULL to use the defaults for anything not given
+    const romlib_t* library; // if set, ROM i of the library is run instead of paths[i], with the machine, quirks and clock it was packed with
+    unsigned long instructionLimit;
+    unsigned long frameLimit;
+    int threads; // 0 - one per online CPU
+    chip8_engine_t engine;
+} pool_options_t;
+
+int pool_run(char** paths, int count, pool_options_t* options, pool_result_t* results);
+int pool_run_list(const char* listPath, pool_options_t* options);
+int pool_run_library(pool_options_t* options);
+#endif
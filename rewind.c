@@ -0,0 +1,249 @@
+/*
+Rewind buffer
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "rewind.h"
+
+#define SNAPSHOT_SIZE(capacity) (sizeof(chip8_snapshot_t) + (capacity))
+#define ENCODED_MAX(capacity) (SNAPSHOT_SIZE(capacity) * 2 + 16) // every run pair but the first follows 3+ unchanged bytes, counts take at most 2 bytes
+#define ZERO_RUN_MIN 3 // shorter runs of unchanged bytes are copied as part of the literal
+
+static size_t rewind_encode(const uint8_t* delta, size_t length, uint8_t* out);
+static void rewind_apply(uint8_t* target, const uint8_t* in, size_t length);
+static bool rewind_store(chip8_rewind_t* rewind, size_t length);
+static bool rewind_fit(chip8_rewind_t* rewind, uint32_t stateSize);
+static uint8_t* put_varint(uint8_t* out, size_t value);
+static inline uint64_t word_at(const uint8_t* bytes);
+static size_t get_varint(const uint8_t** in);
+
+// [budget] is the size of the delta ring in bytes, [maxFrames] caps the number of frames kept
+chip8_rewind_t* rewind_create(size_t budget, int maxFrames) {
+    chip8_rewind_t* rewind = calloc(1, sizeof(chip8_rewind_t));
+    if (rewind == NULL) return NULL;
+    rewind->budget = budget;
+    rewind->capacity = maxFrames;
+    rewind->buffer = malloc(budget);
+    rewind->entries = malloc(sizeof(rewind_entry_t) * maxFrames);
+    if (rewind->buffer == NULL || rewind->entries == NULL) {
+        rewind_free(rewind);
+        return NULL;
+    }
+    return rewind;
+}
+
+void rewind_free(chip8_rewind_t* rewind) {
+    if (rewind == NULL) return;
+    free(rewind->buffer);
+    free(rewind->entries);
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind->delta);
+    free(rewind->encoded);
+    free(rewind);
+}
+
+void rewind_clear(chip8_rewind_t* rewind) {
+    rewind->head = 0;
+    rewind->first = 0;
+    rewind->count = 0;
+    rewind->hasCurrent = false;
+}
+
+// records the current machine state as the newest frame
+void rewind_push(chip8_rewind_t* rewind, chip8_t* chip8) {
+    chip8_snapshot_t* swap;
+    uint8_t* current;
+    uint8_t* next;
+    size_t length;
+
+    if (!rewind_fit(rewind, chip8_state_size(chip8))) return; // out of memory, the frame isn't recorded
+    current = (uint8_t*)rewind->current;
+    next = (uint8_t*)rewind->next;
+    if (!rewind->hasCurrent) {
+        chip8_snapshot(chip8, rewind->current);
+        rewind->hasCurrent = true;
+        return;
+    }
+    chip8_snapshot(chip8, rewind->next);
+    // past the used part of the bigger snapshot both are zero, see chip8_snapshot()
+    length = offsetof(chip8_snapshot_t, state) + (rewind->current->size > rewind->next->size ? rewind->current->size : rewind->next->size);
+    for (size_t i = 0; i < length; i++) rewind->delta[i] = current[i] ^ next[i];
+    length = rewind_encode(rewind->delta, length, rewind->encoded);
+    if (!rewind_store(rewind, length)) rewind_clear(rewind); // the frame before this one can't be reached anymore
+
+    swap = rewind->current;
+    rewind->current = rewind->next;
+    rewind->next = swap;
+    rewind->hasCurrent = true;
+}
+
+/*
+Steps one frame back: restores the frame before the newest one and drops the newest.
+Returns 1 if there is no older frame, or it can't be restored, see chip8_restore().
+*/
+int rewind_pop(chip8_rewind_t* rewind, chip8_t* chip8) {
+    rewind_entry_t* entry;
+    if (rewind->count == 0) return 1;
+
+    entry = &rewind->entries[(rewind->first + rewind->count - 1) % rewind->capacity];
+    rewind_apply((uint8_t*)rewind->current, rewind->buffer + entry->offset, entry->length);
+    rewind->head = entry->offset;
+    rewind->count--;
+    return chip8_restore(chip8, rewind->current) ? 1 : 0;
+}
+
+/*
+Makes sure the snapshots can hold [stateSize] bytes of machine state, sized for the machine instead of
+the biggest profile. Growing them drops the history. Returns false if out of memory.
+*/
+static bool rewind_fit(chip8_rewind_t* rewind, uint32_t stateSize) {
+    if (rewind->current != NULL && rewind->current->capacity >= stateSize) return true;
+    rewind_clear(rewind);
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind->delta);
+    free(rewind->encoded);
+    // calloc in chip8_snapshot_create() keeps the struct padding zeroed, so it never shows up in deltas
+    rewind->current = chip8_snapshot_create(stateSize);
+    rewind->next = chip8_snapshot_create(stateSize);
+    rewind->delta = malloc(SNAPSHOT_SIZE(stateSize));
+    rewind->encoded = malloc(ENCODED_MAX(stateSize));
+    if (rewind->current != NULL && rewind->next != NULL && rewind->delta != NULL && rewind->encoded != NULL) return true;
+    free(rewind->current);
+    free(rewind->next);
+    free(rewind->delta);
+    free(rewind->encoded);
+    rewind->current = rewind->next = NULL;
+    rewind->delta = rewind->encoded = NULL;
+    return false;
+}
+
+// bytes of the ring taken by deltas, from the oldest one to the newest
+size_t rewind_used(chip8_rewind_t* rewind) {
+    rewind_entry_t* oldest = &rewind->entries[rewind->first];
+    if (rewind->count == 0) return 0;
+    if (oldest->offset < rewind->head) return rewind->head - oldest->offset;
+    return rewind->budget - oldest->offset + rewind->head;
+}
+
+/*
+Copies [length] bytes of encoded delta into the ring after the newest one, dropping the oldest deltas
+that are in the way. Deltas are never split, so if one doesn't fit before the end of the ring
+it goes to the start. Returns false if it doesn't fit into the ring at all.
+*/
+static bool rewind_store(chip8_rewind_t* rewind, size_t length) {
+    rewind_entry_t* oldest;
+    rewind_entry_t* entry;
+    if (length > rewind->budget) return false;
+
+    if (rewind->count == rewind->capacity) {
+        rewind->first = (rewind->first + 1) % rewind->capacity;
+        rewind->count--;
+    }
+    if (rewind->head + length > rewind->budget) {
+        // everything between head and the end of the ring is older than the deltas at the start
+        while (rewind->count > 0 && rewind->entries[rewind->first].offset >= rewind->head) {
+            rewind->first = (rewind->first + 1) % rewind->capacity;
+            rewind->count--;
+        }
+        rewind->head = 0;
+    }
+    while (rewind->count > 0) {
+        oldest = &rewind->entries[rewind->first];
+        if (oldest->offset >= rewind->head + length || oldest->offset + oldest->length <= rewind->head) break;
+        rewind->first = (rewind->first + 1) % rewind->capacity;
+        rewind->count--;
+    }
+    if (rewind->count == 0) rewind->first = 0;
+
+    entry = &rewind->entries[(rewind->first + rewind->count) % rewind->capacity];
+    entry->offset = rewind->head;
+    entry->length = length;
+    memcpy(rewind->buffer + rewind->head, rewind->encoded, length);
+    rewind->head += length;
+    rewind->count++;
+    return true;
+}
+
+/*
+Delta encoding: a sequence of (unchanged byte count, changed byte count, changed bytes),
+counts stored as varints. Trailing unchanged bytes are not stored.
+*/
+static size_t rewind_encode(const uint8_t* delta, size_t length, uint8_t* out) {
+    uint8_t* start = out;
+    size_t i = 0;
+    size_t zeros, literal, run;
+
+    while (i < length) {
+        zeros = 0;
+        while (i + zeros + 8 <= length && word_at(delta + i + zeros) == 0) zeros += 8; // most of the snapshot is unchanged
+        while (i + zeros < length && delta[i + zeros] == 0) zeros++;
+        if (i + zeros == length) break;
+        i += zeros;
+        literal = 0;
+        while (i + literal < length) {
+            if (delta[i + literal] != 0) { literal++; continue; }
+            for (run = 0; i + literal + run < length && delta[i + literal + run] == 0 && run < ZERO_RUN_MIN; run++);
+            if (run == ZERO_RUN_MIN || i + literal + run == length) break;
+            literal += run;
+        }
+        out = put_varint(out, zeros);
+        out = put_varint(out, literal);
+        memcpy(out, delta + i, literal);
+        out += literal;
+        i += literal;
+    }
+    return out - start;
+}
+
+// XORs an encoded delta into [target], turning a snapshot into the one it was encoded against
+static void rewind_apply(uint8_t* target, const uint8_t* in, size_t length) {
+    const uint8_t* end = in + length;
+    size_t position = 0;
+    size_t literal;
+
+    while (in < end) {
+        position += get_varint(&in);
+        literal = get_varint(&in);
+        for (size_t i = 0; i < literal; i++) target[position++] ^= *in++;
+    }
+}
+
+static uint8_t* put_varint(uint8_t* out, size_t value) {
+    while (value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+static size_t get_varint(const uint8_t** in) {
+    size_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*in)++;
+        value |= (size_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static inline uint64_t word_at(const uint8_t* bytes) {
+    uint64_t word;
+    memcpy(&word, bytes, sizeof(word));
+    return word;
+}
@@ -0,0 +1,57 @@
+/*
+Header file for the rewind buffer
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef REWIND_H
+#define REWIND_H
+
+#include "state.h"
+
+#define REWIND_BUDGET 1024 // KiB, default
+#define REWIND_MAX_FRAMES (60 * 60 * 5) // 5 minutes at 60 fps, 8 bytes each on top of the budget
+
+typedef struct rewind_entry {
+    uint32_t offset;
+    uint32_t length;
+} rewind_entry_t;
+
+/*
+History of per-frame snapshots. Only the newest snapshot is kept whole; every older frame is stored
+as the XOR of it and the frame after it, run-length encoded, since most of memory and the screen
+don't change between frames. Deltas live in a ring of [budget] bytes, the oldest ones are dropped
+when it fills up.
+*/
+typedef struct chip8_rewind {
+    uint8_t* buffer;
+    size_t budget;
+    size_t head;             // where the next delta goes
+    rewind_entry_t* entries; // circular, oldest at [first]
+    int capacity;
+    int first;
+    int count;
+    chip8_snapshot_t* current; // newest frame
+    chip8_snapshot_t* next;
+    bool hasCurrent;
+    uint8_t* delta; // XOR of two snapshots
+    uint8_t* encoded;
+} chip8_rewind_t;
+
+chip8_rewind_t* rewind_create(size_t budget, int maxFrames);
+void rewind_free(chip8_rewind_t* rewind);
+void rewind_clear(chip8_rewind_t* rewind);
+void rewind_push(chip8_rewind_t* rewind, chip8_t* chip8);
+int rewind_pop(chip8_rewind_t* rewind, chip8_t* chip8);
+size_t rewind_used(chip8_rewind_t* rewind);
+#endif
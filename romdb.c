@@ -0,0 +1,132 @@
+/*
+ROM database
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "romdb.h"
+#include <errno.h>
+#include <ctype.h>
+
+static int compare_entries(const void* a, const void* b);
+static int hash_file(const char* path, uint32_t* hash);
+
+/*
+Loads the database at [path]. Returns NULL with errno set if it can't be read,
+or with a message printed and errno set to EINVAL if a line can't be parsed.
+*/
+romdb_t* romdb_open(const char* path) {
+    char line[256], quirkNames[128], extra[2][16];
+    unsigned int hash;
+    int quirks, profile, clock, fields, capacity = 0;
+    int lineNumber = 0;
+    romdb_entry_t* entries;
+    romdb_t* db;
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return NULL;
+    db = calloc(1, sizeof(romdb_t));
+    if (db == NULL) { fclose(file); return NULL; }
+
+    while (fgets(line, sizeof(line), file)) {
+        lineNumber++;
+        line[strcspn(line, "#")] = '\0';
+        fields = sscanf(line, "%X %127s %15s %15s", &hash, quirkNames, extra[0], extra[1]);
+        if (fields <= 0) continue; // blank or comment
+        if (fields < 2 || (quirks = chip8_parse_quirks(quirkNames)) < 0) goto invalid;
+        profile = -1;
+        clock = 0;
+        for (int i = 0; i < fields - 2; i++) { // machine and clock, in any order
+            if (isdigit((unsigned char)extra[i][0])) {
+                if (clock != 0 || (clock = atoi(extra[i])) <= 0) goto invalid;
+            } else if (profile >= 0 || (profile = chip8_find_profile(extra[i])) < 0) goto invalid;
+        }
+        if (db->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            if ((entries = realloc(db->entries, sizeof(romdb_entry_t) * capacity)) == NULL) { fclose(file); romdb_free(db); return NULL; }
+            db->entries = entries;
+        }
+        db->entries[db->count++] = (romdb_entry_t){ hash, profile, quirks, clock };
+    }
+    fclose(file);
+    if (db->count > 0) qsort(db->entries, db->count, sizeof(romdb_entry_t), compare_entries);
+    return db;
+
+invalid:
+    printf("Invalid ROM database \"%s\" at line %i\n", path, lineNumber);
+    fclose(file);
+    romdb_free(db);
+    errno = EINVAL;
+    return NULL;
+}
+
+// returns the entry for the ROM with [hash], or NULL if there is none
+const romdb_entry_t* romdb_find(const romdb_t* db, uint32_t hash) {
+    romdb_entry_t key = { .hash = hash };
+    if (db == NULL || db->count == 0) return NULL;
+    return bsearch(&key, db->entries, db->count, sizeof(romdb_entry_t), compare_entries);
+}
+
+/*
+Fills in whichever of [profile], [quirks] and [clock] is still -1 (not given by the user):
+from the entry for the ROM at [romPath] if [db] has one, otherwise with plain CHIP-8,
+the default quirks of the machine and CPU_CLOCK. Returns true if an entry was used.
+*/
+bool romdb_resolve(const romdb_t* db, const char* romPath, int* profile, int* quirks, int* clock) {
+    const romdb_entry_t* entry = NULL;
+    uint32_t hash;
+    if ((*profile < 0 || *quirks < 0 || *clock < 0) && db != NULL && hash_file(romPath, &hash) == 0) entry = romdb_find(db, hash);
+    romdb_resolve_entry(entry, profile, quirks, clock);
+    return entry != NULL;
+}
+
+// same as romdb_resolve() for an entry that was already looked up, [entry] may be NULL
+void romdb_resolve_entry(const romdb_entry_t* entry, int* profile, int* quirks, int* clock) {
+    if (*profile < 0) *profile = entry != NULL && entry->profile >= 0 ? entry->profile : PROFILE_CHIP8;
+    if (*quirks < 0) *quirks = entry != NULL ? entry->quirks : chip8_default_quirks(*profile);
+    if (*clock < 0) *clock = entry != NULL && entry->clock > 0 ? entry->clock : CPU_CLOCK;
+}
+
+// FNV-1a, identifies a ROM by its content
+uint32_t romdb_hash(const uint8_t* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+void romdb_free(romdb_t* db) {
+    if (db == NULL) return;
+    free(db->entries);
+    free(db);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    uint32_t x = ((const romdb_entry_t*)a)->hash, y = ((const romdb_entry_t*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// hashes the file at [path] like romdb_hash(), returns 0 on success or -1 with errno set
+static int hash_file(const char* path, uint32_t* hash) {
+    uint8_t buffer[4096];
+    size_t length;
+    uint32_t value = 2166136261u;
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return -1;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        for (size_t i = 0; i < length; i++) value = (value ^ buffer[i]) * 16777619u;
+    }
+    if (ferror(file)) { fclose(file); return -1; }
+    fclose(file);
+    *hash = value;
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+Header file for the ROM database
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROMDB_H
+#define ROMDB_H
+
+#include "cpu.h"
+
+#define ROMDB_PATH "res/romdb.txt"
+
+typedef struct romdb_entry {
+    uint32_t hash;  // romdb_hash() of the ROM file
+    int profile;    // chip8_profile_t, -1 if the entry doesn't name one
+    uint8_t quirks;
+    int clock;      // instructions per second, 0 if the entry doesn't give one
+} romdb_entry_t;
+
+/*
+Machine and quirks per ROM, keyed by content hash, so they can be picked without asking the user.
+Text file, one ROM per line, blank lines and # comments are ignored:
+    <hash, hex> <quirks, see chip8_parse_quirks()> [chip8|schip|xochip] [clock, Hz]
+*/
+typedef struct romdb {
+    romdb_entry_t* entries; // sorted by hash
+    int count;
+} romdb_t;
+
+romdb_t* romdb_open(const char* path);
+const romdb_entry_t* romdb_find(const romdb_t* db, uint32_t hash);
+bool romdb_resolve(const romdb_t* db, const char* romPath, int* profile, int* quirks, int* clock);
+void romdb_resolve_entry(const romdb_entry_t* entry, int* profile, int* quirks, int* clock);
+uint32_t romdb_hash(const uint8_t* data, size_t length);
+void romdb_free(romdb_t* db);
+#endif
@@ -0,0 +1,314 @@
+/*
+Packed ROM library
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "romlib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+Pack file layout, all values little-endian:
+    magic "C8PK", version (1 byte), 3 reserved bytes, ROM count (4), names offset (4), data offset (4), file size (4)
+    one entry per ROM, sorted by hash:
+        hash (4), data offset (4), length (4), name offset from the names (4), clock (4),
+        profile (1, 0xFF if none), quirks (1), flags (1, bit 0 set if the ROM database had an entry), reserved (1)
+    NUL-terminated names
+    ROM data
+*/
+#define ROMLIB_HEADER_SIZE 24
+#define ROMLIB_ENTRY_SIZE 24
+#define ROMLIB_KNOWN 0x01
+#define ROMLIB_MAX_PATH 4096
+
+typedef struct romlib_item {
+    char* name;
+    uint8_t* data;
+    uint32_t length;
+    uint32_t hash;
+} romlib_item_t;
+
+static int collect_paths(const char* sourcePath, char*** paths, bool* directory);
+static int read_rom(const char* path, romlib_item_t* item);
+static int compare_items(const void* a, const void* b);
+static int compare_paths(const void* a, const void* b);
+static uint8_t* put(uint8_t* out, uint64_t value, int bytes);
+static uint32_t get(const uint8_t* in, int bytes);
+
+/*
+Maps the pack at [path]. Returns NULL with errno set if it can't be mapped,
+or EINVAL if it is not a pack of this version or any entry points outside of it.
+*/
+romlib_t* romlib_open(const char* path) {
+    struct stat info;
+    romlib_t* library;
+    uint32_t namesOffset, dataOffset;
+    const uint8_t* entry;
+    void* map;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &info) != 0) { close(fd); return NULL; }
+    if (info.st_size < ROMLIB_HEADER_SIZE || info.st_size > UINT32_MAX) { close(fd); errno = EINVAL; return NULL; }
+    map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    if ((library = calloc(1, sizeof(romlib_t))) == NULL) { munmap(map, info.st_size); return NULL; }
+    library->map = map;
+    library->size = info.st_size;
+
+    library->count = get(library->map + 8, 4);
+    namesOffset = get(library->map + 12, 4);
+    dataOffset = get(library->map + 16, 4);
+    if (memcmp(library->map, ROMLIB_MAGIC, 4) != 0 || library->map[4] != ROMLIB_VERSION || get(library->map + 20, 4) != library->size ||
+        namesOffset != ROMLIB_HEADER_SIZE + (uint64_t)library->count * ROMLIB_ENTRY_SIZE || dataOffset < namesOffset || dataOffset > library->size ||
+        (dataOffset > namesOffset && library->map[dataOffset - 1] != '\0')) goto invalid;
+    library->entries = library->map + ROMLIB_HEADER_SIZE;
+    library->names = (const char*)library->map + namesOffset;
+
+    // checked once here, so romlib_get() can't fail
+    for (uint32_t i = 0; i < library->count; i++) {
+        entry = library->entries + (size_t)i * ROMLIB_ENTRY_SIZE;
+        if (get(entry + 12, 4) >= dataOffset - namesOffset || get(entry + 8, 4) > ROMLIB_MAX_ROM ||
+            get(entry + 4, 4) < dataOffset || (uint64_t)get(entry + 4, 4) + get(entry + 8, 4) > library->size ||
+            (i > 0 && get(entry, 4) <= get(entry - ROMLIB_ENTRY_SIZE, 4))) goto invalid;
+    }
+    return library;
+
+invalid:
+    romlib_close(library);
+    errno = EINVAL;
+    return NULL;
+}
+
+void romlib_get(const romlib_t* library, uint32_t index, romlib_rom_t* rom) {
+    const uint8_t* entry = library->entries + (size_t)index * ROMLIB_ENTRY_SIZE;
+    uint8_t profile = entry[20];
+    rom->info.hash = get(entry, 4);
+    rom->data = library->map + get(entry + 4, 4);
+    rom->length = get(entry + 8, 4);
+    rom->name = library->names + get(entry + 12, 4);
+    rom->info.clock = get(entry + 16, 4);
+    rom->info.profile = profile < PROFILE_COUNT ? profile : -1;
+    rom->info.quirks = entry[21];
+    rom->known = entry[22] & ROMLIB_KNOWN;
+}
+
+// returns the index of the ROM with [hash], or -1 if the library doesn't have it
+int romlib_find(const romlib_t* library, uint32_t hash) {
+    uint32_t low = 0, high = library->count, middle, value;
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        value = get(library->entries + (size_t)middle * ROMLIB_ENTRY_SIZE, 4);
+        if (value == hash) return middle;
+        if (value < hash) low = middle + 1;
+        else high = middle;
+    }
+    return -1;
+}
+
+// returns the index of the ROM named [key], or with [key] as its hash in hex, -1 if there is none
+int romlib_lookup(const romlib_t* library, const char* key) {
+    romlib_rom_t rom;
+    char* end;
+    unsigned long hash;
+    for (uint32_t i = 0; i < library->count; i++) {
+        romlib_get(library, i, &rom);
+        if (strcmp(rom.name, key) == 0) return i;
+    }
+    hash = strtoul(key, &end, 16);
+    if (*key == '\0' || *end != '\0' || hash > UINT32_MAX) return -1;
+    return romlib_find(library, hash);
+}
+
+/*
+Packs every ROM in the directory [sourcePath], or listed in the file [sourcePath] (one path per line,
+empty lines and lines starting with '#' are skipped), into a new pack at [packPath].
+Identical ROMs are only stored once. Machine, quirks and clock are taken from [db], which may be NULL.
+Prints what was done, returns 0 on success or 1 if the pack couldn't be written.
+*/
+int romlib_build(const char* packPath, const char* sourcePath, const romdb_t* db) {
+    char** paths = NULL;
+    char path[ROMLIB_MAX_PATH];
+    romlib_item_t* items;
+    const romdb_entry_t* info;
+    bool directory;
+    int pathCount, count = 0, kept = 0, known = 0, skipped = 0;
+    uint32_t namesSize = 0, dataSize = 0, namesOffset, dataOffset, nameOffset, offset;
+    uint8_t header[ROMLIB_HEADER_SIZE], entry[ROMLIB_ENTRY_SIZE];
+    FILE* file;
+    int status = 1;
+
+    if ((pathCount = collect_paths(sourcePath, &paths, &directory)) < 0) { printf("Failed to read \"%s\": %s\n", sourcePath, strerror(errno)); return 1; }
+    if ((items = calloc(pathCount + 1, sizeof(romlib_item_t))) == NULL) goto done;
+    for (int i = 0; i < pathCount; i++) {
+        if (directory) snprintf(path, sizeof(path), "%s/%s", sourcePath, paths[i]);
+        else snprintf(path, sizeof(path), "%s", paths[i]);
+        if (read_rom(path, &items[count])) {
+            printf("Skipping \"%s\": %s\n", path, strerror(errno));
+            skipped++;
+            continue;
+        }
+        items[count++].name = paths[i];
+    }
+    qsort(items, count, sizeof(romlib_item_t), compare_items);
+
+    // identical ROMs end up next to each other, one of them is kept
+    for (int i = 0; i < count; i++) {
+        if (kept > 0 && items[kept - 1].hash == items[i].hash) {
+            if (items[kept - 1].length != items[i].length || memcmp(items[kept - 1].data, items[i].data, items[i].length) != 0) {
+                printf("Skipping \"%s\": hash %08X is already taken by \"%s\"\n", items[i].name, items[i].hash, items[kept - 1].name);
+            } else printf("Skipping \"%s\": same as \"%s\"\n", items[i].name, items[kept - 1].name);
+            free(items[i].data);
+            skipped++;
+        } else items[kept++] = items[i];
+    }
+    count = kept;
+    for (int i = 0; i < count; i++) {
+        namesSize += strlen(items[i].name) + 1;
+        dataSize += items[i].length;
+    }
+    namesOffset = ROMLIB_HEADER_SIZE + count * ROMLIB_ENTRY_SIZE;
+    dataOffset = namesOffset + namesSize;
+
+    if ((file = fopen(packPath, "wb")) == NULL) { printf("Failed to create \"%s\": %s\n", packPath, strerror(errno)); goto done; }
+    memset(header, 0x0, sizeof(header));
+    memcpy(header, ROMLIB_MAGIC, 4);
+    header[4] = ROMLIB_VERSION;
+    put(put(put(put(header + 8, count, 4), namesOffset, 4), dataOffset, 4), dataOffset + dataSize, 4);
+    status = fwrite(header, 1, sizeof(header), file) != sizeof(header);
+    nameOffset = 0;
+    offset = dataOffset;
+    for (int i = 0; i < count && !status; i++) {
+        info = romdb_find(db, items[i].hash);
+        memset(entry, 0x0, sizeof(entry));
+        put(put(put(put(entry, items[i].hash, 4), offset, 4), items[i].length, 4), nameOffset, 4);
+        if (info != NULL) {
+            put(entry + 16, info->clock, 4);
+            entry[20] = info->profile >= 0 ? info->profile : 0xFF;
+            entry[21] = info->quirks;
+            entry[22] = ROMLIB_KNOWN;
+            known++;
+        } else entry[20] = 0xFF;
+        status = fwrite(entry, 1, sizeof(entry), file) != sizeof(entry);
+        nameOffset += strlen(items[i].name) + 1;
+        offset += items[i].length;
+    }
+    for (int i = 0; i < count && !status; i++) status = fwrite(items[i].name, 1, strlen(items[i].name) + 1, file) != strlen(items[i].name) + 1;
+    for (int i = 0; i < count && !status; i++) status = fwrite(items[i].data, 1, items[i].length, file) != items[i].length;
+    if (fclose(file) != 0) status = 1;
+    if (status) printf("Failed to write \"%s\": %s\n", packPath, strerror(errno));
+    else printf("Packed %i ROMs (%i in the ROM database, %i skipped), %u bytes of ROM data, to \"%s\"\n", count, known, skipped, dataSize, packPath);
+
+done:
+    for (int i = 0; items != NULL && i < count; i++) free(items[i].data);
+    for (int i = 0; i < pathCount; i++) free(paths[i]);
+    free(items);
+    free(paths);
+    return status;
+}
+
+void romlib_close(romlib_t* library) {
+    if (library == NULL) return;
+    munmap((void*)library->map, library->size);
+    free(library);
+}
+
+/*
+Fills [paths] with the names of the regular files in the directory [sourcePath] in alphabetical order,
+or with the paths listed in the file [sourcePath]. Returns the number of paths, or -1 with errno set.
+*/
+static int collect_paths(const char* sourcePath, char*** paths, bool* directory) {
+    char line[ROMLIB_MAX_PATH];
+    struct dirent* file;
+    struct stat info;
+    char** grown;
+    int count = 0, capacity = 0;
+    DIR* dir = NULL;
+    FILE* list = NULL;
+
+    *paths = NULL;
+    if (stat(sourcePath, &info) != 0) return -1;
+    *directory = S_ISDIR(info.st_mode);
+    if (*directory ? (dir = opendir(sourcePath)) == NULL : (list = fopen(sourcePath, "r")) == NULL) return -1;
+    for (;;) {
+        if (*directory) {
+            if ((file = readdir(dir)) == NULL) break;
+            if (file->d_name[0] == '.') continue;
+            snprintf(line, sizeof(line), "%s/%s", sourcePath, file->d_name);
+            if (stat(line, &info) != 0 || !S_ISREG(info.st_mode)) continue;
+            snprintf(line, sizeof(line), "%s", file->d_name);
+        } else {
+            if (!fgets(line, sizeof(line), list)) break;
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0' || line[0] == '#') continue;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            if ((grown = realloc(*paths, sizeof(char*) * capacity)) == NULL) break;
+            *paths = grown;
+        }
+        if (((*paths)[count] = strdup(line)) == NULL) break;
+        count++;
+    }
+    if (dir != NULL) closedir(dir);
+    if (list != NULL) fclose(list);
+    if (*directory && count > 0) qsort(*paths, count, sizeof(char*), compare_paths);
+    return count;
+}
+
+// reads the ROM file at [path] into [item], returns 0 on success or 1 with errno set, EFBIG if it doesn't fit any machine
+static int read_rom(const char* path, romlib_item_t* item) {
+    FILE* file = fopen(path, "rb");
+    uint8_t* shrunk;
+    size_t length;
+    if (file == NULL) return 1;
+    if ((item->data = malloc(ROMLIB_MAX_ROM + 1)) == NULL) { fclose(file); return 1; }
+    length = fread(item->data, 1, ROMLIB_MAX_ROM + 1, file);
+    if (ferror(file) || length > ROMLIB_MAX_ROM) {
+        if (!ferror(file)) errno = EFBIG;
+        fclose(file);
+        free(item->data);
+        return 1;
+    }
+    fclose(file);
+    if ((shrunk = realloc(item->data, length > 0 ? length : 1)) != NULL) item->data = shrunk;
+    item->length = length;
+    item->hash = romdb_hash(item->data, length);
+    return 0;
+}
+
+static int compare_items(const void* a, const void* b) {
+    uint32_t x = ((const romlib_item_t*)a)->hash, y = ((const romlib_item_t*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static uint8_t* put(uint8_t* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) *out++ = value >> (i * 8);
+    return out;
+}
+
+static uint32_t get(const uint8_t* in, int bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint32_t)in[i] << (i * 8);
+    return value;
+}
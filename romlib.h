@@ -0,0 +1,55 @@
+/*
+Header file for the packed ROM library
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ROMLIB_H
+#define ROMLIB_H
+
+#include "cpu.h"
+#include "romdb.h"
+
+#define ROMLIB_MAGIC "C8PK"
+#define ROMLIB_VERSION 1
+#define ROMLIB_MAX_ROM (MEMORY_SIZE - PROGRAM_ADDRESS) // anything bigger doesn't fit any machine
+
+// one ROM of a library, everything points into the mapped pack
+typedef struct romlib_rom {
+    const char* name;    // file the ROM was packed from
+    const uint8_t* data;
+    uint32_t length;
+    romdb_entry_t info;  // hash, plus machine, quirks and clock if [known]
+    bool known;          // the ROM database had an entry for it when the pack was built
+} romlib_rom_t;
+
+/*
+Many ROMs in one file, built once by romlib_build() and then mapped read-only, so loading a ROM
+is a single copy from the mapping instead of opening and reading a file. ROMs are indexed by
+their romdb_hash(), and carry the ROM database entry they had when the pack was built.
+*/
+typedef struct romlib {
+    const uint8_t* map;
+    size_t size;
+    uint32_t count;
+    const uint8_t* entries; // sorted by hash
+    const char* names;
+} romlib_t;
+
+romlib_t* romlib_open(const char* path);
+void romlib_get(const romlib_t* library, uint32_t index, romlib_rom_t* rom);
+int romlib_find(const romlib_t* library, uint32_t hash);
+int romlib_lookup(const romlib_t* library, const char* key);
+int romlib_build(const char* packPath, const char* sourcePath, const romdb_t* db);
+void romlib_close(romlib_t* library);
+#endif
@@ -0,0 +1,244 @@
+/*
+Save states and snapshots
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "state.h"
+#include <errno.h>
+
+/*
+Save state file layout, all values little-endian:
+    magic "C8ST", version (1 byte)
+    V0-VF (16), PC (2), I (2), stack (16 x 2), SP, DT, ST, Fx0A register, Fx0A waiting, halted, QUIRK_* bits (1 each)
+    random number generator state (4)
+    profile, hires, XO-CHIP planes, XO-CHIP pitch (1 each), SUPER-CHIP flags (16), XO-CHIP audio pattern (16)
+    memory (4 KB, 64 KB for XO-CHIP)
+    screen (2 planes x 64 rows x 16, leftmost pixel in the most significant bit; 64x32 uses the top left corner)
+    executed instructions (8), emulated frames (8), frame cycle remainder (1), slots left in the current frame (4)
+*/
+#define STATE_PROFILE_OFFSET (5 + 16 + 2 + 2 + 16 * 2 + 7 + 4)
+#define STATE_HEADER_SIZE (STATE_PROFILE_OFFSET + 4 + 16 + 16)
+#define STATE_TRAILER_SIZE (SCREEN_PLANES * SCREEN_MAX_HEIGHT * SCREEN_WORDS * 8 + 8 + 8 + 1 + 4)
+#define STATE_FILE_SIZE(memorySize) (STATE_HEADER_SIZE + (memorySize) + STATE_TRAILER_SIZE)
+#define STATE_FILE_MAX STATE_FILE_SIZE(MEMORY_SIZE)
+
+static uint8_t* put(uint8_t* out, uint64_t value, int bytes);
+static uint64_t get(const uint8_t** in, int bytes);
+
+// allocates a zeroed snapshot that can hold [capacity] bytes of machine state, chip8_state_size() of the machine it's for
+chip8_snapshot_t* chip8_snapshot_create(uint32_t capacity) {
+    chip8_snapshot_t* snapshot = calloc(1, sizeof(chip8_snapshot_t) + capacity);
+    if (snapshot != NULL) snapshot->capacity = capacity;
+    return snapshot;
+}
+
+// copies the machine state into [snapshot], returns 0 on success or -1 with errno set to ENOSPC if it doesn't fit
+int chip8_snapshot(chip8_t* chip8, chip8_snapshot_t* snapshot) {
+    uint32_t size = chip8_state_size(chip8);
+    if (size > snapshot->capacity) {
+        errno = ENOSPC;
+        return -1;
+    }
+    memcpy(snapshot->state, chip8, size);
+    if (snapshot->size > size) memset(snapshot->state + size, 0x0, snapshot->size - size); // left over from a bigger profile
+    snapshot->size = size;
+    snapshot->cycles = chip8->cycles;
+    snapshot->frames = chip8->frames;
+    snapshot->frameCycles = chip8->frameCycles;
+    snapshot->slotsLeft = chip8->slotsLeft;
+    return 0;
+}
+
+/*
+Replaces the machine state with [snapshot]. If it was taken with the same profile and quirks, only the cached
+code of the memory that differs is dropped. Returns 0 on success or -1 with errno set to ENOMEM if the decode
+cache can't be resized for the profile of [snapshot], with the machine left untouched.
+*/
+int chip8_restore(chip8_t* chip8, const chip8_snapshot_t* snapshot) {
+    uint32_t size = chip8_state_size(chip8);
+    uint8_t profile = snapshot->state[offsetof(chip8_t, profile)];
+    uint8_t quirks = snapshot->state[offsetof(chip8_t, quirks)];
+
+    if (profile == chip8->profile && quirks == chip8->quirks) {
+        // same address space and decoding
+        chip8_replace_memory(chip8, snapshot->state + offsetof(chip8_t, memory));
+        memcpy(chip8, snapshot->state, offsetof(chip8_t, memory));
+    } else {
+        if (profile != chip8->profile) {
+            uint8_t previous = chip8->profile;
+            chip8->profile = profile;
+            if (chip8_size_decode_cache(chip8)) {
+                chip8->profile = previous;
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        memcpy(chip8, snapshot->state, snapshot->size);
+        if (snapshot->size < size) memset((uint8_t*)chip8 + snapshot->size, 0x0, size - snapshot->size); // left over from a bigger profile
+        chip8_flush_caches(chip8);
+    }
+    chip8->cycles = snapshot->cycles;
+    chip8->frames = snapshot->frames;
+    chip8->frameCycles = snapshot->frameCycles;
+    chip8->slotsLeft = snapshot->slotsLeft;
+    chip8->dirtyRows = ~0ULL;
+    chip8->drawFlag = true;
+    return 0;
+}
+
+// writes the machine state to [path], returns 0 on success or -1 with errno set
+int chip8_save_state(chip8_t* chip8, const char* path) {
+    size_t memorySize = chip8->addressMask + 1;
+    size_t size = STATE_FILE_SIZE(memorySize);
+    uint8_t* buffer = malloc(size);
+    uint8_t* out = buffer;
+    FILE* file;
+    int status = -1;
+
+    if (buffer == NULL) return -1;
+
+    memcpy(out, STATE_MAGIC, 4);
+    out += 4;
+    out = put(out, STATE_VERSION, 1);
+    for (int i = 0; i < 16; i++) out = put(out, chip8->registers[i], 1);
+    out = put(out, chip8->programCounter, 2);
+    out = put(out, chip8->indexRegister, 2);
+    for (int i = 0; i < 16; i++) out = put(out, chip8->stack[i], 2);
+    out = put(out, chip8->stackPointer, 1);
+    out = put(out, chip8->delayTimer, 1);
+    out = put(out, chip8->soundTimer, 1);
+    out = put(out, chip8->waitForRegister, 1);
+    out = put(out, chip8->waitForKey, 1);
+    out = put(out, chip8->cpuHalted, 1);
+    out = put(out, chip8->quirks, 1);
+    out = put(out, chip8->rngState, 4);
+    out = put(out, chip8->profile, 1);
+    out = put(out, chip8->hires, 1);
+    out = put(out, chip8->planeMask, 1);
+    out = put(out, chip8->pitch, 1);
+    memcpy(out, chip8->flags, 16);
+    out += 16;
+    memcpy(out, chip8->audioPattern, 16);
+    out += 16;
+    memcpy(out, chip8->memory, memorySize);
+    out += memorySize;
+    for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+        for (int y = 0; y < SCREEN_MAX_HEIGHT; y++) {
+            for (int word = 0; word < SCREEN_WORDS; word++) out = put(out, chip8->screen[plane][y][word], 8);
+        }
+    }
+    out = put(out, chip8->cycles, 8);
+    out = put(out, chip8->frames, 8);
+    out = put(out, chip8->frameCycles, 1);
+    out = put(out, chip8->slotsLeft, 4);
+
+    file = fopen(path, "wb");
+    if (file != NULL) {
+        status = fwrite(buffer, 1, size, file) == size ? 0 : -1;
+        if (fclose(file) != 0) status = -1;
+    }
+    free(buffer);
+    return status;
+}
+
+/*
+Replaces the machine state with the one saved in [path].
+Returns 0 on success or -1 with errno set, EINVAL if the file is not a save state of this version.
+The machine is left untouched on failure.
+*/
+int chip8_load_state(chip8_t* chip8, const char* path) {
+    uint8_t* buffer;
+    const uint8_t* in;
+    size_t length, memorySize;
+    uint8_t profile;
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return -1;
+    buffer = malloc(STATE_FILE_MAX + 1);
+    if (buffer == NULL) { fclose(file); return -1; }
+    length = fread(buffer, 1, STATE_FILE_MAX + 1, file);
+    fclose(file);
+    profile = length > STATE_PROFILE_OFFSET ? buffer[STATE_PROFILE_OFFSET] : PROFILE_COUNT; // decides the expected size
+    memorySize = profile == PROFILE_XOCHIP ? MEMORY_SIZE : 0x1000;
+    if (length != STATE_FILE_SIZE(memorySize) || profile >= PROFILE_COUNT ||
+        memcmp(buffer, STATE_MAGIC, 4) != 0 || buffer[4] != STATE_VERSION) {
+        free(buffer);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (profile != chip8->profile) { // the decode cache is sized for the profile
+        uint8_t previous = chip8->profile;
+        chip8->profile = profile;
+        if (chip8_size_decode_cache(chip8)) {
+            chip8->profile = previous;
+            free(buffer);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    in = buffer + 5;
+    for (int i = 0; i < 16; i++) chip8->registers[i] = get(&in, 1);
+    chip8->programCounter = get(&in, 2);
+    chip8->indexRegister = get(&in, 2);
+    for (int i = 0; i < 16; i++) chip8->stack[i] = get(&in, 2);
+    chip8->stackPointer = get(&in, 1);
+    chip8->delayTimer = get(&in, 1);
+    chip8->soundTimer = get(&in, 1);
+    chip8->waitForRegister = get(&in, 1) & 0xF;
+    chip8->waitForKey = get(&in, 1);
+    chip8->cpuHalted = get(&in, 1);
+    chip8->quirks = get(&in, 1);
+    chip8->rngState = get(&in, 4);
+    if (chip8->rngState == 0) chip8->rngState = 1;
+    chip8->profile = get(&in, 1);
+    chip8->addressMask = memorySize - 1;
+    chip8->hires = get(&in, 1) && chip8->profile != PROFILE_CHIP8;
+    chip8->planeMask = get(&in, 1) & 0x3;
+    chip8->pitch = get(&in, 1);
+    memcpy(chip8->flags, in, 16);
+    in += 16;
+    memcpy(chip8->audioPattern, in, 16);
+    in += 16;
+    memcpy(chip8->memory, in, memorySize);
+    memset(chip8->memory + memorySize, 0x0, MEMORY_SIZE - memorySize);
+    in += memorySize;
+    for (int plane = 0; plane < SCREEN_PLANES; plane++) {
+        for (int y = 0; y < SCREEN_MAX_HEIGHT; y++) {
+            for (int word = 0; word < SCREEN_WORDS; word++) chip8->screen[plane][y][word] = get(&in, 8);
+        }
+    }
+    chip8->cycles = get(&in, 8);
+    chip8->frames = get(&in, 8);
+    chip8->frameCycles = get(&in, 1) % TIMER_CLOCK;
+    chip8->slotsLeft = get(&in, 4) & 0x7FFFFFFF;
+    free(buffer);
+
+    chip8_flush_caches(chip8);
+    chip8->dirtyRows = ~0ULL;
+    chip8->drawFlag = true;
+    return 0;
+}
+
+static uint8_t* put(uint8_t* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) *out++ = value >> (i * 8);
+    return out;
+}
+
+static uint64_t get(const uint8_t** in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t)*(*in)++ << (i * 8);
+    return value;
+}
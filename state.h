@@ -0,0 +1,52 @@
+/*
+Header file for save states and snapshots
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATE_H
+#define STATE_H
+
+#include "cpu.h"
+#include <stddef.h>
+
+#define CHIP8_STATE_SIZE offsetof(chip8_t, drawFlag) // registers up to and including memory
+#define STATE_MAGIC "C8ST"
+#define STATE_VERSION 5
+
+/*
+In-memory copy of a running machine. Taking one is a single memcpy of the machine state. Restoring one
+copies the state back and drops only the decoded instructions and blocks of the memory that changed,
+so a warmed-up machine can be forked or rewound cheaply.
+Only the address space of the machine's profile is copied, the rest of [state] is kept zeroed.
+Snapshots are only valid within one build; use chip8_save_state() for anything stored.
+*/
+typedef struct chip8_snapshot {
+    unsigned long cycles;
+    unsigned long frames;
+    int frameCycles;
+    int slotsLeft;
+    uint32_t size;     // bytes of [state] in use
+    uint32_t capacity; // bytes [state] can hold, see chip8_snapshot_create()
+    uint8_t state[];
+} chip8_snapshot_t;
+
+// bytes of the machine state a snapshot of [chip8] holds
+static inline uint32_t chip8_state_size(const chip8_t* chip8) { return offsetof(chip8_t, memory) + chip8->addressMask + 1; }
+
+chip8_snapshot_t* chip8_snapshot_create(uint32_t capacity);
+int chip8_snapshot(chip8_t* chip8, chip8_snapshot_t* snapshot);
+int chip8_restore(chip8_t* chip8, const chip8_snapshot_t* snapshot);
+int chip8_save_state(chip8_t* chip8, const char* path);
+int chip8_load_state(chip8_t* chip8, const char* path);
+#endif
@@ -0,0 +1,146 @@
+/*
+Execution tracing
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TRACE_IDLE_NS 100000 // writer sleep while the ring is empty, a full ring lasts about a millisecond at full speed
+
+static void* trace_writer_main(void* arg);
+static int trace_write(chip8_trace_t* trace, const void* data, size_t length);
+static int trace_map(chip8_trace_t* trace, off_t offset);
+
+/*
+Creates the trace file at [path], writes the header for a machine with [profile] and [quirks] and starts the writer thread.
+Records are only added once chip8->trace is set to the result. Returns NULL (with a message printed) on failure.
+*/
+chip8_trace_t* trace_open(const char* path, chip8_profile_t profile, uint8_t quirks) {
+    trace_header_t header = { .magic = TRACE_MAGIC, .version = TRACE_VERSION, .recordSize = sizeof(trace_record_t),
+                              .byteOrder = 0x0102, .profile = profile, .quirks = quirks };
+    chip8_trace_t* trace = aligned_alloc(64, sizeof(chip8_trace_t));
+    if (trace == NULL) { printf("Failed to allocate trace buffer\n"); return NULL; }
+    memset(trace, 0x0, sizeof(chip8_trace_t));
+    trace->path = path;
+    trace->map = MAP_FAILED;
+
+    if ((trace->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        printf("Failed to create trace \"%s\": %s\n", path, strerror(errno));
+        free(trace);
+        return NULL;
+    }
+    if (trace_map(trace, 0) || trace_write(trace, &header, sizeof(header))) {
+        printf("Failed to write trace \"%s\": %s\n", path, strerror(errno));
+        close(trace->fd);
+        free(trace);
+        return NULL;
+    }
+    if (pthread_create(&trace->writer, NULL, trace_writer_main, trace) != 0) {
+        printf("Failed to start trace writer\n");
+        munmap(trace->map, TRACE_MAP_SIZE);
+        close(trace->fd);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+/*
+Writes out the records still in the ring, stops the writer and cuts the file to the records written.
+chip8->trace must not point here anymore. Returns 1 (with a message printed) if anything failed to be written.
+*/
+int trace_close(chip8_trace_t* trace) {
+    int status;
+    if (trace == NULL) return 0;
+    __atomic_store_n(&trace->stop, true, __ATOMIC_RELEASE);
+    pthread_join(trace->writer, NULL);
+    status = trace->error != 0;
+    if (trace->map != MAP_FAILED) munmap(trace->map, TRACE_MAP_SIZE);
+    if (ftruncate(trace->fd, trace->size) != 0 && status == 0) { status = 1; trace->error = errno; }
+    if (close(trace->fd) != 0 && status == 0) { status = 1; trace->error = errno; }
+    if (status) printf("Failed to write trace \"%s\": %s\n", trace->path, strerror(trace->error));
+    else printf("Wrote %lu instructions to trace \"%s\" (waited for the writer %lu times)\n",
+                (unsigned long)((trace->size - sizeof(trace_header_t)) / sizeof(trace_record_t)), trace->path, trace->stalls);
+    free(trace);
+    return status;
+}
+
+// called by trace_push() when the ring is full, until the writer frees a slot
+void trace_wait(chip8_trace_t* trace) {
+    trace->stalls++;
+    while (trace->head - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) sched_yield();
+}
+
+/*
+Copies records from the ring to the file until stopped and the ring is empty.
+After a write error records are still taken from the ring, so the emulation thread never blocks, but dropped.
+*/
+static void* trace_writer_main(void* arg) {
+    chip8_trace_t* trace = arg;
+    struct timespec idle = { 0, TRACE_IDLE_NS };
+    uint64_t tail = trace->tail;
+    uint64_t head, count;
+
+    for (;;) {
+        head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (__atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE)) break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        while (tail != head) {
+            // up to the end of the ring, the rest comes from its start on the next pass
+            count = head - tail;
+            if (count > TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1))) count = TRACE_RING_SIZE - (tail & (TRACE_RING_SIZE - 1));
+            if (trace->error == 0 && trace_write(trace, &trace->ring[tail & (TRACE_RING_SIZE - 1)], count * sizeof(trace_record_t))) trace->error = errno;
+            tail += count;
+            __atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+// appends [length] bytes at the end of the file through the mapping, moving it forward when it fills up
+static int trace_write(chip8_trace_t* trace, const void* data, size_t length) {
+    size_t offset, chunk;
+    while (length > 0) {
+        offset = trace->size - trace->mapOffset;
+        if (offset == TRACE_MAP_SIZE) {
+            if (trace_map(trace, trace->mapOffset + TRACE_MAP_SIZE)) return 1;
+            offset = 0;
+        }
+        chunk = length < TRACE_MAP_SIZE - offset ? length : TRACE_MAP_SIZE - offset;
+        memcpy(trace->map + offset, data, chunk);
+        trace->size += chunk;
+        data = (const uint8_t*)data + chunk;
+        length -= chunk;
+    }
+    return 0;
+}
+
+// grows the file and maps TRACE_MAP_SIZE bytes of it at [offset], returns 1 with errno set on failure
+static int trace_map(chip8_trace_t* trace, off_t offset) {
+    if (trace->map != MAP_FAILED) munmap(trace->map, TRACE_MAP_SIZE);
+    trace->map = MAP_FAILED;
+    if (ftruncate(trace->fd, offset + TRACE_MAP_SIZE) != 0) return 1;
+    trace->map = mmap(NULL, TRACE_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, trace->fd, offset);
+    if (trace->map == MAP_FAILED) return 1;
+    trace->mapOffset = offset;
+    return 0;
+}
@@ -0,0 +1,85 @@
+/*
+Header file for execution tracing
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "cpu.h"
+#include <pthread.h>
+
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION 1
+#define TRACE_RING_SIZE 65536         // records, power of two
+#define TRACE_MAP_SIZE (64L << 20)    // bytes of the file mapped at a time, multiple of the page size
+#define TRACE_NO_REGISTER 0xFF
+
+/*
+One executed instruction. Trace files are a trace_header_t followed by these, in execution order,
+in host byte order (the header says which).
+*/
+typedef struct trace_record {
+    uint64_t cycle;   // chip8->cycles before the instruction ran
+    uint16_t pc;
+    uint16_t opcode;  // first two bytes at pc
+    uint16_t index;   // I after the instruction
+    uint8_t reg;      // lowest register the instruction changed (VF only if nothing else changed), or TRACE_NO_REGISTER
+    uint8_t value;    // its new value
+} trace_record_t;
+
+typedef struct trace_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t recordSize;  // sizeof(trace_record_t)
+    uint16_t byteOrder;   // 0x0102 as written by the host
+    uint8_t profile;      // chip8_profile_t
+    uint8_t quirks;
+    uint32_t reserved;
+} trace_header_t;
+
+/*
+Single-producer single-consumer ring: the emulation thread appends records at head, a writer thread
+copies them from tail into the memory-mapped trace file. Both indices only grow and are masked on access,
+so neither side ever takes a lock. If the writer falls a whole ring behind, the emulation thread waits for it,
+so no record is lost.
+Tracing is on while chip8->trace points here, the frontend can clear and restore the pointer at any time.
+*/
+typedef struct chip8_trace {
+    trace_record_t ring[TRACE_RING_SIZE];
+    uint64_t head __attribute__((aligned(64))); // written by the emulation thread
+    uint64_t tail __attribute__((aligned(64))); // written by the writer thread
+    bool stop;
+    unsigned long stalls; // times the emulation thread had to wait for the writer
+    int error;            // errno of the first failed write, records after it are dropped
+    int fd;
+    uint8_t* map;     // window of TRACE_MAP_SIZE bytes at mapOffset
+    off_t mapOffset;
+    off_t size;       // bytes written to the file
+    pthread_t writer;
+    const char* path;
+} chip8_trace_t;
+
+chip8_trace_t* trace_open(const char* path, chip8_profile_t profile, uint8_t quirks);
+int trace_close(chip8_trace_t* trace);
+void trace_wait(chip8_trace_t* trace);
+
+// appends [record], called by the emulation thread only
+static inline void trace_push(chip8_trace_t* trace, const trace_record_t* record) {
+    uint64_t head = trace->head;
+    if (head - __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE) trace_wait(trace);
+    trace->ring[head & (TRACE_RING_SIZE - 1)] = *record;
+    __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,82 @@
+/*
+Trace decoder, prints trace files written with -T as text
+    Copyright (C) 2019 pcm720 <pcm720@gmail.com>
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see
+<http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PC_ANY -1
+
+void print_usage();
+
+int main(int argc, char* argv[]) {
+    unsigned long first = 0, count = 0; // 0 - all of them
+    long pc = PC_ANY;
+    const trace_header_t* header;
+    const trace_record_t* records;
+    unsigned long total, printed = 0;
+    struct stat info;
+    uint8_t* data;
+    int fd, opt;
+
+    while ((opt = getopt(argc, argv, "s:n:p:")) != -1) {
+        switch (opt) {
+            case 's': first = strtoul(optarg, NULL, 0); break;
+            case 'n': count = strtoul(optarg, NULL, 0); break;
+            case 'p': pc = strtol(optarg, NULL, 16); break;
+            default: print_usage(); return 1;
+        }
+    }
+    if (optind == argc) { print_usage(); return 1; }
+
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &info) != 0) { printf("Failed to open trace \"%s\": %s\n", argv[optind], strerror(errno)); return 1; }
+    if (info.st_size < sizeof(trace_header_t)) { printf("\"%s\" is not a trace\n", argv[optind]); close(fd); return 1; }
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) { printf("Failed to map trace \"%s\": %s\n", argv[optind], strerror(errno)); return 1; }
+
+    header = (const trace_header_t*)data;
+    if (memcmp(header->magic, TRACE_MAGIC, 4) != 0 || header->version != TRACE_VERSION || header->recordSize != sizeof(trace_record_t) ||
+        header->byteOrder != 0x0102) {
+        printf("\"%s\" is not a trace of version %i written on a host like this one\n", argv[optind], TRACE_VERSION);
+        munmap(data, info.st_size);
+        return 1;
+    }
+    records = (const trace_record_t*)(data + sizeof(trace_header_t));
+    total = (info.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+    printf("# %s, quirks %02X, %lu instructions\n# cycle       PC    opcode  I     register\n",
+           chip8_profile_name(header->profile), header->quirks, total);
+
+    for (unsigned long i = first; i < total && (count == 0 || printed < count); i++) {
+        const trace_record_t* record = &records[i];
+        if (pc != PC_ANY && record->pc != pc) continue;
+        printf("%-12" PRIu64 "  %04X  %04X    %04X", record->cycle, record->pc, record->opcode, record->index);
+        if (record->reg != TRACE_NO_REGISTER) printf("  V%X=%02X", record->reg, record->value);
+        printf("\n");
+        printed++;
+    }
+    munmap(data, info.st_size);
+    return 0;
+}
+
+void print_usage() {
+    printf("chip8trace - prints traces written by chip8emu -T.\nUsage: chip8trace [options] <trace>\n\n"
+           " Options:\n  -s <n>   skip the first n instructions\n  -n <n>   print at most n instructions\n"
+           "  -p <PC>  only print instructions at this address (hex)\n");
+}